@@ -1,4 +1,10 @@
 require 'mkmf'
 abort '* GNU adns library missing.' unless have_library 'adns'
 abort '* GNU adn_ header missing.' unless have_header 'adns.h'
+# optional: ADNS::State#start_io_thread
+have_header 'pthread.h'
+have_header 'sys/eventfd.h'
+have_func 'rb_thread_call_without_gvl', 'ruby/thread.h'
+# optional: USDT probes
+have_header 'sys/sdt.h'
 create_makefile 'adns/adns'
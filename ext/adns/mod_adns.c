@@ -18,32 +18,297 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
 #include <netinet/in.h>
 
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include <ruby/thread.h>
+#endif
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+#define RB_ADNS_IO_THREAD 1
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#endif
+
+/*
+ * USDT (SystemTap/DTrace compatible) probes, provider "ruby_adns". Queries are
+ * identified by the address of their struct, elapsed times are nanoseconds since
+ * submit unless noted otherwise:
+ *
+ *   query__submit(id, owner, type, qflags)
+ *   query__sent(id, type, elapsed)            adns_submit returned
+ *   query__answered(id, owner, type, status, elapsed)
+ *   query__done(id, owner, type, status, elapsed)     answer Hash built
+ *   query__cancel(id, owner, type, elapsed)
+ *   query__wait(id, blocked)                  time spent in Query#wait, id 0 for completed_queries
+ *   parse(type, nrrs, elapsed)                parse_adns_answer
+ *   poll(nready, elapsed)                     select/poll on adns sockets
+ *
+ * Each probe has a semaphore the tracer raises while it is attached. A disabled
+ * probe costs a test of it: its arguments, clock reads included, are only
+ * evaluated when enabled, and submit only reads the clock if a query probe or
+ * the timing hook wants the phases.
+ */
+#ifdef HAVE_SYS_SDT_H
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define RB_ADNS_SEMAPHORE(name) \
+    __extension__ unsigned short ruby_adns_##name##_semaphore \
+    __attribute__((unused)) __attribute__((section(".probes"))) __attribute__((visibility("hidden")))
+RB_ADNS_SEMAPHORE(query__submit);
+RB_ADNS_SEMAPHORE(query__sent);
+RB_ADNS_SEMAPHORE(query__answered);
+RB_ADNS_SEMAPHORE(query__done);
+RB_ADNS_SEMAPHORE(query__cancel);
+RB_ADNS_SEMAPHORE(query__wait);
+RB_ADNS_SEMAPHORE(parse);
+RB_ADNS_SEMAPHORE(poll);
+#define RB_ADNS_PROBE_ENABLED(name)                  __builtin_expect(ruby_adns_##name##_semaphore != 0, 0)
+#define RB_ADNS_PROBE2(name, a1, a2) \
+    do { if (RB_ADNS_PROBE_ENABLED(name)) DTRACE_PROBE2(ruby_adns, name, a1, a2); } while (0)
+#define RB_ADNS_PROBE3(name, a1, a2, a3) \
+    do { if (RB_ADNS_PROBE_ENABLED(name)) DTRACE_PROBE3(ruby_adns, name, a1, a2, a3); } while (0)
+#define RB_ADNS_PROBE4(name, a1, a2, a3, a4) \
+    do { if (RB_ADNS_PROBE_ENABLED(name)) DTRACE_PROBE4(ruby_adns, name, a1, a2, a3, a4); } while (0)
+#define RB_ADNS_PROBE5(name, a1, a2, a3, a4, a5) \
+    do { if (RB_ADNS_PROBE_ENABLED(name)) DTRACE_PROBE5(ruby_adns, name, a1, a2, a3, a4, a5); } while (0)
+#else
+#define RB_ADNS_PROBE_ENABLED(name)                  0
+/* never evaluated, but keeps probe-only locals from warning */
+#define RB_ADNS_PROBE2(name, a1, a2)                 do { if (0) { (void)(a1); (void)(a2); } } while (0)
+#define RB_ADNS_PROBE3(name, a1, a2, a3)             do { if (0) { (void)(a1); (void)(a2); (void)(a3); } } while (0)
+#define RB_ADNS_PROBE4(name, a1, a2, a3, a4)         do { if (0) { (void)(a1); (void)(a2); (void)(a3); (void)(a4); } } while (0)
+#define RB_ADNS_PROBE5(name, a1, a2, a3, a4, a5)     do { if (0) { (void)(a1); (void)(a2); (void)(a3); (void)(a4); (void)(a5); } } while (0)
+#endif
+/* probes reporting the time since submit */
+#define RB_ADNS_QUERY_PROBES_ENABLED() \
+    (RB_ADNS_PROBE_ENABLED(query__sent) || RB_ADNS_PROBE_ENABLED(query__answered) || \
+     RB_ADNS_PROBE_ENABLED(query__done) || RB_ADNS_PROBE_ENABLED(query__cancel))
+
+#ifndef STR2CSTR /* removed in ruby 1.9 */
+#define STR2CSTR(v)     (StringValueCStr(v))
+#endif
+
 #define VERSION         "0.4"
 #define CSTR2STR(cstr)  ((cstr) ? rb_str_new2(cstr) : rb_str_new2(""))
 #define CSTR2SYM(cstr)  (rb_str_intern(CSTR2STR(cstr)))
 #define CHECK_TYPE(v,t) (Check_Type(v, t))
 #define DEFAULT_DIAG_FILEMODE "w"
+#define DEFAULT_RESOLV_CONF   "/etc/resolv.conf"
+#define ADNS_RESOLV_CONF      "/etc/resolv-adns.conf"
+#define RESOLV_CONF_FILES     4   /* see resolv_conf_files */
+#define DEFAULT_NDOTS         1
+#define DEFAULT_CONFIG_CHECK_INTERVAL 5
+#define SLAB_CHUNK_SLOTS      64    /* query structs per slab chunk */
+#define HANDLE_GEN_BITS       (sizeof(uintptr_t) * 4)
+#define HANDLE_GEN_MASK       (((uintptr_t)1 << HANDLE_GEN_BITS) - 1)
+/* slots addressable by the index bits of a handle, 65536 on 32 bit targets */
+#define SLAB_MAX_SLOTS        ((uintptr_t)1 << (sizeof(uintptr_t) * 8 - HANDLE_GEN_BITS))
+#define SHM_MAGIC             "ADNSSHM2"
+#define SHM_WAYS              4     /* slots a key may live in */
+#define DEFAULT_SHM_SLOTS     4096
+#define DEFAULT_SHM_SLOT_SIZE 512
+#define SHM_MAX_DEPTH         8     /* nesting of an encoded answer, see shm_decode */
+
+enum {
+    RB_ADNS_OP_SUBMIT,
+    RB_ADNS_OP_SUBMIT_REVERSE,
+    RB_ADNS_OP_SUBMIT_REVERSE_ANY,
+    RB_ADNS_OP_CANCEL,
+    RB_ADNS_OP_GLOBAL_SYSTEM_FAILURE,
+    RB_ADNS_OP_RECONFIGURE
+};
+
+typedef struct rb_adns_request {
+    struct rb_adns_request *next;   /* io thread submission queue link */
+    int op;                         /* RB_ADNS_OP_* */
+    struct rb_adns_query *query;
+    char *cfgtxt;                   /* RB_ADNS_OP_RECONFIGURE */
+} rb_adns_request_t;
+
+typedef struct {
+    VALUE list;         /* resolv.conf search list, nil until parsed */
+    int ndots;
+} rb_adns_search_t;
+
+typedef struct {
+    double rate;                /* tokens (submissions) per second, 0: unlimited */
+    double burst;               /* bucket size */
+    double tokens;
+    uint64_t last;              /* clock_ns() of the last refill */
+    struct rb_adns_query *head, *tail;  /* submissions waiting for a token, FIFO */
+    long queued;
+    unsigned long throttled;    /* submissions that had to wait */
+    uint64_t throttled_ns;      /* total time they waited */
+} rb_adns_bucket_t;
+
+typedef struct {
+    VALUE cfgtxt;               /* frozen resolv.conf style text for adns_init_strcfg */
+    VALUE path;                 /* file read by new, nil for new2 */
+    adns_initflags iflags;      /* adns_if_noenv keeps LOCALDOMAIN etc. out of cfgtxt */
+    rb_adns_search_t search;
+    unsigned long generation;   /* bumped whenever cfgtxt changes */
+    struct stat st[RESOLV_CONF_FILES];  /* of the files read, see resolv_conf_files */
+    int check_interval;         /* seconds between checks of path on submit, 0: never */
+    time_t next_check;
+} rb_adns_config_t;
+
+/* shared cache file layout: header, then nslots slots of slot_size bytes */
+typedef struct {
+    char magic[8];              /* SHM_MAGIC, written last when the file is set up */
+    uint32_t nslots, slot_size;
+    uint64_t hits, misses, stores, skipped; /* all processes, relaxed atomics */
+    char pad[24];
+} rb_adns_shm_header_t;
+
+typedef struct {
+    uint32_t seq;               /* seqlock: odd while a writer is inside */
+    uint32_t len;               /* bytes used in data: owner, then the encoded answer */
+    uint64_t key;               /* shm_key of (owner, type, qflags), 0: empty */
+    int64_t expires;
+    int32_t type, qflags;
+    uint32_t owner_len, pad;
+    char data[];
+} rb_adns_shm_slot_t;
+
+typedef struct {
+    rb_adns_shm_header_t *header;   /* mmap'ed, MAP_SHARED */
+    size_t size;
+    uint32_t nslots, slot_size;     /* private copies, the header is writable by others */
+    VALUE path;                     /* nil for an anonymous mapping */
+} rb_adns_shm_t;
 
 typedef struct {
     adns_state ads;
     FILE *diagfile;
+    adns_initflags iflags;
+    adns_state retired; /* replaced by a config reload, finished once drained */
+    VALUE cfgtxt;       /* config text given to new2, from config, or read along with adns_init by new */
+    rb_adns_search_t search;
+    VALUE config;       /* ADNS::Config the state was made from, or nil */
+    VALUE timing_hook;  /* called with each answered query and its phase timings, or nil */
+    VALUE shm;          /* ADNS::SharedCache consulted on submit, or nil */
+    VALUE nsorder;      /* nameservers to ask first, see nameservers=, or nil */
+    int reorder_pending;    /* nsorder not applied yet */
+    VALUE hits;         /* Query objects answered but not returned by completed_queries yet:
+                           shared cache hits, and lists a raising timing hook held back */
+    struct rb_adns_slab *slab;  /* query structs */
+    rb_adns_bucket_t bucket;    /* submission rate limit, see set_rate_limit */
+    unsigned long generation; /* of config, when last applied */
+    int iothread;       /* adns is driven by io_thread_main, see start_io_thread */
+    VALUE inflight;     /* io thread mode: Query objects submitted and not yet collected */
+    VALUE selectors;    /* direct mode: threads in adns_select_timeout, see state_wait_selects, or nil */
+    int nselecting;     /* their number, readable without touching Ruby objects */
+#ifdef RB_ADNS_IO_THREAD
+    pthread_t thread;
+    pid_t owner;                        /* process that started the thread, see io_thread_lost */
+    pthread_mutex_t lock;               /* guards query completion fields */
+    pthread_cond_t cond;                /* signalled on every completion */
+    unsigned long ncompleted;
+    unsigned long nfailed, nswept;      /* completions with an ecode, see state_sweep_inflight */
+    int stop, wake_pending;
+    int wakefd[2];                      /* same eventfd twice, or a pipe */
+    rb_adns_request_t *qhead, *qtail;   /* MPSC submission queue, see mpsc_push */
+    rb_adns_request_t qstub;
+    char *pending_cfgtxt;               /* reconfigure once retired has drained */
+    int waiters;                        /* threads in query_wait_iothread, under the GVL */
+    int lock_kept;                      /* lock and cond outlived io_thread_stop, see cState_free */
+#endif
 } rb_adns_state_t;
 
-typedef struct {
+typedef struct rb_adns_query {
+    struct rb_adns_slab *slab;  /* owning slab, see slab_get */
+    long index;                 /* slot number within the slab */
+    unsigned long gen;          /* bumped on release, see slab_handle */
+    struct rb_adns_query *next_free;
+    int in_use;
+    VALUE self;         /* the ADNS::Query wrapping this slot */
+    struct rb_adns_query *tnext, *tprev;    /* rate limiter queue links */
+    int throttled;      /* waiting in the rate limiter queue */
     adns_query adq;
+    adns_state ads;     /* submitted on, rb_ads_r->ads or rb_ads_r->retired */
     rb_adns_state_t *rb_ads_r;
     VALUE answer;
+    VALUE state;        /* keeps rb_ads_r alive */
+    int refcnt;         /* Query object, plus the io thread while in flight */
+    int iothread;       /* submitted through the io thread */
+    int hit;            /* in rb_ads_r->hits */
+    int detached;       /* never returned by completed_queries, see submit_detached */
+    adns_rrtype type;
+    int timed;          /* phases wanted by the timing hook or a probe at submit */
+    uint64_t t_submit, t_sent, t_answered, t_built;  /* clock_ns(), 0 until reached or untimed */
+    /* submission, kept for the io thread or a rate limited submit */
+    int op;
+    char *owner, *zone;
+    struct sockaddr_in addr;
+    adns_queryflags qflags;
+    int ecode;                  /* deferred submit failure, or io thread completion */
+    adns_answer *answer_r;      /* completion set by the io thread, or taken by ready? */
+#ifdef RB_ADNS_IO_THREAD
+    rb_adns_request_t req;
+    pthread_cond_t cond;        /* signalled on completion, under rb_ads_r->lock */
+    int done;
+    int invalid;                /* collected or cancelled on the Ruby side */
+#endif
 } rb_adns_query_t;
 
+typedef struct rb_adns_slab {
+    rb_adns_query_t **chunks;   /* SLAB_CHUNK_SLOTS slots each, never moved */
+    long nchunks, chunks_len;
+    rb_adns_query_t *free_list; /* LIFO: the most recently released slot is reused first */
+    long nused, peak;
+    int refcnt;                 /* the state, plus one per slot in use */
+#ifdef RB_ADNS_IO_THREAD
+    pthread_mutex_t lock;       /* slots are released from the io thread too */
+#endif
+} rb_adns_slab_t;
+
+typedef struct {
+    int priority, weight, port;
+    int order;                  /* position in the answer */
+    unsigned long eweight;      /* selection weight, see SRV_WEIGHT_SCALE */
+    int down;
+    VALUE endpoint;             /* frozen Hash handed out by pick */
+} rb_adns_srv_endpoint_t;
+
+typedef struct {
+    int first, count;           /* slice of the priority sorted endpoints */
+    int up;                     /* endpoints not marked down */
+    unsigned long total;        /* sum of up endpoints' eweight */
+    unsigned long *tree;        /* 1-based Fenwick tree over eweight of up endpoints */
+} rb_adns_srv_group_t;
+
+typedef struct {
+    rb_adns_srv_endpoint_t *endpoints;
+    int nendpoints;
+    rb_adns_srv_group_t *groups;
+    int ngroups;
+    int active;                 /* first group with an up endpoint, ngroups if none */
+    unsigned long *trees;       /* storage behind groups[].tree */
+} rb_adns_srvset_t;
+
 static VALUE mADNS;                 /* ADNS */
 static VALUE mADNS__cState;         /* ADNS::State */
+static VALUE mADNS__cConfig;        /* ADNS::Config */
 static VALUE mADNS__cQuery;         /* ADNS::Query */
+static VALUE mADNS__cSharedCache;   /* ADNS::SharedCache */
+static VALUE mADNS__cSRVSet;        /* ADNS::SRVSet */
 static VALUE mADNS__mRR;            /* ADNS::RR */
 static VALUE mADNS__mStatus;        /* ADNS::Status */
 static VALUE mADNS__mIF;            /* ADNS::IF */
@@ -55,31 +320,184 @@ static VALUE mADNS__eQueryError;    /* ADNS::QueryError */
 static VALUE maDNS__ePermanentError;/* ADNS::PermanentError */
 static VALUE mADNS__eNotReadyError; /* ADNS::NotReadyError */
 
+#ifdef RB_ADNS_IO_THREAD
+static pid_t rb_adns_pid;           /* getpid(), kept current by rb_adns_atfork_child */
+
+static void rb_adns_atfork_child(void)
+{
+    rb_adns_pid = getpid();
+}
+
+/*
+ * fork(2) carries only the calling thread over: in a child the io thread of an
+ * inherited state is gone, its lock may be held for good and nothing that was in
+ * flight ever completes. Such a state only supports finish and being collected.
+ */
+#define io_thread_lost(rb_ads_r) ((rb_ads_r)->owner != rb_adns_pid)
+#endif
+
+static uint64_t clock_ns(void)
+{
+    struct timespec ts;
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct select_args {
+    rb_adns_state_t *rb_ads_r;
+    int maxfds, nready, ecode;
+    fd_set rfds, wfds, efds;
+    struct timeval *timeout;
+};
+
+static void *select_nogvl(void *ptr)
+{
+    struct select_args *args = (struct select_args *)ptr;
+
+    args->nready = select(args->maxfds, &args->rfds, &args->wfds, &args->efds, args->timeout);
+    args->ecode = args->nready == -1 ? errno : 0;
+    return NULL;
+}
+
+static VALUE select_blocking(VALUE ptr)
+{
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    (void) rb_thread_call_without_gvl(select_nogvl, (void *)ptr, RUBY_UBF_IO, NULL);
+#else
+    (void) select_nogvl((void *)ptr);
+#endif
+    return Qnil;
+}
+
+static VALUE select_leave(VALUE ptr)
+{
+    struct select_args *args = (struct select_args *)ptr;
+    VALUE selectors = args->rb_ads_r->selectors;
+    VALUE current = rb_thread_current();
+    long idx;
+
+    args->rb_ads_r->nselecting--;
+    for (idx = RARRAY_LEN(selectors) - 1; idx >= 0; idx--)
+        if (rb_ary_entry(selectors, idx) == current)
+        {
+            (void) rb_ary_delete_at(selectors, idx);
+            break;
+        }
+    return Qnil;
+}
+
+/*
+ * adns_finish must not pull the sockets from under another thread's select: wake the
+ * threads in adns_select_timeout and wait until they are out. The calling thread may be
+ * one of them (a trap handler), it finds the state gone once back.
+ */
+static void state_wait_selects(rb_adns_state_t *rb_ads_r)
+{
+    struct timeval pause = {0, 1000};
+    VALUE current = rb_thread_current();
+    long idx, others;
+
+    while (rb_ads_r->nselecting > 0)
+    {
+        others = 0;
+        for (idx=0; idx < RARRAY_LEN(rb_ads_r->selectors); idx++)
+            if (rb_ary_entry(rb_ads_r->selectors, idx) != current)
+            {
+                (void) rb_thread_wakeup(rb_ary_entry(rb_ads_r->selectors, idx));
+                others++;
+            }
+        if (!others)
+            return;
+        rb_thread_wait_for(pause);
+    }
+}
+
 static void adns_select_timeout(rb_adns_state_t *rb_ads_r, double t)
 {
    /*
-    * select call on adns query IO rather than file descriptors.
+    * select call on adns query IO rather than file descriptors, for at most <t>
+    * seconds (no limit if negative) and no longer than adns' next retransmit.
+    * The GVL is released while waiting where the ruby allows it.
     */
-    struct timeval **tv_mod = NULL, tv_buf, timeout, now;
-    int nfds, maxfds = 0;
-    fd_set rfds, wfds, efds;
-    int ecode;
+    struct select_args args;
+    struct timeval *tv_mod = NULL, tv_buf, timeout, now;
+    adns_state ads = rb_ads_r->ads, retired = rb_ads_r->retired;
+    uint64_t t_poll;
 
-    timeout.tv_sec = t;
-    timeout.tv_usec = 0;
-    ecode = gettimeofday(&now, NULL);
-    if (ecode == -1)
-        rb_raise(mADNS__eError, strerror(ecode));
-    FD_ZERO(&rfds); FD_ZERO(&wfds); FD_ZERO(&efds);
-    adns_beforeselect(rb_ads_r->ads, &maxfds, &rfds, &wfds, &efds,
-                      tv_mod, &tv_buf, &now);
-    ecode = select(maxfds, &rfds, &wfds, &efds, &timeout);
-    if (ecode == -1)
-        rb_raise(mADNS__eError, strerror(ecode));
-    ecode = gettimeofday(&now, NULL);
-    if (ecode == -1)
-        rb_raise(mADNS__eError, strerror(ecode));
-    adns_afterselect(rb_ads_r->ads, maxfds, &rfds, &wfds, &efds, &now);
+    if (t >= 0)
+    {
+        timeout.tv_sec = (time_t) t;
+        timeout.tv_usec = (long) ((t - (time_t) t) * 1e6);
+        tv_mod = &timeout;
+    }
+    if (gettimeofday(&now, NULL) == -1)
+        rb_raise(mADNS__eError, "%s", strerror(errno));
+    args.rb_ads_r = rb_ads_r;
+    args.maxfds = 0;
+    FD_ZERO(&args.rfds); FD_ZERO(&args.wfds); FD_ZERO(&args.efds);
+    adns_beforeselect(ads, &args.maxfds, &args.rfds, &args.wfds, &args.efds, &tv_mod, &tv_buf, &now);
+    if (retired)
+        adns_beforeselect(retired, &args.maxfds, &args.rfds, &args.wfds, &args.efds, &tv_mod, &tv_buf, &now);
+    args.timeout = tv_mod;
+    t_poll = RB_ADNS_PROBE_ENABLED(poll) ? clock_ns() : 0;
+    if (rb_ads_r->selectors == Qnil)
+        rb_ads_r->selectors = rb_ary_new();
+    rb_ary_push(rb_ads_r->selectors, rb_thread_current());
+    rb_ads_r->nselecting++;
+    (void) rb_ensure(select_blocking, (VALUE)&args, select_leave, (VALUE)&args);
+    RB_ADNS_PROBE2(poll, args.nready, clock_ns() - t_poll);
+    if (args.nready == -1)
+    {
+        /* EBADF: finished from a trap handler while we were away, see below */
+        if (args.ecode != EINTR && args.ecode != EBADF)
+            rb_raise(mADNS__eError, "%s", strerror(args.ecode));
+        FD_ZERO(&args.rfds); FD_ZERO(&args.wfds); FD_ZERO(&args.efds);
+    }
+    if (gettimeofday(&now, NULL) == -1)
+        rb_raise(mADNS__eError, "%s", strerror(errno));
+    /* other threads ran meanwhile: a reconfigure may have retired ads, finish dropped both */
+    if (ads && (ads == rb_ads_r->ads || ads == rb_ads_r->retired))
+        adns_afterselect(ads, args.maxfds, &args.rfds, &args.wfds, &args.efds, &now);
+    if (retired && retired == rb_ads_r->retired)
+        adns_afterselect(retired, args.maxfds, &args.rfds, &args.wfds, &args.efds, &now);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_check_ints(); /* Thread#raise, Thread#kill, signals */
+#endif
+}
+
+static int adns_state_busy(adns_state ads)
+{
+    adns_forallqueries_begin(ads);
+    return adns_forallqueries_next(ads, NULL) != NULL;
+}
+
+static void state_reap_retired(rb_adns_state_t *rb_ads_r)
+{
+    if (rb_ads_r->nselecting > 0)
+        return; /* its sockets may be in a select, a later call reaps it */
+    if (rb_ads_r->retired && !adns_state_busy(rb_ads_r->retired))
+    {
+        (void) adns_finish(rb_ads_r->retired);
+        rb_ads_r->retired = NULL;
+    }
+}
+
+static int state_reconfigure(rb_adns_state_t *rb_ads_r, const char *cfgtxt)
+{
+   /*
+    * Swap in a freshly initialized adns state; queries in flight finish on the
+    * old one. Returns 0 if an earlier swap is still draining.
+    */
+    adns_state ads;
+
+    if (rb_ads_r->retired)
+        return 0;
+    if (adns_init_strcfg(&ads, rb_ads_r->iflags, rb_ads_r->diagfile, cfgtxt))
+        return 1; /* keep what we have */
+    rb_ads_r->retired = rb_ads_r->ads;
+    rb_ads_r->ads = ads;
+    state_reap_retired(rb_ads_r);
+    return 1;
 }
 
 /*
@@ -114,691 +532,3905 @@ static VALUE mADNS__status_to_ss(VALUE self, VALUE a1)
     return CSTR2STR(s);
 }
 
-void __rdata_modify(VALUE data)
+static void parse_resolv_conf_line(rb_adns_search_t *search, char *line)
 {
-    struct RData *data_r = (struct RData *)data;
-    long data_len = sizeof(data_r->data);
-    VALUE *ptr = ALLOC_N(VALUE, data_len);
-    MEMCPY(ptr, data_r->data, VALUE, data_len);
+   /*
+    * Only the directives that drive search list expansion are of interest here,
+    * everything else is left for adns to interpret.
+    */
+    char *save, *word = strtok_r(line, " \t\r\n", &save);
+
+    if (!word || *word == '#' || *word == ';')
+        return;
+    if (!strcmp(word, "domain") || !strcmp(word, "search"))
+    {
+        rb_ary_clear(search->list);
+        while ((word = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+            rb_ary_push(search->list, CSTR2STR(word));
+    }
+    else if (!strcmp(word, "options"))
+    {
+        while ((word = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+            if (!strncmp(word, "ndots:", 6))
+                search->ndots = atoi(word + 6);
+    }
 }
-#define RDATA_MODIFY(d) (__rdata_modify(d))
 
-static VALUE parse_adns_rr_addr(adns_rr_addr *addr_r)
+static void parse_resolv_conf_text(rb_adns_search_t *search, const char *text)
 {
-    const char *addr_str = inet_ntoa(addr_r->addr.inet.sin_addr);
-    if (!addr_str)
-        return CSTR2STR("");
-    else
-        return CSTR2STR(addr_str);
+    char *buf = strdup(text), *save, *line;
+
+    if (!buf)
+        rb_raise(rb_eNoMemError, "%s", strerror(errno));
+    for (line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save))
+        parse_resolv_conf_line(search, line);
+    free(buf);
 }
 
-static VALUE parse_adns_rr_hostaddr(adns_rr_hostaddr *hostaddr_r)
+/* Append environment variable <name> to <text>, as a <directive> line or, without one, verbatim. */
+static void resolv_conf_env(VALUE text, const char *name, const char *directive)
 {
-    VALUE rb_hostaddr = rb_hash_new();
-    VALUE host_k = CSTR2SYM("host");
-    VALUE host_v = CSTR2STR(hostaddr_r->host);
-    VALUE status_k = CSTR2SYM("status");
-    VALUE status_v = INT2FIX(hostaddr_r->astatus);
-    VALUE addrs_k = CSTR2SYM("addr");
-    VALUE addrs_v = rb_ary_new();
-    int idx;
-    
-    if (hostaddr_r->naddrs > 0)
-        for (idx=0; idx < hostaddr_r->naddrs; idx++)
-            rb_ary_store(addrs_v, idx, parse_adns_rr_addr(hostaddr_r->addrs+idx));
-
-    rb_hash_aset(rb_hostaddr, host_k, host_v);
-    rb_hash_aset(rb_hostaddr, status_k, status_v);
-    rb_hash_aset(rb_hostaddr, addrs_k, addrs_v);
+    const char *value = getenv(name);
 
-    return rb_hostaddr;
+    if (!value)
+        return;
+    rb_str_cat2(text, "\n");
+    if (directive)
+    {
+        rb_str_cat2(text, directive);
+        rb_str_cat2(text, " ");
+    }
+    rb_str_cat2(text, value);
+    rb_str_cat2(text, "\n");
 }
 
-
-static VALUE parse_adns_rr_soa(adns_rr_soa *soa_r)
+/* The files adns_init() reads, <path> standing in for /etc/resolv.conf; NULL for unset variables. */
+static void resolv_conf_files(const char *path, adns_initflags iflags, const char *files[RESOLV_CONF_FILES])
 {
-    VALUE rb_soa = rb_hash_new();
-    VALUE mname_k   = CSTR2SYM("mname");
-    VALUE mname_v   = CSTR2STR(soa_r->mname);
-    VALUE rname_k   = CSTR2SYM("rname");
-    VALUE rname_v   = CSTR2STR(soa_r->rname);
-    VALUE serial_k  = CSTR2SYM("serial");
-    VALUE serial_v  = INT2FIX(soa_r->serial);
-    VALUE refresh_k = CSTR2SYM("refresh");
-    VALUE refresh_v = INT2FIX(soa_r->refresh);
-    VALUE retry_k   = CSTR2SYM("retry");
-    VALUE retry_v = INT2FIX(soa_r->retry);
-    VALUE minimum_k = CSTR2SYM("minimum");
-    VALUE mimimum_v = INT2FIX(soa_r->minimum);
-    
-    rb_hash_aset(rb_soa, mname_k, mname_v);
-    rb_hash_aset(rb_soa, rname_k, rname_v);
-    rb_hash_aset(rb_soa, serial_k, serial_v);
-    rb_hash_aset(rb_soa, refresh_k, refresh_v);
-    rb_hash_aset(rb_soa, retry_k, retry_v);
-    rb_hash_aset(rb_soa, minimum_k, mimimum_v);
+    int env = !(iflags & adns_if_noenv);
 
-    return rb_soa;
+    files[0] = path;
+    files[1] = ADNS_RESOLV_CONF;
+    files[2] = env ? getenv("RES_CONF") : NULL;
+    files[3] = env ? getenv("ADNS_RES_CONF") : NULL;
 }
 
-
-static VALUE parse_adns_rr_srv(adns_rr_srvraw *srvraw_r, adns_rr_srvha *srvha_r)
+static void resolv_conf_file(VALUE text, const char *path, struct stat *st_r, int strict)
 {
-    VALUE rb_srv = rb_hash_new();
-    VALUE priority_k = CSTR2SYM("priority"), priority_v;
-    VALUE weight_k = CSTR2SYM("weight"), weight_v;
-    VALUE port_k = CSTR2SYM("port"), port_v;
-    VALUE host_k = CSTR2SYM("host"), host_v;
-    VALUE addrs_k = CSTR2SYM("addrs"), addrs_v;
-    
-    if (srvraw_r)
-    {
-        priority_v = INT2FIX(srvraw_r->priority);
-        weight_v = INT2FIX(srvraw_r->weight);
-        port_v = INT2FIX(srvraw_r->port);
-        host_v = CSTR2STR(srvraw_r->host);
-        rb_hash_aset(rb_srv, host_k, host_v);
-    }
-    else if (srvha_r)
+    char buf[4096];
+    size_t len;
+    FILE *fp;
+
+    if (st_r)
+        memset(st_r, 0, sizeof(struct stat));
+    if ((fp = fopen(path, "r")) != NULL)
     {
-        priority_v = INT2FIX(srvha_r->priority);
-        weight_v = INT2FIX(srvha_r->weight);
-        port_v = INT2FIX(srvha_r->port);
-        addrs_v = parse_adns_rr_hostaddr(&srvha_r->ha);
-        rb_hash_aset(rb_srv, addrs_k, addrs_v);
+        if (st_r)
+            (void) fstat(fileno(fp), st_r);
+        rb_str_cat2(text, "\n");
+        while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+            rb_str_cat(text, buf, len);
+        rb_str_cat2(text, "\n");
+        (void) fclose(fp);
     }
-
-    rb_hash_aset(rb_srv, priority_k, priority_v);
-    rb_hash_aset(rb_srv, weight_k, weight_v);
-    rb_hash_aset(rb_srv, port_k, port_v);
-
-    return rb_srv;
+    else if (strict && errno != ENOENT)
+        rb_raise(rb_eIOError, "%s - %s", strerror(errno), path);
 }
 
-
-static VALUE parse_adns_answer(adns_answer *answer_r)
+static VALUE resolv_conf_text(const char *path, adns_initflags iflags, struct stat *st_r, int strict)
 {
-    VALUE rb_answer = rb_ary_new2(answer_r->nrrs);;
-    adns_rrtype t = answer_r->type & adns_rrt_typemask;
-    adns_rrtype t_dref = answer_r->type & adns__qtf_deref;
-    int idx, ecode;
-    
-    if (answer_r->nrrs == 0)
-    /* something went wrong! */
-        return rb_answer;
-
-    for (idx=0; idx < answer_r->nrrs; idx++)
-    {
-        VALUE v; /* record specific value */
-        
-        /* A, ADDR RECORD */
-        if (t == adns_r_a)
-            if (t_dref)
-                v = parse_adns_rr_addr(answer_r->rrs.addr+idx);
-            else
-            {
-                const char *addr_buf;
-                struct in_addr *inaddr_r = answer_r->rrs.inaddr+idx;
-                addr_buf = inet_ntoa(*inaddr_r);
-                if (ecode)
-                    v = CSTR2STR("");
-                else
-                    v = CSTR2STR(addr_buf);
-            }
-        /* NS, NS_RAW RECORD */
-            else if (t == adns_r_ns_raw)
-                if (t_dref)
-                    v = parse_adns_rr_hostaddr(answer_r->rrs.hostaddr+idx);
-                else
-                    v = CSTR2STR(answer_r->rrs.str[idx]);
-        /* CNAME, PTR, PTR_RAW RECORD */
-                else if (t == adns_r_cname ||
-                         t == adns_r_ptr ||
-                         t == adns_r_ptr_raw)
-                    v = CSTR2STR(answer_r->rrs.str[idx]);
-        /* SOA, SOA_RAW RECORD */
-                else if (t == adns_r_soa_raw)
-                    v = parse_adns_rr_soa(answer_r->rrs.soa+idx);
-        /* HINFO RECORD */
-                else if (t == adns_r_hinfo)
-                {
-                    adns_rr_intstrpair *intstrpair_r = answer_r->rrs.intstrpair+idx;
-                    const char *str1 = intstrpair_r->array[0].str;
-                    const char *str2 = intstrpair_r->array[1].str;
-                    v = rb_ary_new();
-                    VALUE v1 = rb_ary_new();
-                    VALUE v2 = rb_ary_new();
-                    
-                    rb_ary_store(v1, 0, INT2FIX(intstrpair_r->array[0].i));
-                    rb_ary_store(v1, 1, str1 ? CSTR2STR(str1) : CSTR2STR(""));
-                    rb_ary_store(v2, 0, INT2FIX(intstrpair_r->array[1].i));
-                    rb_ary_store(v2, 1, str2 ? CSTR2STR(str2) : CSTR2STR(""));
-                    rb_ary_store(v, 0, v1);
-                    rb_ary_store(v, 1, v2);
-                }
-        /* MX, MX_RAW RECORD */
-                else if (t == adns_r_mx_raw)
-                {
-                    v = rb_hash_new();
-                    VALUE preference_k = CSTR2SYM("preference"), preference_v;
-                    
-                    if (t_dref) {
-                        adns_rr_inthostaddr *inthostaddr_r = answer_r->rrs.inthostaddr+idx;
-                        preference_v = INT2FIX(inthostaddr_r->i);
-                        v = parse_adns_rr_hostaddr(&inthostaddr_r->ha);
-                    } else {
-                        adns_rr_intstr *intstr_r = answer_r->rrs.intstr+idx;
-                        preference_v = INT2FIX(intstr_r->i);
-                        VALUE host_k = CSTR2SYM("host");
-                        VALUE host_v = CSTR2STR(intstr_r->str);
-                        rb_hash_aset(v, host_k, host_v);
-                    }
-                    rb_hash_aset(v, preference_k, preference_v);
-                }
-        /* TXT RECORD */
-                else if (t == adns_r_txt)
-                {
-                    adns_rr_intstr *intstr_r = answer_r->rrs.manyistr[idx];
-                    v = CSTR2STR(intstr_r->str);
-                }
-        /* RP RP_RAW RECORD */
-                else if (t == adns_r_rp)
-                {
-                    adns_rr_strpair *strpair_r = answer_r->rrs.strpair+idx;
-                    v = rb_ary_new2(2);
-                    rb_ary_store(v, 0, CSTR2STR(strpair_r->array[0]));
-                    rb_ary_store(v, 1, CSTR2STR(strpair_r->array[1]));
-                }
-        /* SRV, SRV_RAW RECORD */
-                else if (t == adns_r_srv)
-                {
-                    if (t_dref) {
-                        adns_rr_srvraw *srvraw_r = answer_r->rrs.srvraw+idx;
-                        v = parse_adns_rr_srv(srvraw_r, NULL);
-                    } else {
-                        adns_rr_srvha *srvha_r = answer_r->rrs.srvha+idx;
-                        v = parse_adns_rr_srv(NULL, srvha_r);
-                    }
-                }
-        /* UNKNOWN RECORD */
-                else
-                    v = rb_hash_new();
-        /* push value to answer array */
-        rb_ary_store(rb_answer, idx, v);
+   /*
+    * Everything adns_init() reads, in its order and with <path> in place of
+    * /etc/resolv.conf, as one text for adns_init_strcfg(): RES_OPTIONS and
+    * ADNS_RES_OPTIONS, the files of resolv_conf_files, RES_CONF_TEXT and
+    * ADNS_RES_CONF_TEXT, the options once more, then LOCALDOMAIN and
+    * ADNS_LOCALDOMAIN. Variables are skipped with adns_if_noenv. Missing files
+    * are fine, adns then falls back to a local nameserver. <st_r>, if given,
+    * has room for RESOLV_CONF_FILES entries.
+    */
+    VALUE text = rb_str_new2("");
+    const char *files[RESOLV_CONF_FILES];
+    int env = !(iflags & adns_if_noenv), idx;
+
+    resolv_conf_files(path, iflags, files);
+    if (env)
+    {
+        resolv_conf_env(text, "RES_OPTIONS", "options");
+        resolv_conf_env(text, "ADNS_RES_OPTIONS", "options");
     }
-    return rb_answer;
+    for (idx=0; idx < RESOLV_CONF_FILES; idx++)
+    {
+        if (files[idx])
+            resolv_conf_file(text, files[idx], st_r ? st_r + idx : NULL, strict && idx == 0);
+        else if (st_r)
+            memset(st_r + idx, 0, sizeof(struct stat));
+    }
+    if (env)
+    {
+        resolv_conf_env(text, "RES_CONF_TEXT", NULL);
+        resolv_conf_env(text, "ADNS_RES_CONF_TEXT", NULL);
+        resolv_conf_env(text, "RES_OPTIONS", "options");
+        resolv_conf_env(text, "ADNS_RES_OPTIONS", "options");
+        resolv_conf_env(text, "LOCALDOMAIN", "search");
+        resolv_conf_env(text, "ADNS_LOCALDOMAIN", "search");
+    }
+    return text;
 }
 
-static VALUE cQuery_init(VALUE self)
+static void parse_search_config(rb_adns_search_t *search, VALUE cfgtxt, adns_initflags iflags)
 {
-    return self;
+   /*
+    * Mirror what adns_init()/adns_init_strcfg() read, so that search list
+    * expansion done on the Ruby side agrees with adns_qf_search.
+    */
+    if (search->list != Qnil)
+        return;
+    if (cfgtxt == Qnil)
+        cfgtxt = resolv_conf_text(DEFAULT_RESOLV_CONF, iflags, NULL, 0);
+    search->list = rb_ary_new();
+    search->ndots = DEFAULT_NDOTS;
+    parse_resolv_conf_text(search, RSTRING_PTR(cfgtxt));
+    OBJ_FREEZE(search->list);
 }
 
-static void cQuery_mark(void *ptr)
+static int cfgtxt_is_nameserver_line(const char *line)
 {
-    rb_adns_query_t *rb_adq_r = (rb_adns_query_t *)ptr;
-    rb_gc_mark(rb_adq_r->answer);
+    char word[16];
+    return sscanf(line, " %15s", word) == 1 && !strcmp(word, "nameserver");
 }
 
-static void cQuery_free(void *ptr)
+/* Nameserver addresses in resolv.conf style text <cfgtxt>, in order. */
+static VALUE cfgtxt_nameservers(VALUE cfgtxt)
 {
-    rb_adns_query_t *rb_adq_r = (rb_adns_query_t *)ptr;
-    rb_adq_r->rb_ads_r = NULL;
-    rb_adq_r->adq = NULL;
-    rb_adq_r->answer = Qnil;
-    (void) free(rb_adq_r);
+    VALUE list = rb_ary_new();
+    char addr[64];
+    char *buf = strdup(RSTRING_PTR(cfgtxt)), *save, *line;
+
+    if (!buf)
+        rb_raise(rb_eNoMemError, "%s", strerror(errno));
+    for (line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save))
+        if (cfgtxt_is_nameserver_line(line) && sscanf(line, " %*s %63s", addr) == 1)
+            rb_ary_push(list, rb_str_new2(addr));
+    free(buf);
+    return list;
 }
 
 /*
- * call-seq: check => Hash or raises ADNS::NotReadyError
- *
- * Check pending asynchronous request and retrieve answer or raises ADNS::NotReadyError, if request is still pending.
+ * <cfgtxt> with its nameserver lines moved to the end and reordered: the ones in
+ * <order> first, in that order, then the others as they were.
  */
-static VALUE cQuery_check(VALUE self)
+static VALUE cfgtxt_reorder(VALUE cfgtxt, VALUE order)
 {
-    rb_adns_query_t *rb_adq_r;
-    adns_answer *answer_r;
-    int ecode;
-    
-    Data_Get_Struct(self, rb_adns_query_t, rb_adq_r);
-    if (rb_adq_r->answer != Qnil)
-        return rb_adq_r->answer;
-    if (!rb_adq_r->adq)
-        rb_raise(mADNS__eQueryError, "invalid query");
-    ecode = adns_check(rb_adq_r->rb_ads_r->ads, &rb_adq_r->adq, &answer_r, NULL);
-    if (ecode)
-    {
-        if (ecode == EWOULDBLOCK)
-            rb_raise(mADNS__eNotReadyError, strerror(ecode));
-        else
+    VALUE servers = cfgtxt_nameservers(cfgtxt), sorted = rb_ary_new();
+    VALUE text = rb_str_new2(""), addr;
+    char *buf = strdup(RSTRING_PTR(cfgtxt)), *save, *line;
+    long idx;
+
+    if (!buf)
+        rb_raise(rb_eNoMemError, "%s", strerror(errno));
+    for (line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save))
+        if (!cfgtxt_is_nameserver_line(line))
         {
-            rb_adq_r->adq = NULL;
-            rb_raise(mADNS__eError, strerror(ecode));
+            rb_str_cat2(text, line);
+            rb_str_cat2(text, "\n");
         }
+    free(buf);
+    for (idx=0; idx < RARRAY_LEN(order); idx++)
+    {
+        addr = rb_ary_entry(order, idx);
+        if (rb_ary_includes(servers, addr) == Qtrue && rb_ary_includes(sorted, addr) == Qfalse)
+            rb_ary_push(sorted, addr);
     }
-    rb_adq_r->answer = rb_hash_new();
-    rb_hash_aset(rb_adq_r->answer, CSTR2SYM("type"), INT2FIX(answer_r->type));
-    rb_hash_aset(rb_adq_r->answer, CSTR2SYM("owner"), CSTR2STR(answer_r->owner));
-    rb_hash_aset(rb_adq_r->answer, CSTR2SYM("status"), INT2FIX(answer_r->status));
-    rb_hash_aset(rb_adq_r->answer, CSTR2SYM("expires"), INT2FIX(answer_r->expires));
-    rb_hash_aset(rb_adq_r->answer, CSTR2SYM("answer"), parse_adns_answer(answer_r));
-    rb_adq_r->adq = NULL; /* mark query as completed, thus making it invalid */
-    return rb_adq_r->answer;
+    for (idx=0; idx < RARRAY_LEN(servers); idx++)
+        if (rb_ary_includes(sorted, rb_ary_entry(servers, idx)) == Qfalse)
+            rb_ary_push(sorted, rb_ary_entry(servers, idx));
+    for (idx=0; idx < RARRAY_LEN(sorted); idx++)
+    {
+        rb_str_cat2(text, "nameserver ");
+        rb_str_append(text, rb_ary_entry(sorted, idx));
+        rb_str_cat2(text, "\n");
+    }
+    return text;
+}
+
+void __rdata_modify(VALUE data)
+{
+    struct RData *data_r = (struct RData *)data;
+    long data_len = sizeof(data_r->data);
+    VALUE *ptr = ALLOC_N(VALUE, data_len);
+    MEMCPY(ptr, data_r->data, VALUE, data_len);
 }
+#define RDATA_MODIFY(d) (__rdata_modify(d))
 
 /*
- * call-seq: wait() => Hash
+ * Answer decoding
  *
- * Wait until answer is received.
+ * One decoder per adns record representation, picked once per answer from
+ * rr_decoders[] and then run over the rrs array, answer_r->rrsz apart.
  */
-static VALUE cQuery_wait(int argc, VALUE argv[], VALUE self)
+typedef VALUE (*rr_decoder_t)(const void *rr);
+
+static VALUE parse_adns_rr_addr(const adns_rr_addr *addr_r)
 {
-    rb_adns_query_t *rb_adq_r;
-    adns_answer *answer_r;
-    int ecode;
-    
-    Data_Get_Struct(self, rb_adns_query_t, rb_adq_r);
-    if (rb_adq_r->answer != Qnil)
-        return rb_adq_r->answer;
-    if (!rb_adq_r->adq)
-        rb_raise(mADNS__eQueryError, "query invalidated");
-    ecode = adns_wait(rb_adq_r->rb_ads_r->ads, &rb_adq_r->adq, &answer_r, NULL);
-    if (ecode)
+    char addr_buf[INET6_ADDRSTRLEN];
+    const char *addr_str = NULL;
+
+    switch (addr_r->addr.sa.sa_family)
     {
-        rb_adq_r->adq = NULL;
-        rb_adq_r->answer = Qnil;
-        rb_raise(mADNS__eError, strerror(ecode));
+        case AF_INET:
+            addr_str = inet_ntop(AF_INET, &addr_r->addr.inet.sin_addr, addr_buf, sizeof(addr_buf));
+            break;
+#ifdef ADNS_FEATURE_MANYAF
+        case AF_INET6:
+            addr_str = inet_ntop(AF_INET6, &addr_r->addr.inet6.sin6_addr, addr_buf, sizeof(addr_buf));
+            break;
+#endif
     }
-    rb_adq_r->answer = rb_hash_new();
-    rb_hash_aset(rb_adq_r->answer, CSTR2SYM("type"), INT2FIX(answer_r->type));
-    rb_hash_aset(rb_adq_r->answer, CSTR2SYM("owner"), CSTR2STR(answer_r->owner));
-    rb_hash_aset(rb_adq_r->answer, CSTR2SYM("status"), INT2FIX(answer_r->status));
-    rb_hash_aset(rb_adq_r->answer, CSTR2SYM("expires"), INT2FIX(answer_r->expires));
-    rb_hash_aset(rb_adq_r->answer, CSTR2SYM("answer"), parse_adns_answer(answer_r));
-    rb_adq_r->adq = NULL;
-    return rb_adq_r->answer;
+    return CSTR2STR(addr_str);
 }
 
-/*
- * call-seq: cancel() => nil
- *
- * Cancel current pending asynchronous request.
- */
-static VALUE cQuery_cancel(VALUE self)
+static VALUE parse_adns_rr_hostaddr(const adns_rr_hostaddr *hostaddr_r)
 {
-    rb_adns_query_t *rb_adq_r;
-    int ecode;
+    VALUE rb_hostaddr = rb_hash_new();
+    VALUE addrs_v = rb_ary_new2(hostaddr_r->naddrs > 0 ? hostaddr_r->naddrs : 0);
+    int idx;
     
-    Data_Get_Struct(self, rb_adns_query_t, rb_adq_r);
-    if (!rb_adq_r->adq)
-        rb_raise(mADNS__eQueryError, "query invalidated");
-    (void) adns_cancel(rb_adq_r->adq);
-    cQuery_free((void *)rb_adq_r);
-    return Qnil;
+    for (idx=0; idx < hostaddr_r->naddrs; idx++)
+        rb_ary_push(addrs_v, parse_adns_rr_addr(hostaddr_r->addrs+idx));
+    rb_hash_aset(rb_hostaddr, CSTR2SYM("host"), CSTR2STR(hostaddr_r->host));
+    rb_hash_aset(rb_hostaddr, CSTR2SYM("status"), INT2FIX(hostaddr_r->astatus));
+    rb_hash_aset(rb_hostaddr, CSTR2SYM("addr"), addrs_v);
+    return rb_hostaddr;
 }
 
+/* A */
+static VALUE decode_rr_inaddr(const void *rr)
+{
+    char addr_buf[INET_ADDRSTRLEN];
+    return CSTR2STR(inet_ntop(AF_INET, rr, addr_buf, sizeof(addr_buf)));
+}
 
-/*
- * call-seq: submit(domain, type[, qflags]) => ADNS::Query instance
- *
- * Submit asynchronous request to resolve domain <domain> of record type <type> using optional query flags <qflags>.
- */
-static VALUE cState_submit(int argc, VALUE argv[], VALUE self)
+#ifdef ADNS_FEATURE_MANYAF
+/* AAAA */
+static VALUE decode_rr_in6addr(const void *rr)
 {
-    rb_adns_query_t *rb_adq_r = ALLOC(rb_adns_query_t);
-    const char *owner;
-    adns_rrtype type;
-    adns_queryflags qflags = adns_qf_owner;
-    VALUE query; /* return instance */
-    int ecode;
-    
-    Data_Get_Struct(self, rb_adns_state_t, rb_adq_r->rb_ads_r);
-    if (argc < 2)
-        rb_raise(rb_eArgError, "wrong number of arguments (%d for 2)", argc);
-    else if (argc > 3)
-        rb_raise(rb_eArgError, "excess number of arguments (%d for 3)", argc);      
-    CHECK_TYPE(argv[0], T_STRING); /* DOMAIN */
-    CHECK_TYPE(argv[1], T_FIXNUM); /* RR */
-    if (argc == 3)
-        CHECK_TYPE(argv[2], T_FIXNUM); /* QFlags */
-    owner = STR2CSTR(argv[0]);
-    type = FIX2INT(argv[1]);
-    if (argc == 3)
-        qflags |= FIX2INT(argv[2]);
-    rb_adq_r->answer = Qnil;
-    query = Data_Wrap_Struct(mADNS__cQuery, cQuery_mark, cQuery_free, rb_adq_r);
-    ecode = adns_submit(rb_adq_r->rb_ads_r->ads, owner, type, qflags, (void *)query, &rb_adq_r->adq);
+    char addr_buf[INET6_ADDRSTRLEN];
+    return CSTR2STR(inet_ntop(AF_INET6, rr, addr_buf, sizeof(addr_buf)));
+}
+#endif
+
+/* ADDR */
+static VALUE decode_rr_addr(const void *rr)
+{
+    return parse_adns_rr_addr((const adns_rr_addr *)rr);
+}
+
+/* NS_RAW, CNAME, PTR, PTR_RAW */
+static VALUE decode_rr_str(const void *rr)
+{
+    return CSTR2STR(*(char * const *)rr);
+}
+
+/* NS */
+static VALUE decode_rr_hostaddr(const void *rr)
+{
+    return parse_adns_rr_hostaddr((const adns_rr_hostaddr *)rr);
+}
+
+/* SOA, SOA_RAW */
+static VALUE decode_rr_soa(const void *rr)
+{
+    const adns_rr_soa *soa_r = (const adns_rr_soa *)rr;
+    VALUE rb_soa = rb_hash_new();
+
+    rb_hash_aset(rb_soa, CSTR2SYM("mname"), CSTR2STR(soa_r->mname));
+    rb_hash_aset(rb_soa, CSTR2SYM("rname"), CSTR2STR(soa_r->rname));
+    rb_hash_aset(rb_soa, CSTR2SYM("serial"), ULONG2NUM(soa_r->serial));
+    rb_hash_aset(rb_soa, CSTR2SYM("refresh"), ULONG2NUM(soa_r->refresh));
+    rb_hash_aset(rb_soa, CSTR2SYM("retry"), ULONG2NUM(soa_r->retry));
+    rb_hash_aset(rb_soa, CSTR2SYM("expire"), ULONG2NUM(soa_r->expire));
+    rb_hash_aset(rb_soa, CSTR2SYM("minimum"), ULONG2NUM(soa_r->minimum));
+    return rb_soa;
+}
+
+/* HINFO */
+static VALUE decode_rr_intstrpair(const void *rr)
+{
+    const adns_rr_intstrpair *intstrpair_r = (const adns_rr_intstrpair *)rr;
+    VALUE v = rb_ary_new2(2);
+    int idx;
+
+    for (idx=0; idx < 2; idx++)
+        rb_ary_push(v, rb_assoc_new(INT2FIX(intstrpair_r->array[idx].i),
+                                    CSTR2STR(intstrpair_r->array[idx].str)));
+    return v;
+}
+
+/* MX_RAW */
+static VALUE decode_rr_intstr(const void *rr)
+{
+    const adns_rr_intstr *intstr_r = (const adns_rr_intstr *)rr;
+    VALUE v = rb_hash_new();
+
+    rb_hash_aset(v, CSTR2SYM("host"), CSTR2STR(intstr_r->str));
+    rb_hash_aset(v, CSTR2SYM("preference"), INT2FIX(intstr_r->i));
+    return v;
+}
+
+/* MX */
+static VALUE decode_rr_inthostaddr(const void *rr)
+{
+    const adns_rr_inthostaddr *inthostaddr_r = (const adns_rr_inthostaddr *)rr;
+    VALUE v = parse_adns_rr_hostaddr(&inthostaddr_r->ha);
+
+    rb_hash_aset(v, CSTR2SYM("preference"), INT2FIX(inthostaddr_r->i));
+    return v;
+}
+
+/* TXT: the record's character-strings, concatenated */
+static VALUE decode_rr_manyistr(const void *rr)
+{
+    const adns_rr_intstr *intstr_r = *(adns_rr_intstr * const *)rr;
+    VALUE v = rb_str_new("", 0);
+
+    for (; intstr_r->i != -1; intstr_r++)
+        rb_str_cat(v, intstr_r->str, intstr_r->i);
+    return v;
+}
+
+/* RP, RP_RAW */
+static VALUE decode_rr_strpair(const void *rr)
+{
+    const adns_rr_strpair *strpair_r = (const adns_rr_strpair *)rr;
+    return rb_assoc_new(CSTR2STR(strpair_r->array[0]), CSTR2STR(strpair_r->array[1]));
+}
+
+/* SRV_RAW */
+static VALUE decode_rr_srvraw(const void *rr)
+{
+    const adns_rr_srvraw *srvraw_r = (const adns_rr_srvraw *)rr;
+    VALUE rb_srv = rb_hash_new();
+
+    rb_hash_aset(rb_srv, CSTR2SYM("host"), CSTR2STR(srvraw_r->host));
+    rb_hash_aset(rb_srv, CSTR2SYM("priority"), INT2FIX(srvraw_r->priority));
+    rb_hash_aset(rb_srv, CSTR2SYM("weight"), INT2FIX(srvraw_r->weight));
+    rb_hash_aset(rb_srv, CSTR2SYM("port"), INT2FIX(srvraw_r->port));
+    return rb_srv;
+}
+
+/* SRV */
+static VALUE decode_rr_srvha(const void *rr)
+{
+    const adns_rr_srvha *srvha_r = (const adns_rr_srvha *)rr;
+    VALUE rb_srv = rb_hash_new();
+
+    rb_hash_aset(rb_srv, CSTR2SYM("host"), CSTR2STR(srvha_r->ha.host));
+    rb_hash_aset(rb_srv, CSTR2SYM("addrs"), parse_adns_rr_hostaddr(&srvha_r->ha));
+    rb_hash_aset(rb_srv, CSTR2SYM("priority"), INT2FIX(srvha_r->priority));
+    rb_hash_aset(rb_srv, CSTR2SYM("weight"), INT2FIX(srvha_r->weight));
+    rb_hash_aset(rb_srv, CSTR2SYM("port"), INT2FIX(srvha_r->port));
+    return rb_srv;
+}
+
+/* RR::UNKNOWN: raw rdata */
+static VALUE decode_rr_byteblock(const void *rr)
+{
+    const adns_rr_byteblock *byteblock_r = (const adns_rr_byteblock *)rr;
+    return rb_str_new((const char *)byteblock_r->data, byteblock_r->len);
+}
+
+/* types adns knows nothing about */
+static VALUE decode_rr_none(const void *rr)
+{
+    return rb_hash_new();
+}
+
+static const struct {
+    adns_rrtype type;
+    rr_decoder_t decode;
+} rr_decoders[] = {
+    { adns_r_a,         decode_rr_inaddr },
+    { adns_r_addr,      decode_rr_addr },
+#ifdef ADNS_FEATURE_MANYAF
+    { adns_r_aaaa,      decode_rr_in6addr },
+#endif
+    { adns_r_ns_raw,    decode_rr_str },
+    { adns_r_ns,        decode_rr_hostaddr },
+    { adns_r_cname,     decode_rr_str },
+    { adns_r_soa_raw,   decode_rr_soa },
+    { adns_r_soa,       decode_rr_soa },
+    { adns_r_ptr_raw,   decode_rr_str },
+    { adns_r_ptr,       decode_rr_str },
+    { adns_r_hinfo,     decode_rr_intstrpair },
+    { adns_r_mx_raw,    decode_rr_intstr },
+    { adns_r_mx,        decode_rr_inthostaddr },
+    { adns_r_txt,       decode_rr_manyistr },
+    { adns_r_rp_raw,    decode_rr_strpair },
+    { adns_r_rp,        decode_rr_strpair },
+    { adns_r_srv_raw,   decode_rr_srvraw },
+    { adns_r_srv,       decode_rr_srvha },
+};
+
+static rr_decoder_t rr_decoder(adns_rrtype type)
+{
+    size_t idx;
+
+    if (type & adns_r_unknown)
+        return decode_rr_byteblock;
+    for (idx=0; idx < sizeof(rr_decoders) / sizeof(rr_decoders[0]); idx++)
+        if (rr_decoders[idx].type == type)
+            return rr_decoders[idx].decode;
+    return decode_rr_none;
+}
+
+static VALUE parse_adns_answer(adns_answer *answer_r)
+{
+    VALUE rb_answer = rb_ary_new2(answer_r->nrrs > 0 ? answer_r->nrrs : 0);
+    rr_decoder_t decode = rr_decoder(answer_r->type);
+    const char *rr = (const char *)answer_r->rrs.untyped;
+    int idx;
+    
+    for (idx=0; idx < answer_r->nrrs; idx++, rr += answer_r->rrsz)
+        rb_ary_push(rb_answer, decode(rr));
+    return rb_answer;
+}
+
+static VALUE query_answer_new(adns_answer *answer_r)
+{
+    VALUE answer = rb_hash_new();
+    uint64_t t_parse;
+    rb_hash_aset(answer, CSTR2SYM("type"), INT2FIX(answer_r->type));
+    rb_hash_aset(answer, CSTR2SYM("owner"), CSTR2STR(answer_r->owner));
+    rb_hash_aset(answer, CSTR2SYM("status"), INT2FIX(answer_r->status));
+    rb_hash_aset(answer, CSTR2SYM("expires"), INT2FIX(answer_r->expires));
+    t_parse = RB_ADNS_PROBE_ENABLED(parse) ? clock_ns() : 0;
+    rb_hash_aset(answer, CSTR2SYM("answer"), parse_adns_answer(answer_r));
+    RB_ADNS_PROBE3(parse, answer_r->type, answer_r->nrrs, clock_ns() - t_parse);
+    return answer;
+}
+
+/* Nanoseconds from submit to <t>, for probes; 0 for a query submitted untimed. */
+static uint64_t query_elapsed(rb_adns_query_t *rb_adq_r, uint64_t t)
+{
+    return t && rb_adq_r->t_submit ? t - rb_adq_r->t_submit : 0;
+}
+
+static void query_mark_answered(rb_adns_query_t *rb_adq_r, adns_answer *answer_r)
+{
+    if (rb_adq_r->timed)
+        rb_adq_r->t_answered = clock_ns();
+    RB_ADNS_PROBE5(query__answered, rb_adq_r, answer_r->owner, answer_r->type,
+                   answer_r->status, query_elapsed(rb_adq_r, rb_adq_r->t_answered));
+}
+
+static VALUE query_phase(rb_adns_query_t *rb_adq_r, uint64_t t)
+{
+    return t && rb_adq_r->t_submit ? rb_float_new((t - rb_adq_r->t_submit) / 1e9) : Qnil;
+}
+
+/* Report the timing phases of an answered query to the state's timing hook, if any. */
+static void query_report_timing(VALUE query, rb_adns_query_t *rb_adq_r)
+{
+    VALUE hook = rb_adq_r->rb_ads_r->timing_hook;
+    VALUE timings;
+
+    if (hook == Qnil)
+        return;
+    timings = rb_hash_new();
+    rb_hash_aset(timings, CSTR2SYM("sent"), query_phase(rb_adq_r, rb_adq_r->t_sent));
+    rb_hash_aset(timings, CSTR2SYM("answered"), query_phase(rb_adq_r, rb_adq_r->t_answered));
+    rb_hash_aset(timings, CSTR2SYM("built"), query_phase(rb_adq_r, rb_adq_r->t_built));
+    (void) rb_funcall(hook, rb_intern("call"), 2, query, timings);
+}
+
+static VALUE query_report_timing_i(VALUE query)
+{
+    rb_adns_query_t *rb_adq_r;
+    Data_Get_Struct(query, rb_adns_query_t, rb_adq_r);
+    query_report_timing(query, rb_adq_r);
+    return Qnil;
+}
+
+/* Put <query> on the list completed_queries returns next, see rb_adns_state_t.hits. */
+static void query_hold(VALUE query, rb_adns_query_t *rb_adq_r)
+{
+    if (rb_adq_r->rb_ads_r->hits == Qnil)
+        rb_adq_r->rb_ads_r->hits = rb_hash_new();
+    rb_adq_r->hit = 1;
+    rb_hash_aset(rb_adq_r->rb_ads_r->hits, query, Qtrue);
+}
+
+static void state_report_timings(rb_adns_state_t *rb_ads_r, VALUE query_list, long first)
+{
+   /*
+    * The timing hook calls of completed_queries, made once <query_list> is complete
+    * so that a raising hook cannot lose the queries collected around it. Every
+    * entry from <first> on is reported; if any call raised, the whole list is held
+    * back for the next completed_queries and the first exception re-raised.
+    */
+    VALUE query, error = Qnil;
+    rb_adns_query_t *rb_adq_r;
+    int tag, failed = 0;
+    long idx;
+
+    if (rb_ads_r->timing_hook == Qnil)
+        return;
+    for (idx=first; idx < RARRAY_LEN(query_list); idx++)
+    {
+        (void) rb_protect(query_report_timing_i, rb_ary_entry(query_list, idx), &tag);
+        if (!tag || failed)
+            continue;
+        failed = tag;
+        error = rb_errinfo();
+        rb_set_errinfo(Qnil);
+    }
+    if (!failed)
+        return;
+    for (idx=0; idx < RARRAY_LEN(query_list); idx++)
+    {
+        query = rb_ary_entry(query_list, idx);
+        Data_Get_Struct(query, rb_adns_query_t, rb_adq_r);
+        query_hold(query, rb_adq_r);
+    }
+    if (rb_obj_is_kind_of(error, rb_eException))
+        rb_exc_raise(error);
+    rb_jump_tag(failed);
+}
+
+/*
+ * Shared answer cache
+ *
+ * A fixed size hash table in a MAP_SHARED mapping, shared by processes forked
+ * after it was mapped or opening the same file. A key lives in one of the
+ * SHM_WAYS slots of its set. Readers take no lock: writers make a slot's
+ * sequence number odd while they change it, and a read only counts if the
+ * number was even and the same before and after the copy. Writers claim a
+ * slot with a compare-and-swap and skip the store rather than wait. Answers
+ * are kept in the fixed encoding of shm_encode, with their adns expiry time.
+ */
+static uint64_t shm_key(const char *owner, adns_rrtype type, adns_queryflags qflags)
+{
+    uint64_t h = 14695981039346656037ULL; /* FNV-1a, owner case folded */
+    const unsigned char *p;
+
+    for (p = (const unsigned char *) owner; *p; p++)
+    {
+        h ^= (*p >= 'A' && *p <= 'Z') ? *p + ('a' - 'A') : *p;
+        h *= 1099511628211ULL;
+    }
+    h ^= ((uint64_t) type << 32) | (uint32_t) qflags;
+    h *= 1099511628211ULL;
+    return h ? h : 1; /* 0 marks an empty slot */
+}
+
+static rb_adns_shm_slot_t *shm_slot(rb_adns_shm_t *shm_r, uint32_t idx)
+{
+    return (rb_adns_shm_slot_t *)((char *)(shm_r->header + 1) + (size_t) idx * shm_r->slot_size);
+}
+
+/* First slot of the set <key> belongs to. */
+static uint32_t shm_set(rb_adns_shm_t *shm_r, uint64_t key)
+{
+    return (uint32_t)(key % (shm_r->nslots / SHM_WAYS)) * SHM_WAYS;
+}
+
+/*
+ * Answers are encoded as what the decoders build, nothing else: a tag byte, then
+ * 'I' int64, 'S' uint32 length and bytes, 'A' uint32 count and elements, or 'H'
+ * uint32 count and pairs of a shm_keys index byte and value. Whoever can write the
+ * cache can only ever make lookups produce such values, never other objects.
+ */
+static const char *const shm_keys[] = {
+    "type", "owner", "status", "expires", "answer", "host", "addr", "addrs", "mname", "rname",
+    "serial", "refresh", "retry", "expire", "minimum", "preference", "priority", "weight", "port",
+};
+#define SHM_NKEYS ((int)(sizeof(shm_keys) / sizeof(shm_keys[0])))
+
+static void shm_encode_u32(VALUE buf, char tag, uint32_t n)
+{
+    char head[1 + sizeof(n)];
+
+    head[0] = tag;
+    memcpy(head + 1, &n, sizeof(n));
+    rb_str_cat(buf, head, sizeof(head));
+}
+
+struct shm_encode_args {
+    VALUE buf;
+    int ok;
+};
+
+static int shm_encode_pair_i(VALUE key, VALUE value, VALUE arg);
+
+/* Append <v> to <buf>. Returns 0 for something the decoders never build. */
+static int shm_encode(VALUE buf, VALUE v)
+{
+    struct shm_encode_args args;
+    char head[1 + sizeof(int64_t)];
+    int64_t i;
+    long idx;
+
+    switch (TYPE(v))
+    {
+        case T_FIXNUM:
+        case T_BIGNUM:
+            i = NUM2LL(v);
+            head[0] = 'I';
+            memcpy(head + 1, &i, sizeof(i));
+            rb_str_cat(buf, head, sizeof(head));
+            return 1;
+        case T_STRING:
+            shm_encode_u32(buf, 'S', (uint32_t) RSTRING_LEN(v));
+            rb_str_cat(buf, RSTRING_PTR(v), RSTRING_LEN(v));
+            return 1;
+        case T_ARRAY:
+            shm_encode_u32(buf, 'A', (uint32_t) RARRAY_LEN(v));
+            for (idx=0; idx < RARRAY_LEN(v); idx++)
+                if (!shm_encode(buf, rb_ary_entry(v, idx)))
+                    return 0;
+            return 1;
+        case T_HASH:
+            shm_encode_u32(buf, 'H', (uint32_t) RHASH_SIZE(v));
+            args.buf = buf;
+            args.ok = 1;
+            rb_hash_foreach(v, shm_encode_pair_i, (VALUE)&args);
+            return args.ok;
+    }
+    return 0;
+}
+
+static int shm_encode_pair_i(VALUE key, VALUE value, VALUE arg)
+{
+    struct shm_encode_args *args = (struct shm_encode_args *)arg;
+    const char *name;
+    char byte;
+    int idx;
+
+    if (SYMBOL_P(key))
+    {
+        name = rb_id2name(SYM2ID(key));
+        for (idx=0; idx < SHM_NKEYS; idx++)
+            if (strcmp(name, shm_keys[idx]) == 0)
+                break;
+        byte = (char) idx;
+        if (idx < SHM_NKEYS)
+        {
+            rb_str_cat(args->buf, &byte, 1);
+            if (shm_encode(args->buf, value))
+                return ST_CONTINUE;
+        }
+    }
+    args->ok = 0;
+    return ST_STOP;
+}
+
+static int shm_decode_u32(const char **p, const char *end, uint32_t *n)
+{
+    if (end - *p < (long) sizeof(*n))
+        return 0;
+    memcpy(n, *p, sizeof(*n));
+    *p += sizeof(*n);
+    return 1;
+}
+
+/* Value encoded at *<p> by shm_encode, advancing *<p>. Qundef if it is not well formed. */
+static VALUE shm_decode(const char **p, const char *end, int depth)
+{
+    VALUE v, item;
+    int64_t i;
+    uint32_t n, idx;
+    unsigned char key;
+
+    if (*p >= end || depth > SHM_MAX_DEPTH)
+        return Qundef;
+    switch (*(*p)++)
+    {
+        case 'I':
+            if (end - *p < (long) sizeof(i))
+                return Qundef;
+            memcpy(&i, *p, sizeof(i));
+            *p += sizeof(i);
+            return LL2NUM(i);
+        case 'S':
+            if (!shm_decode_u32(p, end, &n) || (uint32_t)(end - *p) < n)
+                return Qundef;
+            v = rb_str_new(*p, n);
+            *p += n;
+            return v;
+        case 'A':
+            if (!shm_decode_u32(p, end, &n) || (uint32_t)(end - *p) < n)
+                return Qundef; /* every element takes a byte at least */
+            v = rb_ary_new2(n);
+            for (idx=0; idx < n; idx++)
+            {
+                if ((item = shm_decode(p, end, depth + 1)) == Qundef)
+                    return Qundef;
+                rb_ary_push(v, item);
+            }
+            return v;
+        case 'H':
+            if (!shm_decode_u32(p, end, &n) || (uint32_t)(end - *p) < n * 2)
+                return Qundef;
+            v = rb_hash_new();
+            for (idx=0; idx < n; idx++)
+            {
+                key = (unsigned char) *(*p)++;
+                if (key >= SHM_NKEYS || (item = shm_decode(p, end, depth + 1)) == Qundef)
+                    return Qundef;
+                rb_hash_aset(v, CSTR2SYM(shm_keys[key]), item);
+            }
+            return v;
+    }
+    return Qundef;
+}
+
+static VALUE shm_lookup(rb_adns_shm_t *shm_r, const char *owner, adns_rrtype type, adns_queryflags qflags)
+{
+    uint64_t key = shm_key(owner, type, qflags);
+    size_t owner_len = strlen(owner);
+    size_t capacity = shm_r->slot_size - sizeof(rb_adns_shm_slot_t);
+    uint32_t seq, way, base = shm_set(shm_r, key);
+    rb_adns_shm_slot_t *slot, copy;
+    time_t now = time(NULL);
+    VALUE data, answer;
+    const char *p;
+    int tries;
+
+    for (way=0; way < SHM_WAYS; way++)
+    {
+        slot = shm_slot(shm_r, base + way);
+        for (tries=0; tries < 3; tries++)
+        {
+            seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            if (seq & 1)
+                continue; /* writer inside */
+            memcpy(&copy, slot, sizeof(copy));
+            data = Qnil;
+            if (copy.key == key && copy.type == (int32_t) type && copy.qflags == (int32_t) qflags &&
+                copy.expires > now && copy.owner_len == owner_len &&
+                copy.len >= owner_len && copy.len <= capacity &&
+                strncasecmp(slot->data, owner, owner_len) == 0)
+                data = rb_str_new(slot->data + owner_len, copy.len - owner_len);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+                continue; /* torn, read again */
+            if (data == Qnil)
+                break;
+            p = RSTRING_PTR(data);
+            answer = shm_decode(&p, p + RSTRING_LEN(data), 0);
+            RB_GC_GUARD(data);
+            if (answer == Qundef || TYPE(answer) != T_HASH)
+                break; /* not ours, or garbage */
+            (void) __atomic_add_fetch(&shm_r->header->hits, 1, __ATOMIC_RELAXED);
+            return answer;
+        }
+    }
+    (void) __atomic_add_fetch(&shm_r->header->misses, 1, __ATOMIC_RELAXED);
+    return Qnil;
+}
+
+static void shm_store(rb_adns_shm_t *shm_r, const char *owner, adns_rrtype type, adns_queryflags qflags,
+                      VALUE answer, time_t expires)
+{
+    VALUE data = rb_str_buf_new(256);
+    uint64_t key = shm_key(owner, type, qflags);
+    size_t owner_len = strlen(owner);
+    size_t len;
+    uint32_t seq, way, base = shm_set(shm_r, key);
+    rb_adns_shm_slot_t *slot, *victim = NULL;
+    int64_t victim_expires = 0, slot_expires;
+
+    if (!shm_encode(data, answer))
+        return;
+    len = owner_len + RSTRING_LEN(data);
+    if (len > shm_r->slot_size - sizeof(rb_adns_shm_slot_t))
+    {
+        (void) __atomic_add_fetch(&shm_r->header->skipped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    /* the key's own slot, else the one expiring first (empty ones never expire later) */
+    for (way=0; way < SHM_WAYS; way++)
+    {
+        slot = shm_slot(shm_r, base + way);
+        if (__atomic_load_n(&slot->key, __ATOMIC_RELAXED) == key)
+        {
+            victim = slot;
+            break;
+        }
+        slot_expires = __atomic_load_n(&slot->expires, __ATOMIC_RELAXED);
+        if (!victim || slot_expires < victim_expires)
+        {
+            victim = slot;
+            victim_expires = slot_expires;
+        }
+    }
+    seq = __atomic_load_n(&victim->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&victim->seq, &seq, seq + 1, 0,
+                                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        (void) __atomic_add_fetch(&shm_r->header->skipped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    victim->key = key;
+    victim->expires = expires;
+    victim->type = type;
+    victim->qflags = qflags;
+    victim->owner_len = owner_len;
+    victim->len = len;
+    memcpy(victim->data, owner, owner_len);
+    memcpy(victim->data + owner_len, RSTRING_PTR(data), RSTRING_LEN(data));
+    __atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+    (void) __atomic_add_fetch(&shm_r->header->stores, 1, __ATOMIC_RELAXED);
+}
+
+/* Offer the answer of a forward query to the state's shared cache: positive and NXDomain/NoData. */
+static void query_offer_shm(rb_adns_query_t *rb_adq_r, adns_answer *answer_r)
+{
+    VALUE shm = rb_adq_r->rb_ads_r->shm;
+    rb_adns_shm_t *shm_r;
+
+    if (shm == Qnil || rb_adq_r->op != RB_ADNS_OP_SUBMIT || !rb_adq_r->owner)
+        return;
+    if (answer_r->status != adns_s_ok && answer_r->status != adns_s_nxdomain &&
+        answer_r->status != adns_s_nodata)
+        return;
+    if (answer_r->expires <= time(NULL))
+        return;
+    Data_Get_Struct(shm, rb_adns_shm_t, shm_r);
+    shm_store(shm_r, rb_adq_r->owner, rb_adq_r->type, rb_adq_r->qflags, rb_adq_r->answer,
+              answer_r->expires);
+}
+
+/* A submission answered from the shared cache, reported by completed_queries until collected. */
+static void query_hit(VALUE query, rb_adns_query_t *rb_adq_r)
+{
+    if (rb_adq_r->timed)
+        rb_adq_r->t_answered = rb_adq_r->t_built = clock_ns();
+    query_hold(query, rb_adq_r);
+    query_report_timing(query, rb_adq_r);
+}
+
+static void query_take_hit(VALUE query, rb_adns_query_t *rb_adq_r)
+{
+    if (!rb_adq_r->hit)
+        return;
+    rb_adq_r->hit = 0;
+    (void) rb_hash_delete(rb_adq_r->rb_ads_r->hits, query);
+}
+
+/* Hits not collected yet, for completed_queries. */
+static VALUE state_take_hits(rb_adns_state_t *rb_ads_r)
+{
+    VALUE query_list;
+    rb_adns_query_t *rb_adq_r;
+    long idx;
+
+    if (rb_ads_r->hits == Qnil || RHASH_SIZE(rb_ads_r->hits) == 0)
+        return rb_ary_new();
+    query_list = rb_funcall(rb_ads_r->hits, rb_intern("keys"), 0);
+    rb_hash_clear(rb_ads_r->hits);
+    for (idx=0; idx < RARRAY_LEN(query_list); idx++)
+    {
+        Data_Get_Struct(rb_ary_entry(query_list, idx), rb_adns_query_t, rb_adq_r);
+        rb_adq_r->hit = 0;
+    }
+    return query_list;
+}
+
+/*
+ * Build the answer Hash of a completed query, offer it to the shared cache and free
+ * <answer_r>. The timing hook is left to the caller, see query_answered.
+ */
+static VALUE query_build(VALUE query, rb_adns_query_t *rb_adq_r, adns_answer *answer_r)
+{
+    if (!rb_adq_r->t_answered)
+        query_mark_answered(rb_adq_r, answer_r);
+    rb_adq_r->answer = query_answer_new(answer_r);
+    if (rb_adq_r->timed)
+        rb_adq_r->t_built = clock_ns();
+    RB_ADNS_PROBE5(query__done, rb_adq_r, answer_r->owner, answer_r->type,
+                   answer_r->status, query_elapsed(rb_adq_r, rb_adq_r->t_built));
+    query_offer_shm(rb_adq_r, answer_r);
+    free(answer_r);
+    return rb_adq_r->answer;
+}
+
+/* query_build, then report the timing phases to the state's timing hook, if any. */
+static VALUE query_answered(VALUE query, rb_adns_query_t *rb_adq_r, adns_answer *answer_r)
+{
+    (void) query_build(query, rb_adq_r, answer_r);
+    query_report_timing(query, rb_adq_r);
+    return rb_adq_r->answer;
+}
+
+/*
+ * Query struct slab
+ *
+ * Query structs come from a per-state slab of fixed size chunks, so submit
+ * and release are a free list pop and push instead of malloc and free.
+ * Slots never move, which keeps pointers handed to the io thread valid.
+ * adns query contexts are generation-tagged handles rather than pointers
+ * or Ruby references, so a context that outlived its query is recognised
+ * by its stale generation. The slab lives as long as the state or any slot
+ * in use, whichever is longer, since Query objects may be freed after
+ * their state.
+ */
+#ifdef RB_ADNS_IO_THREAD
+#define SLAB_LOCK(slab)     ((void) pthread_mutex_lock(&(slab)->lock))
+#define SLAB_UNLOCK(slab)   ((void) pthread_mutex_unlock(&(slab)->lock))
+#else
+#define SLAB_LOCK(slab)     ((void) 0)
+#define SLAB_UNLOCK(slab)   ((void) 0)
+#endif
+
+static rb_adns_slab_t *slab_new(void)
+{
+    rb_adns_slab_t *slab = calloc(1, sizeof(rb_adns_slab_t));
+
+    if (!slab)
+        rb_raise(rb_eNoMemError, "%s", strerror(errno));
+    slab->refcnt = 1;
+#ifdef RB_ADNS_IO_THREAD
+    (void) pthread_mutex_init(&slab->lock, NULL);
+#endif
+    return slab;
+}
+
+static void slab_unref(rb_adns_slab_t *slab)
+{
+    long idx;
+    int last;
+
+    SLAB_LOCK(slab);
+    last = --slab->refcnt == 0;
+    SLAB_UNLOCK(slab);
+    if (!last)
+        return;
+    for (idx=0; idx < slab->nchunks; idx++)
+        free(slab->chunks[idx]);
+    free(slab->chunks);
+#ifdef RB_ADNS_IO_THREAD
+    (void) pthread_mutex_destroy(&slab->lock);
+#endif
+    free(slab);
+}
+
+/* Add a chunk of free slots. Returns 0 with errno set: ENOMEM, or EAGAIN at SLAB_MAX_SLOTS. */
+static int slab_grow(rb_adns_slab_t *slab)
+{
+    rb_adns_query_t *chunk, **chunks;
+    long idx;
+
+    if ((uintptr_t)(slab->nchunks + 1) * SLAB_CHUNK_SLOTS > SLAB_MAX_SLOTS)
+    {
+        errno = EAGAIN;
+        return 0;
+    }
+    if (slab->nchunks == slab->chunks_len)
+    {
+        chunks = realloc(slab->chunks, sizeof(rb_adns_query_t *) * (slab->chunks_len ? slab->chunks_len * 2 : 4));
+        if (!chunks)
+        {
+            errno = ENOMEM;
+            return 0;
+        }
+        slab->chunks = chunks;
+        slab->chunks_len = slab->chunks_len ? slab->chunks_len * 2 : 4;
+    }
+    if (!(chunk = calloc(SLAB_CHUNK_SLOTS, sizeof(rb_adns_query_t))))
+    {
+        errno = ENOMEM;
+        return 0;
+    }
+    for (idx=SLAB_CHUNK_SLOTS-1; idx >= 0; idx--)
+    {
+        chunk[idx].slab = slab;
+        chunk[idx].index = slab->nchunks * SLAB_CHUNK_SLOTS + idx;
+        chunk[idx].next_free = slab->free_list;
+        slab->free_list = chunk + idx;
+    }
+    slab->chunks[slab->nchunks++] = chunk;
+    return 1;
+}
+
+/* Take a zeroed slot, growing the slab by a chunk if none is free. NULL with errno set as by slab_grow. */
+static rb_adns_query_t *slab_get(rb_adns_slab_t *slab)
+{
+    rb_adns_query_t *slot;
+    unsigned long gen;
+    long index;
+    int ecode;
+
+    SLAB_LOCK(slab);
+    if (!slab->free_list && !slab_grow(slab))
+    {
+        ecode = errno;
+        SLAB_UNLOCK(slab);
+        errno = ecode;
+        return NULL;
+    }
+    slot = slab->free_list;
+    slab->free_list = slot->next_free;
+    if (++slab->nused > slab->peak)
+        slab->peak = slab->nused;
+    slab->refcnt++;
+    SLAB_UNLOCK(slab);
+    index = slot->index;
+    gen = slot->gen;
+    MEMZERO(slot, rb_adns_query_t, 1);
+    slot->slab = slab;
+    slot->index = index;
+    slot->gen = gen;
+    slot->in_use = 1;
+    return slot;
+}
+
+static void slab_put(rb_adns_query_t *slot)
+{
+    rb_adns_slab_t *slab = slot->slab;
+
+    SLAB_LOCK(slab);
+    slot->gen++; /* outstanding handles to this slot go stale */
+    slot->in_use = 0;
+    slot->next_free = slab->free_list;
+    slab->free_list = slot;
+    slab->nused--;
+    SLAB_UNLOCK(slab);
+    slab_unref(slab); /* the slot's */
+}
+
+static void *slab_handle(rb_adns_query_t *slot)
+{
+    return (void *)(((uintptr_t)slot->index << HANDLE_GEN_BITS) | (slot->gen & HANDLE_GEN_MASK));
+}
+
+/* Resolve a handle from slab_handle, NULL if its slot has been released since. */
+static rb_adns_query_t *slab_lookup(rb_adns_slab_t *slab, void *handle)
+{
+    uintptr_t index = (uintptr_t)handle >> HANDLE_GEN_BITS;
+    rb_adns_query_t *slot;
+
+    if (index >= (uintptr_t)(slab->nchunks * SLAB_CHUNK_SLOTS))
+        return NULL;
+    slot = slab->chunks[index / SLAB_CHUNK_SLOTS] + index % SLAB_CHUNK_SLOTS;
+    if (!slot->in_use || (slot->gen & HANDLE_GEN_MASK) != ((uintptr_t)handle & HANDLE_GEN_MASK))
+        return NULL;
+    return slot;
+}
+
+static void query_release(rb_adns_query_t *rb_adq_r)
+{
+   /*
+    * Query structs are shared between the Query object and, while in flight,
+    * the io thread. Whichever lets go last frees it.
+    */
+    if (__atomic_sub_fetch(&rb_adq_r->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+#ifdef RB_ADNS_IO_THREAD
+    if (rb_adq_r->iothread)
+        (void) pthread_cond_destroy(&rb_adq_r->cond);
+#endif
+    free(rb_adq_r->answer_r);
+    rb_adq_r->answer_r = NULL;
+    free(rb_adq_r->owner);
+    free(rb_adq_r->zone);
+    rb_adq_r->rb_ads_r = NULL;
+    rb_adq_r->adq = NULL;
+    rb_adq_r->answer = Qnil;
+    slab_put(rb_adq_r);
+}
+
+static int query_adns_submit(rb_adns_state_t *rb_ads_r, rb_adns_query_t *rb_adq_r, int op,
+                             const char *owner, const char *zone, struct sockaddr_in *addr,
+                             adns_rrtype type, adns_queryflags qflags, void *context)
+{
+    int ecode;
+
+    rb_adq_r->ads = rb_ads_r->ads;
+    switch (op)
+    {
+        case RB_ADNS_OP_SUBMIT_REVERSE:
+            ecode = adns_submit_reverse(rb_ads_r->ads, (struct sockaddr *)addr,
+                                        type, qflags, context, &rb_adq_r->adq);
+            break;
+        case RB_ADNS_OP_SUBMIT_REVERSE_ANY:
+            ecode = adns_submit_reverse_any(rb_ads_r->ads, (struct sockaddr *)addr,
+                                            zone, type, qflags, context, &rb_adq_r->adq);
+            break;
+        default:
+            ecode = adns_submit(rb_ads_r->ads, owner, type, qflags, context, &rb_adq_r->adq);
+    }
+    if (!ecode)
+    {
+        /* adns sends UDP queries from within adns_submit */
+        if (rb_adq_r->timed)
+            rb_adq_r->t_sent = clock_ns();
+        RB_ADNS_PROBE3(query__sent, rb_adq_r, type, query_elapsed(rb_adq_r, rb_adq_r->t_sent));
+    }
+    return ecode;
+}
+
+/*
+ * Rate limiting
+ *
+ * A token bucket in front of adns_submit. Submissions that find it empty
+ * wait in a FIFO and are handed to adns as tokens come in: by the io thread
+ * in io thread mode, otherwise whenever Ruby checks, waits or collects.
+ * In io thread mode the queue belongs to the io thread and rate, burst and
+ * tokens are guarded by rb_ads_r->lock; the counters are atomics.
+ */
+#ifdef RB_ADNS_IO_THREAD
+#define BUCKET_LOCK(rb_ads_r)   do { if ((rb_ads_r)->iothread) (void) pthread_mutex_lock(&(rb_ads_r)->lock); } while (0)
+#define BUCKET_UNLOCK(rb_ads_r) do { if ((rb_ads_r)->iothread) (void) pthread_mutex_unlock(&(rb_ads_r)->lock); } while (0)
+static void io_thread_complete(rb_adns_state_t *rb_ads_r, rb_adns_query_t *rb_adq_r,
+                               adns_answer *answer_r, int ecode);
+#else
+#define BUCKET_LOCK(rb_ads_r)   ((void) 0)
+#define BUCKET_UNLOCK(rb_ads_r) ((void) 0)
+#endif
+
+static void bucket_refill(rb_adns_bucket_t *bucket, uint64_t now)
+{
+    bucket->tokens += (now - bucket->last) * bucket->rate / 1e9;
+    if (bucket->tokens > bucket->burst)
+        bucket->tokens = bucket->burst;
+    bucket->last = now;
+}
+
+static int state_take_token(rb_adns_state_t *rb_ads_r)
+{
+    rb_adns_bucket_t *bucket = &rb_ads_r->bucket;
+    int taken = 1;
+
+    BUCKET_LOCK(rb_ads_r);
+    if (bucket->rate > 0)
+    {
+        bucket_refill(bucket, clock_ns());
+        if ((taken = bucket->tokens >= 1))
+            bucket->tokens -= 1;
+    }
+    BUCKET_UNLOCK(rb_ads_r);
+    return taken;
+}
+
+/* Seconds until the next token, 0 if nothing is waiting for one. */
+static double state_token_delay(rb_adns_state_t *rb_ads_r)
+{
+    rb_adns_bucket_t *bucket = &rb_ads_r->bucket;
+    double delay = 0;
+
+    BUCKET_LOCK(rb_ads_r);
+    if (bucket->head && bucket->rate > 0)
+    {
+        bucket_refill(bucket, clock_ns());
+        if (bucket->tokens < 1)
+            delay = (1 - bucket->tokens) / bucket->rate;
+    }
+    BUCKET_UNLOCK(rb_ads_r);
+    return delay;
+}
+
+static void bucket_enqueue(rb_adns_bucket_t *bucket, rb_adns_query_t *rb_adq_r)
+{
+    if (!rb_adq_r->t_submit)
+        rb_adq_r->t_submit = clock_ns(); /* for throttled_ns */
+    rb_adq_r->tnext = NULL;
+    rb_adq_r->tprev = bucket->tail;
+    if (bucket->tail)
+        bucket->tail->tnext = rb_adq_r;
+    else
+        bucket->head = rb_adq_r;
+    bucket->tail = rb_adq_r;
+    rb_adq_r->throttled = 1;
+    __atomic_add_fetch(&bucket->queued, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bucket->throttled, 1, __ATOMIC_RELAXED);
+}
+
+static void bucket_unlink(rb_adns_bucket_t *bucket, rb_adns_query_t *rb_adq_r)
+{
+    if (rb_adq_r->tprev)
+        rb_adq_r->tprev->tnext = rb_adq_r->tnext;
+    else
+        bucket->head = rb_adq_r->tnext;
+    if (rb_adq_r->tnext)
+        rb_adq_r->tnext->tprev = rb_adq_r->tprev;
+    else
+        bucket->tail = rb_adq_r->tprev;
+    rb_adq_r->tnext = rb_adq_r->tprev = NULL;
+    rb_adq_r->throttled = 0;
+    __atomic_sub_fetch(&bucket->queued, 1, __ATOMIC_RELAXED);
+}
+
+/* Hand waiting submissions to adns, as far as there are tokens for them. */
+static void state_pump(rb_adns_state_t *rb_ads_r)
+{
+    rb_adns_bucket_t *bucket = &rb_ads_r->bucket;
+    rb_adns_query_t *rb_adq_r;
+    int ecode;
+
+    while ((rb_adq_r = bucket->head) != NULL && state_take_token(rb_ads_r))
+    {
+        bucket_unlink(bucket, rb_adq_r);
+        __atomic_add_fetch(&bucket->throttled_ns, clock_ns() - rb_adq_r->t_submit, __ATOMIC_RELAXED);
+        ecode = query_adns_submit(rb_ads_r, rb_adq_r, rb_adq_r->op, rb_adq_r->owner, rb_adq_r->zone,
+                                  &rb_adq_r->addr, rb_adq_r->type, rb_adq_r->qflags,
+                                  rb_adq_r->iothread ? (void *)rb_adq_r : slab_handle(rb_adq_r));
+        if (!ecode)
+            continue;
+#ifdef RB_ADNS_IO_THREAD
+        if (rb_adq_r->iothread)
+        {
+            io_thread_complete(rb_ads_r, rb_adq_r, NULL, ecode);
+            continue;
+        }
+#endif
+        rb_adq_r->ecode = ecode; /* raised by check/wait */
+    }
+}
+
+#ifdef RB_ADNS_IO_THREAD
+/*
+ * io thread mode
+ *
+ * Only the io thread calls into adns. Ruby threads hand it submissions and
+ * cancellations through an intrusive multi-producer/single-consumer queue
+ * (Vyukov's), wake it through an eventfd (a pipe where there is none) and
+ * wait for completions on the query's condition variable, without the GVL.
+ * The queue itself takes no lock; rb_ads_r->lock only guards the completion
+ * fields of rb_adns_query_t.
+ */
+static void mpsc_push(rb_adns_state_t *rb_ads_r, rb_adns_request_t *req)
+{
+    rb_adns_request_t *prev;
+
+    req->next = NULL;
+    prev = __atomic_exchange_n(&rb_ads_r->qhead, req, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, req, __ATOMIC_RELEASE);
+}
+
+static rb_adns_request_t *mpsc_pop(rb_adns_state_t *rb_ads_r)
+{
+    rb_adns_request_t *tail = rb_ads_r->qtail;
+    rb_adns_request_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &rb_ads_r->qstub)
+    {
+        if (!next)
+            return NULL;
+        rb_ads_r->qtail = tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next)
+    {
+        rb_ads_r->qtail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&rb_ads_r->qhead, __ATOMIC_ACQUIRE))
+        return NULL; /* a producer is half way through mpsc_push, it will wake us */
+    mpsc_push(rb_ads_r, &rb_ads_r->qstub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next)
+    {
+        rb_ads_r->qtail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static void io_thread_wake(rb_adns_state_t *rb_ads_r)
+{
+    uint64_t one = 1;
+    /* one write per sleep is enough */
+    if (__atomic_exchange_n(&rb_ads_r->wake_pending, 1, __ATOMIC_ACQ_REL) == 0)
+        (void) !write(rb_ads_r->wakefd[1], &one, sizeof(one));
+}
+
+static void io_thread_enqueue(rb_adns_state_t *rb_ads_r, rb_adns_query_t *rb_adq_r, int op)
+{
+    rb_adns_request_t *req = &rb_adq_r->req;
+
+    if (op != RB_ADNS_OP_SUBMIT && op != RB_ADNS_OP_SUBMIT_REVERSE && op != RB_ADNS_OP_SUBMIT_REVERSE_ANY)
+    {
+        req = malloc(sizeof(rb_adns_request_t));
+        if (!req)
+            rb_raise(rb_eNoMemError, "%s", strerror(errno));
+    }
+    if (rb_adq_r)
+        __atomic_add_fetch(&rb_adq_r->refcnt, 1, __ATOMIC_ACQ_REL); /* io thread's */
+    req->op = op;
+    req->query = rb_adq_r;
+    req->cfgtxt = NULL;
+    mpsc_push(rb_ads_r, req);
+    io_thread_wake(rb_ads_r);
+}
+
+static void io_thread_enqueue_reconfigure(rb_adns_state_t *rb_ads_r, const char *cfgtxt)
+{
+    rb_adns_request_t *req = malloc(sizeof(rb_adns_request_t));
+
+    if (!req || !(req->cfgtxt = strdup(cfgtxt)))
+    {
+        free(req);
+        rb_raise(rb_eNoMemError, "%s", strerror(errno));
+    }
+    req->op = RB_ADNS_OP_RECONFIGURE;
+    req->query = NULL;
+    mpsc_push(rb_ads_r, req);
+    io_thread_wake(rb_ads_r);
+}
+
+static void io_thread_complete(rb_adns_state_t *rb_ads_r, rb_adns_query_t *rb_adq_r,
+                               adns_answer *answer_r, int ecode)
+{
+    if (answer_r)
+        query_mark_answered(rb_adq_r, answer_r);
+    (void) pthread_mutex_lock(&rb_ads_r->lock);
+    rb_adq_r->answer_r = answer_r;
+    rb_adq_r->ecode = ecode;
+    rb_adq_r->done = 1;
+    rb_ads_r->ncompleted++;
+    if (ecode)
+        rb_ads_r->nfailed++;
+    (void) pthread_cond_broadcast(&rb_adq_r->cond);
+    (void) pthread_cond_broadcast(&rb_ads_r->cond);
+    (void) pthread_mutex_unlock(&rb_ads_r->lock);
+    query_release(rb_adq_r);
+}
+
+static void io_thread_process(rb_adns_state_t *rb_ads_r, rb_adns_request_t *req)
+{
+    rb_adns_query_t *rb_adq_r = req->query;
+    int ecode;
+
+    switch (req->op)
+    {
+        case RB_ADNS_OP_CANCEL:
+            if (!rb_adq_r->done)
+            {
+                if (rb_adq_r->throttled)
+                    bucket_unlink(&rb_ads_r->bucket, rb_adq_r);
+                else
+                    (void) adns_cancel(rb_adq_r->adq);
+                rb_adq_r->adq = NULL;
+                io_thread_complete(rb_ads_r, rb_adq_r, NULL, ECANCELED);
+            }
+            query_release(rb_adq_r);
+            free(req);
+            return;
+        case RB_ADNS_OP_GLOBAL_SYSTEM_FAILURE:
+            (void) adns_globalsystemfailure(rb_ads_r->ads);
+            if (rb_ads_r->retired)
+                (void) adns_globalsystemfailure(rb_ads_r->retired);
+            free(req);
+            return;
+        case RB_ADNS_OP_RECONFIGURE:
+            free(rb_ads_r->pending_cfgtxt); /* superseded */
+            rb_ads_r->pending_cfgtxt = req->cfgtxt;
+            free(req);
+            return;
+    }
+    if (__atomic_load_n(&rb_ads_r->stop, __ATOMIC_ACQUIRE))
+        ecode = ECANCELED;
+    else if (rb_ads_r->bucket.head || !state_take_token(rb_ads_r))
+    {
+        bucket_enqueue(&rb_ads_r->bucket, rb_adq_r);
+        return;
+    }
+    else
+        ecode = query_adns_submit(rb_ads_r, rb_adq_r, req->op, rb_adq_r->owner, rb_adq_r->zone,
+                                  &rb_adq_r->addr, rb_adq_r->type, rb_adq_r->qflags, rb_adq_r);
+    if (ecode)
+        io_thread_complete(rb_ads_r, rb_adq_r, NULL, ecode);
+}
+
+static void io_thread_harvest(rb_adns_state_t *rb_ads_r, adns_state ads)
+{
+    adns_query adq;
+    adns_answer *answer_r;
+    void *context;
+
+    for (;;)
+    {
+        adq = NULL;
+        if (adns_check(ads, &adq, &answer_r, &context))
+            break; /* EAGAIN: nothing finished, ESRCH: nothing in flight */
+        ((rb_adns_query_t *)context)->adq = NULL;
+        io_thread_complete(rb_ads_r, (rb_adns_query_t *)context, answer_r, 0);
+    }
+}
+
+static void io_thread_cancel_all(rb_adns_state_t *rb_ads_r, adns_state ads)
+{
+    adns_query adq;
+    void *context;
+
+    for (;;)
+    {
+        adns_forallqueries_begin(ads);
+        if (!(adq = adns_forallqueries_next(ads, &context)))
+            break;
+        (void) adns_cancel(adq);
+        ((rb_adns_query_t *)context)->adq = NULL;
+        io_thread_complete(rb_ads_r, (rb_adns_query_t *)context, NULL, ECANCELED);
+    }
+}
+
+static void *io_thread_main(void *arg)
+{
+    rb_adns_state_t *rb_ads_r = (rb_adns_state_t *)arg;
+    struct pollfd fds_buf[1 + ADNS_POLLFDS_RECOMMENDED], *fds = fds_buf;
+    int fds_len = 1 + ADNS_POLLFDS_RECOMMENDED;
+    rb_adns_request_t *req;
+    struct timeval now;
+    char buf[64];
+    int nfds, nretired, timeout, ecode;
+    uint64_t t_poll;
+
+    for (;;)
+    {
+        while ((req = mpsc_pop(rb_ads_r)) != NULL)
+            io_thread_process(rb_ads_r, req);
+        state_pump(rb_ads_r);
+        io_thread_harvest(rb_ads_r, rb_ads_r->ads);
+        if (rb_ads_r->retired)
+        {
+            io_thread_harvest(rb_ads_r, rb_ads_r->retired);
+            state_reap_retired(rb_ads_r);
+        }
+        if (rb_ads_r->pending_cfgtxt && state_reconfigure(rb_ads_r, rb_ads_r->pending_cfgtxt))
+        {
+            free(rb_ads_r->pending_cfgtxt);
+            rb_ads_r->pending_cfgtxt = NULL;
+        }
+        if (__atomic_load_n(&rb_ads_r->stop, __ATOMIC_ACQUIRE))
+            break;
+        (void) gettimeofday(&now, NULL);
+        nfds = fds_len - 1;
+        nretired = 0;
+        timeout = -1;
+        ecode = adns_beforepoll(rb_ads_r->ads, fds + 1, &nfds, &timeout, &now);
+        if (!ecode && rb_ads_r->retired)
+        {
+            nretired = fds_len - 1 - nfds;
+            ecode = adns_beforepoll(rb_ads_r->retired, fds + 1 + nfds, &nretired, &timeout, &now);
+        }
+        if (rb_ads_r->bucket.head)
+        {
+            /* rate limited submissions waiting, wake up for the next token */
+            int delay = (int) (state_token_delay(rb_ads_r) * 1000) + 1;
+            if (timeout < 0 || delay < timeout)
+                timeout = delay;
+        }
+        if (ecode == ERANGE)
+        {
+            /* more adns sockets than we have room for, grow and go round again */
+            struct pollfd *grown = malloc(sizeof(struct pollfd) * fds_len * 2);
+            if (grown)
+            {
+                if (fds != fds_buf)
+                    free(fds);
+                fds = grown;
+                fds_len *= 2;
+            }
+            continue;
+        }
+        fds[0].fd = rb_ads_r->wakefd[0];
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        t_poll = RB_ADNS_PROBE_ENABLED(poll) ? clock_ns() : 0;
+        ecode = poll(fds, nfds + nretired + 1, timeout);
+        RB_ADNS_PROBE2(poll, ecode, clock_ns() - t_poll);
+        if (ecode < 0)
+            nfds = nretired = 0;
+        (void) gettimeofday(&now, NULL);
+        adns_afterpoll(rb_ads_r->ads, fds + 1, nfds, &now);
+        if (rb_ads_r->retired)
+            adns_afterpoll(rb_ads_r->retired, fds + 1 + nfds, nretired, &now);
+        if (fds[0].revents & POLLIN)
+        {
+            while (read(rb_ads_r->wakefd[0], buf, sizeof(buf)) > 0)
+                ;
+            (void) __atomic_exchange_n(&rb_ads_r->wake_pending, 0, __ATOMIC_ACQ_REL);
+        }
+    }
+    /* stopping: fail whatever is still queued or in flight */
+    while ((req = mpsc_pop(rb_ads_r)) != NULL)
+        io_thread_process(rb_ads_r, req);
+    while (rb_ads_r->bucket.head)
+    {
+        rb_adns_query_t *rb_adq_r = rb_ads_r->bucket.head;
+        bucket_unlink(&rb_ads_r->bucket, rb_adq_r);
+        io_thread_complete(rb_ads_r, rb_adq_r, NULL, ECANCELED);
+    }
+    io_thread_cancel_all(rb_ads_r, rb_ads_r->ads);
+    if (rb_ads_r->retired)
+    {
+        io_thread_cancel_all(rb_ads_r, rb_ads_r->retired);
+        state_reap_retired(rb_ads_r);
+    }
+    free(rb_ads_r->pending_cfgtxt);
+    rb_ads_r->pending_cfgtxt = NULL;
+    if (fds != fds_buf)
+        free(fds);
+    return NULL;
+}
+
+static void io_thread_stop(rb_adns_state_t *rb_ads_r)
+{
+    uint64_t one = 1;
+
+    if (!rb_ads_r->iothread)
+        return;
+    if (io_thread_lost(rb_ads_r))
+    {
+        /* nothing to join; adns may be mid-call in the parent's thread, leave it be */
+        (void) close(rb_ads_r->wakefd[0]);
+        if (rb_ads_r->wakefd[1] != rb_ads_r->wakefd[0])
+            (void) close(rb_ads_r->wakefd[1]);
+        rb_ads_r->ads = rb_ads_r->retired = NULL;
+        rb_ads_r->iothread = 0;
+        return;
+    }
+    __atomic_store_n(&rb_ads_r->stop, 1, __ATOMIC_RELEASE);
+    (void) !write(rb_ads_r->wakefd[1], &one, sizeof(one));
+    (void) pthread_join(rb_ads_r->thread, NULL);
+    (void) close(rb_ads_r->wakefd[0]);
+    if (rb_ads_r->wakefd[1] != rb_ads_r->wakefd[0])
+        (void) close(rb_ads_r->wakefd[1]);
+    rb_ads_r->iothread = 0;
+    /* threads in query_wait_iothread see stop, but may not have taken the lock yet */
+    (void) pthread_mutex_lock(&rb_ads_r->lock);
+    (void) pthread_cond_broadcast(&rb_ads_r->cond);
+    (void) pthread_mutex_unlock(&rb_ads_r->lock);
+    if (rb_ads_r->waiters > 0)
+    {
+        rb_ads_r->lock_kept = 1; /* destroyed by cState_free */
+        return;
+    }
+    (void) pthread_cond_destroy(&rb_ads_r->cond);
+    (void) pthread_mutex_destroy(&rb_ads_r->lock);
+}
+
+struct query_wait_args {
+    rb_adns_state_t *rb_ads_r;
+    rb_adns_query_t *rb_adq_r;      /* NULL: wait for any completion */
+    unsigned long ncompleted;       /* completion count seen before waiting for any */
+    struct timespec deadline;
+    int timed, timedout, interrupted;
+};
+
+static void *query_wait_nogvl(void *ptr)
+{
+    struct query_wait_args *args = (struct query_wait_args *)ptr;
+    rb_adns_state_t *rb_ads_r = args->rb_ads_r;
+    rb_adns_query_t *rb_adq_r = args->rb_adq_r;
+    pthread_cond_t *cond = rb_adq_r ? &rb_adq_r->cond : &rb_ads_r->cond;
+
+    (void) pthread_mutex_lock(&rb_ads_r->lock);
+    while (!args->interrupted &&
+           (rb_adq_r ? !rb_adq_r->done : rb_ads_r->ncompleted == args->ncompleted &&
+                                         !__atomic_load_n(&rb_ads_r->stop, __ATOMIC_ACQUIRE)))
+    {
+        if (!args->timed)
+            (void) pthread_cond_wait(cond, &rb_ads_r->lock);
+        else if (pthread_cond_timedwait(cond, &rb_ads_r->lock, &args->deadline) == ETIMEDOUT)
+        {
+            args->timedout = 1;
+            break;
+        }
+    }
+    (void) pthread_mutex_unlock(&rb_ads_r->lock);
+    return NULL;
+}
+
+static void query_wait_ubf(void *ptr)
+{
+    struct query_wait_args *args = (struct query_wait_args *)ptr;
+    rb_adns_state_t *rb_ads_r = args->rb_ads_r;
+
+    (void) pthread_mutex_lock(&rb_ads_r->lock);
+    args->interrupted = 1;
+    (void) pthread_cond_broadcast(args->rb_adq_r ? &args->rb_adq_r->cond : &rb_ads_r->cond);
+    (void) pthread_mutex_unlock(&rb_ads_r->lock);
+}
+
+static void query_wait_deadline(struct query_wait_args *args, double timeout)
+{
+    struct timeval now;
+    double t;
+
+    args->timed = timeout >= 0;
+    if (!args->timed)
+        return;
+    (void) gettimeofday(&now, NULL);
+    t = now.tv_sec + now.tv_usec / 1e6 + timeout;
+    args->deadline.tv_sec = (time_t)t;
+    args->deadline.tv_nsec = (long)((t - (time_t)t) * 1e9);
+}
+
+static VALUE query_wait_blocking(VALUE ptr)
+{
+    (void) rb_thread_call_without_gvl(query_wait_nogvl, (void *)ptr, query_wait_ubf, (void *)ptr);
+    return Qnil;
+}
+
+static VALUE query_wait_leave(VALUE ptr)
+{
+    ((struct query_wait_args *)ptr)->rb_ads_r->waiters--;
+    return Qnil;
+}
+
+/*
+ * Block, GVL released, until <rb_adq_r> (or any query if NULL) completes. Returns 0 on timeout.
+ * Once the io thread is stopped every query is done and the lock may be gone.
+ */
+static int query_wait_iothread(rb_adns_state_t *rb_ads_r, rb_adns_query_t *rb_adq_r,
+                               unsigned long ncompleted, double timeout)
+{
+    struct query_wait_args args;
+    uint64_t t_wait = RB_ADNS_PROBE_ENABLED(query__wait) ? clock_ns() : 0;
+
+    args.rb_ads_r = rb_ads_r;
+    args.rb_adq_r = rb_adq_r;
+    args.ncompleted = ncompleted;
+    args.timedout = 0;
+    query_wait_deadline(&args, timeout);
+    for (;;)
+    {
+        if (!rb_ads_r->iothread)
+            return rb_adq_r != NULL;
+        args.interrupted = 0;
+        rb_ads_r->waiters++; /* keeps io_thread_stop from destroying the lock under us */
+        (void) rb_ensure(query_wait_blocking, (VALUE)&args, query_wait_leave, (VALUE)&args);
+        if (args.timedout || !args.interrupted)
+        {
+            RB_ADNS_PROBE2(query__wait, rb_adq_r, clock_ns() - t_wait);
+            return !args.timedout;
+        }
+        rb_thread_check_ints(); /* Thread#raise, Thread#kill, signals */
+    }
+}
+
+/* Raise if <rb_adq_r> went to an io thread this process does not have, see io_thread_lost. */
+static void query_check_lost(rb_adns_query_t *rb_adq_r)
+{
+    if (io_thread_lost(rb_adq_r->rb_ads_r))
+        rb_raise(mADNS__eError, "io thread not inherited by fork, use a new state");
+}
+
+static int query_done(rb_adns_state_t *rb_ads_r, rb_adns_query_t *rb_adq_r)
+{
+    int done;
+    if (!rb_ads_r->iothread)
+        return rb_adq_r->done; /* stopped, the lock is gone */
+    (void) pthread_mutex_lock(&rb_ads_r->lock);
+    done = rb_adq_r->done;
+    (void) pthread_mutex_unlock(&rb_ads_r->lock);
+    return done;
+}
+
+static int inflight_sweep_i(VALUE query, VALUE value, VALUE arg)
+{
+    rb_adns_query_t *rb_adq_r;
+    Data_Get_Struct(query, rb_adns_query_t, rb_adq_r);
+    if (query_done(rb_adq_r->rb_ads_r, rb_adq_r) && (rb_adq_r->invalid || rb_adq_r->ecode))
+        return ST_DELETE;
+    return ST_CONTINUE;
+}
+
+/*
+ * Drop cancelled and locally failed queries from the in flight set once the io thread
+ * has completed them. Nothing is left to collect, check and wait still report the
+ * failure, and they no longer count as outstanding nor pin the Query object.
+ */
+static void state_sweep_inflight(rb_adns_state_t *rb_ads_r)
+{
+    unsigned long nfailed;
+
+    if (rb_ads_r->inflight == Qnil)
+        return;
+    if (rb_ads_r->iothread)
+    {
+        (void) pthread_mutex_lock(&rb_ads_r->lock);
+        nfailed = rb_ads_r->nfailed;
+        (void) pthread_mutex_unlock(&rb_ads_r->lock);
+    }
+    else
+        nfailed = rb_ads_r->nfailed;
+    if (nfailed == rb_ads_r->nswept)
+        return;
+    rb_ads_r->nswept = nfailed;
+    rb_hash_foreach(rb_ads_r->inflight, inflight_sweep_i, 0);
+}
+
+/*
+ * Turn a completed io thread query into its answer, dropping it from the in flight set.
+ * The timing hook is called if <report>, else left to the caller. A failed query stays
+ * valid, so checking it again raises the same error.
+ */
+static VALUE query_collect(VALUE query, rb_adns_query_t *rb_adq_r, int report)
+{
+    adns_answer *answer_r = rb_adq_r->answer_r;
+
+    (void) rb_hash_delete(rb_adq_r->rb_ads_r->inflight, query);
+    if (rb_adq_r->ecode)
+        rb_raise(mADNS__eError, "%s", strerror(rb_adq_r->ecode));
+    rb_adq_r->answer_r = NULL;
+    rb_adq_r->invalid = 1;
+    return report ? query_answered(query, rb_adq_r, answer_r) : query_build(query, rb_adq_r, answer_r);
+}
+#endif
+
+static VALUE cQuery_init(VALUE self)
+{
+    return self;
+}
+
+static void cQuery_mark(void *ptr)
+{
+    rb_adns_query_t *rb_adq_r = (rb_adns_query_t *)ptr;
+    rb_gc_mark(rb_adq_r->answer);
+    rb_gc_mark(rb_adq_r->state);
+}
+
+static void cQuery_free(void *ptr)
+{
+    query_release((rb_adns_query_t *)ptr);
+}
+
+#define RB_ADNS_EINVALID (-1) /* query_check: cancelled or already collected */
+
+/* Answer of <self> if it is in, else Qnil with *ecode_r set (EWOULDBLOCK while pending). */
+static VALUE query_check(VALUE self, int *ecode_r)
+{
+    rb_adns_query_t *rb_adq_r;
+    adns_answer *answer_r;
+    int ecode;
+    
+    Data_Get_Struct(self, rb_adns_query_t, rb_adq_r);
+    if (rb_adq_r->answer != Qnil)
+    {
+        query_take_hit(self, rb_adq_r);
+        return rb_adq_r->answer;
+    }
+#ifdef RB_ADNS_IO_THREAD
+    if (rb_adq_r->iothread)
+    {
+        query_check_lost(rb_adq_r);
+        *ecode_r = rb_adq_r->invalid ? RB_ADNS_EINVALID : EWOULDBLOCK;
+        if (rb_adq_r->invalid || !query_done(rb_adq_r->rb_ads_r, rb_adq_r))
+            return Qnil;
+        return query_collect(self, rb_adq_r, 1);
+    }
+#endif
+    if (rb_adq_r->throttled)
+    {
+        state_pump(rb_adq_r->rb_ads_r);
+        *ecode_r = EWOULDBLOCK;
+        if (rb_adq_r->throttled)
+            return Qnil;
+    }
+    if ((answer_r = rb_adq_r->answer_r) != NULL)
+    {
+        rb_adq_r->answer_r = NULL; /* taken by ready? */
+        return query_answered(self, rb_adq_r, answer_r);
+    }
+    *ecode_r = rb_adq_r->ecode ? rb_adq_r->ecode : RB_ADNS_EINVALID;
+    if (rb_adq_r->ecode || !rb_adq_r->adq)
+        return Qnil;
+    ecode = adns_check(rb_adq_r->ads, &rb_adq_r->adq, &answer_r, NULL);
+    if (ecode)
+    {
+        if (ecode != EWOULDBLOCK)
+        {
+            rb_adq_r->adq = NULL;
+            rb_adq_r->ecode = ecode; /* raised again by the next check */
+        }
+        *ecode_r = ecode;
+        return Qnil;
+    }
+    rb_adq_r->adq = NULL; /* mark query as completed, thus making it invalid */
+    state_reap_retired(rb_adq_r->rb_ads_r);
+    return query_answered(self, rb_adq_r, answer_r);
+}
+
+static void query_check_raise(int ecode)
+{
+    if (ecode == EWOULDBLOCK)
+        rb_raise(mADNS__eNotReadyError, "%s", strerror(ecode));
+    if (ecode == RB_ADNS_EINVALID)
+        rb_raise(mADNS__eQueryError, "invalid query");
+    rb_raise(mADNS__eError, "%s", strerror(ecode));
+}
+
+/*
+ * call-seq: check => Hash or raises ADNS::NotReadyError
+ *
+ * Check pending asynchronous request and retrieve answer or raises ADNS::NotReadyError, if request is still pending.
+ */
+static VALUE cQuery_check(VALUE self)
+{
+    VALUE answer;
+    int ecode = 0;
+
+    if ((answer = query_check(self, &ecode)) == Qnil)
+        query_check_raise(ecode);
+    return answer;
+}
+
+/*
+ * call-seq: check_nonblock => Hash or nil
+ *
+ * Like check, but returns nil while the request is pending instead of raising
+ * ADNS::NotReadyError, so polling many queries costs no exceptions. Invalid queries
+ * and local failures still raise.
+ */
+static VALUE cQuery_check_nonblock(VALUE self)
+{
+    VALUE answer;
+    int ecode = 0;
+
+    if ((answer = query_check(self, &ecode)) == Qnil && ecode != EWOULDBLOCK)
+        query_check_raise(ecode);
+    return answer;
+}
+
+/*
+ * call-seq: ready? => true or false
+ *
+ * False while the request is pending, true once check would not raise
+ * ADNS::NotReadyError. Never raises itself: the answer or error is left for check.
+ */
+static VALUE cQuery_is_ready(VALUE self)
+{
+    rb_adns_query_t *rb_adq_r;
+    adns_answer *answer_r;
+    int ecode;
+
+    Data_Get_Struct(self, rb_adns_query_t, rb_adq_r);
+    if (rb_adq_r->answer != Qnil)
+        return Qtrue;
+#ifdef RB_ADNS_IO_THREAD
+    if (rb_adq_r->iothread)
+    {
+        if (rb_adq_r->invalid || io_thread_lost(rb_adq_r->rb_ads_r))
+            return Qtrue;
+        return query_done(rb_adq_r->rb_ads_r, rb_adq_r) ? Qtrue : Qfalse;
+    }
+#endif
+    if (rb_adq_r->throttled)
+    {
+        state_pump(rb_adq_r->rb_ads_r);
+        if (rb_adq_r->throttled)
+            return Qfalse;
+    }
+    if (rb_adq_r->answer_r || rb_adq_r->ecode || !rb_adq_r->adq)
+        return Qtrue;
+    /* adns has no peek: keep the raw answer for check, which builds and reports it */
+    ecode = adns_check(rb_adq_r->ads, &rb_adq_r->adq, &answer_r, NULL);
+    if (ecode == EWOULDBLOCK)
+        return Qfalse;
+    rb_adq_r->adq = NULL;
+    if (ecode)
+        rb_adq_r->ecode = ecode;
+    else
+        rb_adq_r->answer_r = answer_r;
+    state_reap_retired(rb_adq_r->rb_ads_r);
+    return Qtrue;
+}
+
+/*
+ * call-seq: wait([timeout]) => Hash or nil
+ *
+ * Wait until answer is received, with the GVL released. An optional <timeout> in
+ * seconds makes it return nil if the answer is not in by then; the query stays
+ * pending.
+ */
+static VALUE cQuery_wait(int argc, VALUE argv[], VALUE self)
+{
+    rb_adns_query_t *rb_adq_r;
+    rb_adns_state_t *rb_ads_r;
+    VALUE answer;
+    double timeout = -1, delay;
+    uint64_t t_wait, deadline;
+    int ecode;
+    
+    if (argc > 1)
+        rb_raise(rb_eArgError, "excess number of arguments (%d for 1)", argc);
+    if (argc == 1 && argv[0] != Qnil)
+        timeout = NUM2DBL(argv[0]);
+    Data_Get_Struct(self, rb_adns_query_t, rb_adq_r);
+    if (rb_adq_r->answer != Qnil)
+    {
+        query_take_hit(self, rb_adq_r);
+        return rb_adq_r->answer;
+    }
+    rb_ads_r = rb_adq_r->rb_ads_r;
+#ifdef RB_ADNS_IO_THREAD
+    if (rb_adq_r->iothread)
+    {
+        query_check_lost(rb_adq_r);
+        if (rb_adq_r->invalid)
+            rb_raise(mADNS__eQueryError, "query invalidated");
+        if (!query_wait_iothread(rb_ads_r, rb_adq_r, 0, timeout))
+            return Qnil;
+        return query_collect(self, rb_adq_r, 1);
+    }
+#endif
+    t_wait = RB_ADNS_PROBE_ENABLED(query__wait) ? clock_ns() : 0;
+    deadline = timeout >= 0 ? clock_ns() + (uint64_t) (timeout * 1e9) : 0;
+    for (;;)
+    {
+        if ((answer = query_check(self, &ecode)) != Qnil)
+            break;
+        if (ecode != EWOULDBLOCK)
+            query_check_raise(ecode);
+        delay = -1;
+        if (timeout >= 0)
+        {
+            uint64_t now = clock_ns();
+            if (now >= deadline)
+                break;
+            delay = (deadline - now) / 1e9;
+        }
+        if (rb_adq_r->throttled && (delay < 0 || state_token_delay(rb_ads_r) < delay))
+            delay = state_token_delay(rb_ads_r);
+        adns_select_timeout(rb_ads_r, delay);
+    }
+    RB_ADNS_PROBE2(query__wait, rb_adq_r, clock_ns() - t_wait);
+    return answer;
+}
+
+/*
+ * call-seq: cancel() => nil
+ *
+ * Cancel current pending asynchronous request.
+ */
+static VALUE cQuery_cancel(VALUE self)
+{
+    rb_adns_query_t *rb_adq_r;
+    int ecode;
+    
+    Data_Get_Struct(self, rb_adns_query_t, rb_adq_r);
+    query_take_hit(self, rb_adq_r); /* then fails as answered */
+    RB_ADNS_PROBE4(query__cancel, rb_adq_r, rb_adq_r->owner, rb_adq_r->type,
+                   query_elapsed(rb_adq_r, clock_ns()));
+#ifdef RB_ADNS_IO_THREAD
+    if (rb_adq_r->iothread)
+    {
+        query_check_lost(rb_adq_r);
+        if (rb_adq_r->invalid || rb_adq_r->answer != Qnil ||
+            (query_done(rb_adq_r->rb_ads_r, rb_adq_r) && rb_adq_r->ecode))
+            rb_raise(mADNS__eQueryError, "query invalidated");
+        rb_adq_r->invalid = 1;
+        if (query_done(rb_adq_r->rb_ads_r, rb_adq_r))
+            (void) rb_hash_delete(rb_adq_r->rb_ads_r->inflight, self);
+        else /* completed_queries drops it once the io thread acknowledges */
+            io_thread_enqueue(rb_adq_r->rb_ads_r, rb_adq_r, RB_ADNS_OP_CANCEL);
+        return Qnil;
+    }
+#endif
+    if (rb_adq_r->throttled)
+    {
+        bucket_unlink(&rb_adq_r->rb_ads_r->bucket, rb_adq_r);
+        return Qnil;
+    }
+    if (!rb_adq_r->adq)
+        rb_raise(mADNS__eQueryError, "query invalidated");
+    (void) adns_cancel(rb_adq_r->adq);
+    rb_adq_r->adq = NULL; /* struct is still owned by the Query object */
+    return Qnil;
+}
+
+/* Copy names for a submission that happens later, see rb_adns_query_t. */
+static void query_keep_names(rb_adns_query_t *rb_adq_r, const char *owner, const char *zone)
+{
+    rb_adq_r->owner = owner ? strdup(owner) : NULL;
+    rb_adq_r->zone = zone ? strdup(zone) : NULL;
+    if ((owner && !rb_adq_r->owner) || (zone && !rb_adq_r->zone))
+        rb_raise(rb_eNoMemError, "%s", strerror(errno));
+}
+
+static int config_reload(rb_adns_config_t *rb_cfg_r, int strict)
+{
+    VALUE cfgtxt;
+    rb_adns_search_t search;
+
+    if (rb_cfg_r->path == Qnil)
+        return 0;
+    cfgtxt = resolv_conf_text(RSTRING_PTR(rb_cfg_r->path), rb_cfg_r->iflags, rb_cfg_r->st, strict);
+    rb_cfg_r->next_check = time(NULL) + rb_cfg_r->check_interval;
+    if (rb_cfg_r->cfgtxt != Qnil && rb_str_equal(cfgtxt, rb_cfg_r->cfgtxt) == Qtrue)
+        return 0;
+    search.list = Qnil;
+    parse_search_config(&search, cfgtxt, rb_cfg_r->iflags);
+    rb_cfg_r->cfgtxt = rb_str_freeze(cfgtxt);
+    rb_cfg_r->search = search;
+    rb_cfg_r->generation++;
+    return 1;
+}
+
+static void config_check(rb_adns_config_t *rb_cfg_r)
+{
+   /*
+    * Called on every submit, so this costs a time() call until check_interval
+    * has passed, and a stat() of each config file after that. The files are
+    * only read again if one looks different.
+    */
+    const char *files[RESOLV_CONF_FILES];
+    struct stat st, *last;
+    time_t now;
+    int idx;
+
+    if (rb_cfg_r->path == Qnil || rb_cfg_r->check_interval <= 0)
+        return;
+    if ((now = time(NULL)) < rb_cfg_r->next_check)
+        return;
+    rb_cfg_r->next_check = now + rb_cfg_r->check_interval;
+    resolv_conf_files(RSTRING_PTR(rb_cfg_r->path), rb_cfg_r->iflags, files);
+    for (idx=0; idx < RESOLV_CONF_FILES; idx++)
+    {
+        last = rb_cfg_r->st + idx;
+        if (!files[idx] || stat(files[idx], &st) == -1)
+            memset(&st, 0, sizeof(st));
+        if (st.st_mtime != last->st_mtime || st.st_size != last->st_size ||
+            st.st_ino != last->st_ino || st.st_dev != last->st_dev)
+        {
+            (void) config_reload(rb_cfg_r, 0);
+            return;
+        }
+    }
+}
+
+/* Reconfigure from <cfgtxt>, nameservers in nsorder. Returns 0 if an earlier swap is still draining. */
+static int state_apply_cfgtxt(rb_adns_state_t *rb_ads_r, VALUE cfgtxt)
+{
+    VALUE text = rb_ads_r->nsorder == Qnil ? cfgtxt : cfgtxt_reorder(cfgtxt, rb_ads_r->nsorder);
+#ifdef RB_ADNS_IO_THREAD
+    if (rb_ads_r->iothread)
+    {
+        io_thread_enqueue_reconfigure(rb_ads_r, RSTRING_PTR(text));
+        return 1;
+    }
+#endif
+    return state_reconfigure(rb_ads_r, RSTRING_PTR(text));
+}
+
+static void state_follow_config(rb_adns_state_t *rb_ads_r)
+{
+   /*
+    * Pick up a reloaded ADNS::Config or a new nameserver order: queries from now on
+    * go to a new adns state, those in flight drain on the retired one.
+    */
+    rb_adns_config_t *rb_cfg_r;
+
+    if (rb_ads_r->config != Qnil)
+    {
+        Data_Get_Struct(rb_ads_r->config, rb_adns_config_t, rb_cfg_r);
+        config_check(rb_cfg_r);
+        if (rb_cfg_r->generation != rb_ads_r->generation)
+        {
+            if (!state_apply_cfgtxt(rb_ads_r, rb_cfg_r->cfgtxt))
+                return; /* previous generation still draining, try again on next submit */
+            rb_ads_r->generation = rb_cfg_r->generation;
+            rb_ads_r->cfgtxt = rb_cfg_r->cfgtxt;
+            rb_ads_r->search = rb_cfg_r->search;
+            rb_ads_r->reorder_pending = 0;
+        }
+    }
+    if (rb_ads_r->reorder_pending && state_apply_cfgtxt(rb_ads_r, rb_ads_r->cfgtxt))
+        rb_ads_r->reorder_pending = 0;
+}
+
+/*
+ * Take a query struct from state <self>'s slab and wrap it in a ADNS::Query object, then submit it
+ * directly to adns or, in io thread mode, through the io thread's queue. With <nonblock> a local
+ * failure returns its errno as a Fixnum instead of raising.
+ */
+static VALUE query_submit(VALUE self, int op, const char *owner, const char *zone, struct sockaddr_in *addr,
+                          adns_rrtype type, adns_queryflags qflags, int nonblock)
+{
+    VALUE query; /* return instance */
+    rb_adns_state_t *rb_ads_r;
+    rb_adns_query_t *rb_adq_r;
+    int ecode;
+
+    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
+    if (!(rb_adq_r = slab_get(rb_ads_r->slab)))
+    {
+        ecode = errno;
+        if (nonblock)
+            return INT2FIX(ecode);
+        if (ecode == ENOMEM)
+            rb_raise(rb_eNoMemError, "%s", strerror(ecode));
+        rb_raise(mADNS__eError, "too many queries outstanding (%lu)", (unsigned long) SLAB_MAX_SLOTS);
+    }
+    rb_adq_r->rb_ads_r = rb_ads_r;
+    rb_adq_r->answer = Qnil;
+    rb_adq_r->state = self;
+    rb_adq_r->refcnt = 1;
+    rb_adq_r->type = type;
+    rb_adq_r->timed = rb_ads_r->timing_hook != Qnil || RB_ADNS_QUERY_PROBES_ENABLED();
+    rb_adq_r->t_submit = rb_adq_r->timed ? clock_ns() : 0;
+    RB_ADNS_PROBE4(query__submit, rb_adq_r, owner, type, qflags);
+    query = Data_Wrap_Struct(mADNS__cQuery, cQuery_mark, cQuery_free, rb_adq_r);
+    rb_adq_r->self = query;
+    if (!rb_adq_r->rb_ads_r->ads)
+    {
+        if (nonblock)
+            return INT2FIX(ESHUTDOWN);
+        rb_raise(mADNS__eError, "adns state finished");
+    }
+#ifdef RB_ADNS_IO_THREAD
+    if (rb_ads_r->iothread && io_thread_lost(rb_ads_r))
+    {
+        if (nonblock)
+            return INT2FIX(ESHUTDOWN);
+        rb_raise(mADNS__eError, "io thread not inherited by fork, use a new state");
+    }
+#endif
+    state_follow_config(rb_adq_r->rb_ads_r);
+    rb_adq_r->op = op;
+    rb_adq_r->qflags = qflags;
+    if (addr)
+        rb_adq_r->addr = *addr;
+    if (op == RB_ADNS_OP_SUBMIT && rb_ads_r->shm != Qnil)
+    {
+        rb_adns_shm_t *shm_r;
+        Data_Get_Struct(rb_ads_r->shm, rb_adns_shm_t, shm_r);
+        rb_adq_r->answer = shm_lookup(shm_r, owner, type, qflags);
+        if (rb_adq_r->answer != Qnil)
+        {
+            query_hit(query, rb_adq_r);
+            rb_obj_call_init(query, 0, 0);
+            return query;
+        }
+    }
+#ifdef RB_ADNS_IO_THREAD
+    if (rb_adq_r->rb_ads_r->iothread)
+    {
+        rb_adq_r->iothread = 1;
+        (void) pthread_cond_init(&rb_adq_r->cond, NULL);
+        query_keep_names(rb_adq_r, owner, zone);
+        state_sweep_inflight(rb_ads_r);
+        rb_hash_aset(rb_adq_r->rb_ads_r->inflight, query, Qtrue);
+        io_thread_enqueue(rb_adq_r->rb_ads_r, rb_adq_r, op);
+        rb_obj_call_init(query, 0, 0);
+        return query;
+    }
+#endif
+    if (rb_ads_r->bucket.head || !state_take_token(rb_ads_r))
+    {
+        /* rate limited, submitted by state_pump */
+        query_keep_names(rb_adq_r, owner, zone);
+        bucket_enqueue(&rb_ads_r->bucket, rb_adq_r);
+        rb_obj_call_init(query, 0, 0);
+        return query;
+    }
+    if (op == RB_ADNS_OP_SUBMIT && rb_ads_r->shm != Qnil)
+        query_keep_names(rb_adq_r, owner, zone); /* the key query_offer_shm stores under */
+    ecode = query_adns_submit(rb_adq_r->rb_ads_r, rb_adq_r, op, owner, zone, addr, type, qflags,
+                              slab_handle(rb_adq_r));
+    if (ecode)
+    {
+        if (nonblock)
+            return INT2FIX(ecode);
+        rb_raise(mADNS__eError, strerror(ecode));
+    }
+    rb_obj_call_init(query, 0, 0);
+    return query;
+}
+
+static VALUE state_submit(int argc, VALUE argv[], VALUE self, int nonblock)
+{
+    const char *owner;
+    adns_rrtype type;
+    adns_queryflags qflags = adns_qf_owner;
+    
+    if (argc < 2)
+        rb_raise(rb_eArgError, "wrong number of arguments (%d for 2)", argc);
+    else if (argc > 3)
+        rb_raise(rb_eArgError, "excess number of arguments (%d for 3)", argc);      
+    CHECK_TYPE(argv[0], T_STRING); /* DOMAIN */
+    CHECK_TYPE(argv[1], T_FIXNUM); /* RR */
+    if (argc == 3)
+        CHECK_TYPE(argv[2], T_FIXNUM); /* QFlags */
+    owner = STR2CSTR(argv[0]);
+    type = FIX2INT(argv[1]);
+    if (argc == 3)
+        qflags |= FIX2INT(argv[2]);
+    return query_submit(self, RB_ADNS_OP_SUBMIT, owner, NULL, NULL, type, qflags, nonblock);
+}
+
+/*
+ * call-seq: submit(domain, type[, qflags]) => ADNS::Query instance
+ *
+ * Submit asynchronous request to resolve domain <domain> of record type <type> using optional query flags <qflags>.
+ */
+static VALUE cState_submit(int argc, VALUE argv[], VALUE self)
+{
+    return state_submit(argc, argv, self, 0);
+}
+
+/*
+ * call-seq: submit_nonblock(domain, type[, qflags]) => ADNS::Query instance or Integer
+ *
+ * Like ADNS::State#submit, but a local failure returns its errno value (see Errno) instead
+ * of raising ADNS::Error, EAGAIN for instance when the state has as many queries outstanding
+ * as query handles can address. An invalid <domain> is not a local failure: its answer
+ * carries the status, as with submit.
+ */
+static VALUE cState_submit_nonblock(int argc, VALUE argv[], VALUE self)
+{
+    return state_submit(argc, argv, self, 1);
+}
+
+/*
+ * call-seq: submit_detached(domain, type[, qflags]) => ADNS::Query instance
+ *
+ * Like ADNS::State#submit, but the query never shows up in completed_queries: its answer
+ * is only returned by the Query's check, check_nonblock and wait. Used for the candidates
+ * of submit_search.
+ */
+static VALUE cState_submit_detached(int argc, VALUE argv[], VALUE self)
+{
+    VALUE query;
+    rb_adns_query_t *rb_adq_r;
+
+    query = state_submit(argc, argv, self, 0);
+    Data_Get_Struct(query, rb_adns_query_t, rb_adq_r);
+    rb_adq_r->detached = 1;
+    query_take_hit(query, rb_adq_r); /* a shared cache hit is already held for completed_queries */
+    return query;
+}
+
+static VALUE state_submit_reverse(int argc, VALUE argv[], VALUE self, int nonblock)
+{
+    const char *owner;
+    struct sockaddr_in addr;
+    adns_rrtype type;
+    adns_queryflags qflags = adns_qf_owner;
+    int ecode;
+    
+    if (argc < 2)
+        rb_raise(rb_eArgError, "wrong number of arguments (%d for 2)", argc);
+    if (argc > 3)
+        rb_raise(rb_eArgError, "excess number of arguments (%d for 2)", argc);
+    CHECK_TYPE(argv[0], T_STRING);
+    CHECK_TYPE(argv[1], T_FIXNUM);
+    if (argc == 3)
+        CHECK_TYPE(argv[2], T_FIXNUM);
+    owner = STR2CSTR(argv[0]);
+    type = FIX2INT(argv[1]);
+    if (argc == 3)
+        qflags |= FIX2INT(argv[2]);
+    switch(type)
+    {
+        case adns_r_ptr:
+        case adns_r_ptr_raw:
+            break;
+        default:
+            rb_raise(rb_eArgError, "invalid record type (PTR or PTR_RAW record expected)");
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    ecode = inet_aton(owner, &addr.sin_addr);
+    if (ecode == 0)
+    {
+        if (nonblock)
+            return INT2FIX(EINVAL);
+        rb_raise(mADNS__eQueryError, "invalid ip address");
+    }
+    return query_submit(self, RB_ADNS_OP_SUBMIT_REVERSE, NULL, NULL, &addr, type, qflags, nonblock);
+}
+
+/*
+ * call-seq: submit_reverse(ipaddr, type[, qflags]) => ADNS::Query object
+ *
+ * Submit asynchronous request to reverse lookup address <ipaddr> using optional query flags <qflags>.
+ * Note: <type> can only be ADNS::RR::PTR or ADNS::RR::PTR_RAW  
+ */
+static VALUE cState_submit_reverse(int argc, VALUE argv[], VALUE self)
+{
+    return state_submit_reverse(argc, argv, self, 0);
+}
+
+/*
+ * call-seq: submit_reverse_nonblock(ipaddr, type[, qflags]) => ADNS::Query object or Integer
+ *
+ * Like ADNS::State#submit_reverse, but an invalid <ipaddr> returns EINVAL and other local
+ * failures their errno value instead of raising.
+ */
+static VALUE cState_submit_reverse_nonblock(int argc, VALUE argv[], VALUE self)
+{
+    return state_submit_reverse(argc, argv, self, 1);
+}
+
+static VALUE state_submit_reverse_any(int argc, VALUE argv[], VALUE self, int nonblock)
+{
+    const char *owner;
+    struct sockaddr_in addr;
+    const char *zone; /* in-addr.arpa or any other reverse zones */
+    adns_rrtype type = adns_r_none;
+    adns_queryflags qflags = adns_qf_owner;
+    int ecode;
+   
+    if (argc < 3)
+        rb_raise(rb_eArgError, "wrong number of arguments (%d for 3)", argc);
+    if (argc > 4)
+        rb_raise(rb_eArgError, "excess number of arguments (%d for 4)", argc);
+    CHECK_TYPE(argv[0], T_STRING); /* IP */
+    CHECK_TYPE(argv[1], T_STRING); /* Zone */
+    CHECK_TYPE(argv[2], T_FIXNUM); /* RR */
+    if (argc == 4)
+        CHECK_TYPE(argv[3], T_FIXNUM); /* )); */
+    owner = STR2CSTR(argv[0]);
+    zone = STR2CSTR(argv[1]);
+    type = FIX2INT(argv[2]);
+    if (argc == 4)
+        qflags |= FIX2INT(argv[3]);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    ecode = inet_aton(owner, &addr.sin_addr);
+    if (ecode == 0)
+    {
+        if (nonblock)
+            return INT2FIX(EINVAL);
+        rb_raise(mADNS__eQueryError, "invalid ip address");
+    }
+    return query_submit(self, RB_ADNS_OP_SUBMIT_REVERSE_ANY, NULL, zone, &addr, type, qflags, nonblock);
+}
+
+/*
+ * call-seq: submit_reverse_any(ip_addr, type[, qflags])    => ADNS::Query instance
+ * 
+ * Submit asynchronous request to reverse lookup address <ipaddr> using optional query flags <qflags>.
+ * Note: <type> can any resource record.  
+ */
+static VALUE cState_submit_reverse_any(int argc, VALUE argv[], VALUE self)
+{
+    return state_submit_reverse_any(argc, argv, self, 0);
+}
+
+/*
+ * call-seq: submit_reverse_any_nonblock(ip_addr, zone, type[, qflags]) => ADNS::Query instance or Integer
+ *
+ * Like ADNS::State#submit_reverse_any, with the errors of ADNS::State#submit_reverse_nonblock.
+ */
+static VALUE cState_submit_reverse_any_nonblock(int argc, VALUE argv[], VALUE self)
+{
+    return state_submit_reverse_any(argc, argv, self, 1);
+}
+
+#ifdef RB_ADNS_IO_THREAD
+static VALUE completed_queries_iothread(rb_adns_state_t *rb_ads_r, VALUE query_list, double timeout)
+{
+    VALUE pending, query_ctx;
+    rb_adns_query_t *rb_adq_r;
+    unsigned long ncompleted = 0;
+    long idx, first = RARRAY_LEN(query_list);
+
+    if (io_thread_lost(rb_ads_r))
+        rb_raise(mADNS__eError, "io thread not inherited by fork, use a new state");
+    for (;;)
+    {
+        if (rb_ads_r->iothread) /* else finished by another thread while we waited */
+        {
+            (void) pthread_mutex_lock(&rb_ads_r->lock);
+            ncompleted = rb_ads_r->ncompleted;
+            (void) pthread_mutex_unlock(&rb_ads_r->lock);
+        }
+        state_sweep_inflight(rb_ads_r);
+        pending = rb_funcall(rb_ads_r->inflight, rb_intern("keys"), 0);
+        for (idx=0; idx < RARRAY_LEN(pending); idx++)
+        {
+            query_ctx = rb_ary_entry(pending, idx);
+            Data_Get_Struct(query_ctx, rb_adns_query_t, rb_adq_r);
+            if (rb_adq_r->detached || !query_done(rb_ads_r, rb_adq_r))
+                continue;
+            if (rb_adq_r->invalid || rb_adq_r->ecode) /* cancelled, or failed: check/wait report it */
+            {
+                (void) rb_hash_delete(rb_ads_r->inflight, query_ctx);
+                continue;
+            }
+            (void) query_collect(query_ctx, rb_adq_r, 0);
+            rb_ary_push(query_list, query_ctx);
+        }
+        if (RARRAY_LEN(query_list) > 0 || timeout <= 0 || RHASH_SIZE(rb_ads_r->inflight) == 0)
+            break;
+        if (!query_wait_iothread(rb_ads_r, NULL, ncompleted, timeout))
+            timeout = 0; /* one last look */
+    }
+    state_report_timings(rb_ads_r, query_list, first);
+    return query_list;
+}
+#endif
+
+/*
+ * call-seq: completed()    => Array
+ *
+ * Returns an array of all the completed (ADNS::Query) queries submitted using ADNS::State.submit_*() methods.
+ */
+static VALUE cState_completed_queries(int argc, VALUE argv[], VALUE self)
+{
+    VALUE a1, query_list;
+    void *context; /* slab_handle of the query, passed from one of the submit_* */
+    rb_adns_state_t *rb_ads_r;
+    rb_adns_query_t *rb_adq_r;
+    adns_state ads;
+    adns_query adq;
+    adns_answer *answer_r;
+    double timeout;
+    uint64_t t_wait;
+    long first;
+    int ecode;
+
+    if (argc == 1)
+    {
+        a1 = argv[0];
+        CHECK_TYPE(a1, T_FLOAT);
+    }
+    else
+        a1 = rb_float_new(0.0);
+    timeout = (double) RFLOAT_VALUE(a1);
+    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
+    query_list = state_take_hits(rb_ads_r);
+    if (RARRAY_LEN(query_list) > 0)
+        timeout = 0; /* have something to return already */
+#ifdef RB_ADNS_IO_THREAD
+    if (rb_ads_r->iothread)
+        return completed_queries_iothread(rb_ads_r, query_list, timeout);
+#endif
+    if (!rb_ads_r->ads)
+        rb_raise(mADNS__eError, "adns state finished");
+    first = RARRAY_LEN(query_list);
+    state_pump(rb_ads_r);
+    if (rb_ads_r->bucket.head && state_token_delay(rb_ads_r) < timeout)
+        timeout = state_token_delay(rb_ads_r);
+    t_wait = RB_ADNS_PROBE_ENABLED(query__wait) ? clock_ns() : 0;
+    (void) adns_select_timeout(rb_ads_r, timeout);
+    RB_ADNS_PROBE2(query__wait, (rb_adns_query_t *)NULL, clock_ns() - t_wait);
+    state_pump(rb_ads_r);
+    for (ads = rb_ads_r->ads; ads; ads = (ads == rb_ads_r->retired ? NULL : rb_ads_r->retired))
+    for (adns_forallqueries_begin(ads);
+         (adq = adns_forallqueries_next(ads, &context)) != 0;)
+    {
+        rb_adq_r = slab_lookup(rb_ads_r->slab, context);
+        if (rb_adq_r && rb_adq_r->detached)
+            continue; /* left for its own check or wait */
+        ecode = adns_check(ads, &adq, &answer_r, &context);
+        if (ecode) /* EWOULDBLOCK */
+            continue;
+        if (!rb_adq_r)
+        {
+            free(answer_r); /* its Query is gone */
+            continue;
+        }
+        rb_adq_r->adq = NULL;
+        rb_ary_push(query_list, rb_adq_r->self);
+        (void) query_build(rb_adq_r->self, rb_adq_r, answer_r);
+    }
+    state_reap_retired(rb_ads_r);
+    state_report_timings(rb_ads_r, query_list, first);
+    return query_list;
+}
+
+/*
+ * call-seq: synchronous(domain, type[, qflags]) => Hash
+ *
+ * Submit synchronous request to resolve domain <domain> of record type <type> using optional query flags <qflags>.
+ */
+static VALUE cState_synchronous(int argc, VALUE argv[], VALUE self)
+{
+    VALUE answer = rb_hash_new(); /* return instance */
+    rb_adns_state_t *rb_ads_r;
+    adns_answer *answer_r;
+    adns_queryflags qflags = adns_qf_owner;
+    adns_rrtype type = adns_r_none;
+    const char *owner;
+    int ecode;
+    
+    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
+    if (argc < 2)
+        rb_raise(rb_eArgError, "wrong number of arguments (%d for 2)", argc);
+    if (argc > 3)
+        rb_raise(rb_eArgError, "excess number of arguments (%d for 3)", argc);
+    CHECK_TYPE(argv[0], T_STRING); /* DOMAIN */
+    CHECK_TYPE(argv[1], T_FIXNUM); /* RR */
+    if (argc == 3)
+        CHECK_TYPE(argv[2], T_FIXNUM); /* QFlags */
+    owner = STR2CSTR(argv[0]);
+    type = FIX2INT(argv[1]);
+    if (argc == 3)
+        qflags |= FIX2INT(argv[2]);
+    if (rb_ads_r->iothread || rb_ads_r->bucket.rate > 0 || rb_ads_r->shm != Qnil)
+    {
+        /* through the io thread, the rate limiter or the shared cache */
+        VALUE query = query_submit(self, RB_ADNS_OP_SUBMIT, owner, NULL, NULL, type, qflags, 0);
+        answer = rb_obj_dup(cQuery_wait(0, NULL, query));
+        if (RARRAY_LEN(rb_hash_aref(answer, CSTR2SYM("answer"))) == 0)
+            rb_hash_aset(answer, CSTR2SYM("answer"), Qnil);
+        return answer;
+    }
+    if (!rb_ads_r->ads)
+        rb_raise(mADNS__eError, "adns state finished");
+    state_follow_config(rb_ads_r);
+    ecode = adns_synchronous(rb_ads_r->ads, owner, type, qflags, &answer_r);
     if (ecode)
-        rb_raise(mADNS__eError, strerror(ecode));
-    rb_obj_call_init(query, 0, 0);
-    return query;
+        rb_raise(mADNS__eError, adns_strerror(ecode));
+    /* populate return hash */
+    rb_hash_aset(answer, CSTR2SYM("type"), INT2FIX(answer_r->type));
+    rb_hash_aset(answer, CSTR2SYM("owner"), CSTR2STR(answer_r->owner));
+    rb_hash_aset(answer, CSTR2SYM("status"), INT2FIX(answer_r->status));
+    rb_hash_aset(answer, CSTR2SYM("expires"), INT2FIX(answer_r->expires));
+    rb_hash_aset(answer, CSTR2SYM("answer"), Qnil);
+    if (answer_r->nrrs == 0)
+        return answer;
+    else
+        rb_hash_aset(answer, CSTR2SYM("answer"), parse_adns_answer(answer_r));
+    return answer;
+}
+
+/*
+ * call-seq: global_system_failure() => nil
+ *
+ * Call this function, If serious problem(s) occurs with adns library.
+ * All currently outstanding queries will be made to fail with ADNS::Status::SystemFail
+ * status code and adns library will close any stream sockets it has open since inception.
+ */
+static VALUE cState_global_system_failure(VALUE self)
+{
+    rb_adns_state_t *rb_ads_r;
+    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
+#ifdef RB_ADNS_IO_THREAD
+    if (rb_ads_r->iothread)
+    {
+        io_thread_enqueue(rb_ads_r, NULL, RB_ADNS_OP_GLOBAL_SYSTEM_FAILURE);
+        return Qnil;
+    }
+#endif
+    if (!rb_ads_r->ads)
+        rb_raise(mADNS__eError, "adns state finished");
+    (void) adns_globalsystemfailure(rb_ads_r->ads);
+    if (rb_ads_r->retired)
+        (void) adns_globalsystemfailure(rb_ads_r->retired);
+    return Qnil;
+}
+
+/*
+ * call-seq: start_io_thread() => self
+ *
+ * Hand adns over to a native background thread which alone calls into adns from now on.
+ * Submissions from any number of Ruby threads go through a lock-free queue, and
+ * ADNS::Query#wait, ADNS::State#completed_queries and ADNS::State#synchronous block
+ * with the GVL released until the io thread signals completion.
+ * Must be called before any query is submitted, or once all of them, including rate
+ * limited ones still queued, are answered or cancelled; raises ADNS::QueryError otherwise.
+ * The thread does not survive fork: in a child the state raises ADNS::Error on use
+ * and finish or garbage collection drop it without touching the parent's queries.
+ */
+static VALUE cState_start_io_thread(VALUE self)
+{
+    rb_adns_state_t *rb_ads_r;
+#ifdef RB_ADNS_IO_THREAD
+    sigset_t all, old;
+    int ecode;
+#endif
+
+    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
+    if (rb_ads_r->iothread)
+        return self;
+#ifdef RB_ADNS_IO_THREAD
+    if (!rb_ads_r->ads)
+        rb_raise(mADNS__eError, "adns state finished");
+    /* rate limited submissions queued in direct mode carry slab handles, not struct pointers */
+    if (adns_state_busy(rb_ads_r->ads) || rb_ads_r->retired || rb_ads_r->bucket.head)
+        rb_raise(mADNS__eQueryError, "queries outstanding");
+#ifdef HAVE_SYS_EVENTFD_H
+    rb_ads_r->wakefd[0] = rb_ads_r->wakefd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (rb_ads_r->wakefd[0] == -1)
+        rb_raise(mADNS__eError, "%s", strerror(errno));
+#else
+    if (pipe(rb_ads_r->wakefd) == -1)
+        rb_raise(mADNS__eError, "%s", strerror(errno));
+    (void) fcntl(rb_ads_r->wakefd[0], F_SETFL, O_NONBLOCK);
+    (void) fcntl(rb_ads_r->wakefd[1], F_SETFL, O_NONBLOCK);
+    (void) fcntl(rb_ads_r->wakefd[0], F_SETFD, FD_CLOEXEC);
+    (void) fcntl(rb_ads_r->wakefd[1], F_SETFD, FD_CLOEXEC);
+#endif
+    (void) pthread_mutex_init(&rb_ads_r->lock, NULL);
+    (void) pthread_cond_init(&rb_ads_r->cond, NULL);
+    rb_ads_r->ncompleted = 0;
+    rb_ads_r->nfailed = rb_ads_r->nswept = 0;
+    rb_ads_r->stop = 0;
+    rb_ads_r->wake_pending = 0;
+    rb_ads_r->qstub.next = NULL;
+    rb_ads_r->qhead = rb_ads_r->qtail = &rb_ads_r->qstub;
+    rb_ads_r->pending_cfgtxt = NULL;
+    rb_ads_r->inflight = rb_hash_new();
+    /* signals are Ruby's business, keep them off the io thread */
+    (void) sigfillset(&all);
+    (void) pthread_sigmask(SIG_SETMASK, &all, &old);
+    ecode = pthread_create(&rb_ads_r->thread, NULL, io_thread_main, rb_ads_r);
+    (void) pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ecode)
+    {
+        (void) close(rb_ads_r->wakefd[0]);
+        if (rb_ads_r->wakefd[1] != rb_ads_r->wakefd[0])
+            (void) close(rb_ads_r->wakefd[1]);
+        (void) pthread_cond_destroy(&rb_ads_r->cond);
+        (void) pthread_mutex_destroy(&rb_ads_r->lock);
+        rb_raise(mADNS__eError, "%s", strerror(ecode));
+    }
+    rb_ads_r->owner = rb_adns_pid;
+    rb_ads_r->iothread = 1;
+    return self;
+#else
+    rb_raise(rb_eNotImpError, "io thread mode needs pthreads and rb_thread_call_without_gvl()");
+#endif
+}
+
+/*
+ * call-seq: io_thread?() => true or false
+ *
+ * Check whether adns is driven by a background io thread, see ADNS::State#start_io_thread.
+ */
+static VALUE cState_is_io_thread(VALUE self)
+{
+    rb_adns_state_t *rb_ads_r;
+    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
+    return rb_ads_r->iothread ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq: search_list() => Array
+ *
+ * Returns the domain search list (resolv.conf 'search'/'domain') used to expand
+ * queries submitted with ADNS::QF::SEARCH.
+ */
+static VALUE cState_search_list(VALUE self)
+{
+    rb_adns_state_t *rb_ads_r;
+    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
+    parse_search_config(&rb_ads_r->search, rb_ads_r->cfgtxt, rb_ads_r->iflags);
+    return rb_ads_r->search.list;
+}
+
+/*
+ * call-seq: ndots() => Integer
+ *
+ * Returns the resolv.conf 'ndots' option: domains with at least this many dots are
+ * tried as is before the search list is applied.
+ */
+static VALUE cState_ndots(VALUE self)
+{
+    rb_adns_state_t *rb_ads_r;
+    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
+    parse_search_config(&rb_ads_r->search, rb_ads_r->cfgtxt, rb_ads_r->iflags);
+    return INT2FIX(rb_ads_r->search.ndots);
+}
+
+static VALUE cState_initialize(int argc, VALUE argv[], VALUE self)
+{
+    return self;
+}
+
+static void cState_free(void *ptr)
+{
+    rb_adns_state_t *rb_ads_r = (rb_adns_state_t *) ptr;
+#ifdef RB_ADNS_IO_THREAD
+    io_thread_stop(rb_ads_r);
+    if (rb_ads_r->lock_kept)
+    {
+        (void) pthread_cond_destroy(&rb_ads_r->cond);
+        (void) pthread_mutex_destroy(&rb_ads_r->lock);
+    }
+#endif
+    if (rb_ads_r->ads)
+        (void) adns_finish(rb_ads_r->ads);
+    if (rb_ads_r->retired)
+        (void) adns_finish(rb_ads_r->retired);
+    slab_unref(rb_ads_r->slab); /* the state's */
+    if (rb_ads_r->diagfile)
+        (void) fclose(rb_ads_r->diagfile);
+    free(rb_ads_r);
+}
+
+static void cState_mark(void *ptr)
+{
+    rb_adns_state_t *rb_ads_r = (rb_adns_state_t *) ptr;
+    rb_gc_mark(rb_ads_r->cfgtxt);
+    rb_gc_mark(rb_ads_r->search.list);
+    rb_gc_mark(rb_ads_r->config);
+    rb_gc_mark(rb_ads_r->timing_hook);
+    rb_gc_mark(rb_ads_r->shm);
+    rb_gc_mark(rb_ads_r->nsorder);
+    rb_gc_mark(rb_ads_r->hits);
+    rb_gc_mark(rb_ads_r->inflight);
+    rb_gc_mark(rb_ads_r->selectors);
+    if (!rb_ads_r->iothread)
+    {
+        /* queries adns or the rate limiter still have are reachable through completed_queries */
+        rb_adns_slab_t *slab = rb_ads_r->slab;
+        rb_adns_query_t *slot;
+        long idx;
+        for (idx=0; idx < slab->nchunks * SLAB_CHUNK_SLOTS; idx++)
+        {
+            slot = slab->chunks[idx / SLAB_CHUNK_SLOTS] + idx % SLAB_CHUNK_SLOTS;
+            if (slot->in_use && (slot->adq || slot->throttled))
+                rb_gc_mark(slot->self);
+        }
+    }
+}
+
+static rb_adns_state_t *state_alloc(void)
+{
+    rb_adns_state_t *rb_ads_r = ALLOC(rb_adns_state_t);
+
+    MEMZERO(rb_ads_r, rb_adns_state_t, 1);
+    rb_ads_r->cfgtxt = Qnil;
+    rb_ads_r->search.list = Qnil;
+    rb_ads_r->config = Qnil;
+    rb_ads_r->timing_hook = Qnil;
+    rb_ads_r->shm = Qnil;
+    rb_ads_r->nsorder = Qnil;
+    rb_ads_r->hits = Qnil;
+    rb_ads_r->inflight = Qnil;
+    rb_ads_r->selectors = Qnil;
+    rb_ads_r->slab = slab_new();
+    return rb_ads_r;
+}
+
+static void state_open_diagfile(rb_adns_state_t *rb_ads_r, int argc, VALUE argv[])
+{
+    const char *fname, *fmode;
+
+    if (argc < 1)
+        return;
+    CHECK_TYPE(argv[0], T_STRING);
+    fname = STR2CSTR(argv[0]);
+    if (argc == 2)
+    {
+        CHECK_TYPE(argv[1], T_STRING);
+        fmode = STR2CSTR(argv[1]);
+    } else
+        fmode = DEFAULT_DIAG_FILEMODE;
+    rb_ads_r->diagfile = fopen(fname, fmode);
+    if (!rb_ads_r->diagfile)
+        rb_raise(rb_eIOError, "%s - %s", strerror(errno), fname);
+}
+
+/*
+ * call-seq: new([iflags, filename, filemode])  => ADNS::State object
+ *
+ * Create new ADNS::State object and initialize adns library using optional initialization
+ * flags <iflags>, debug log to filename <filename> (*only available if ADNS::IF::DEBUG flag is given*),
+ * debug log filemode <filemode>.
+ */
+static VALUE cState_new(int argc, VALUE argv[], VALUE self)
+{
+    VALUE state; /* return instance */
+    rb_adns_state_t *rb_ads_r = state_alloc();
+    adns_initflags iflags = adns_if_none;
+    
+    if (argc > 3)
+        rb_raise(rb_eArgError, "excess number of arguments (%d for 3)", argc);
+    if (argc >= 1)
+    {
+        CHECK_TYPE(argv[0], T_FIXNUM);
+        iflags |= FIX2INT(argv[0]);
+        state_open_diagfile(rb_ads_r, argc - 1, argv + 1);
+    }
+    rb_ads_r->iflags = iflags;
+    /* what adns_init reads, environment included, for nameservers= and the search list */
+    rb_ads_r->cfgtxt = rb_str_freeze(resolv_conf_text(DEFAULT_RESOLV_CONF, iflags, NULL, 0));
+    adns_init(&rb_ads_r->ads, iflags, rb_ads_r->diagfile);
+    state = Data_Wrap_Struct(mADNS__cState, cState_mark, cState_free, rb_ads_r);
+    rb_obj_call_init(state, 0, 0);
+    return state;
+}
+
+/*
+ * call-seq: new2(configtext, [iflags, filename, filemode]) => ADNS::State object
+ *
+ * Create new ADNS::State object and initialize adns library using resolve.conf style
+ * configuration text and optional initialization
+ * flags <iflags>, debug log to filename <filename> (*only available if ADNS::IF::DEBUG flag is given*),
+ * debug log filemode <filemode>.
+ */
+static VALUE cState_new2(int argc, VALUE argv[], VALUE self)
+{
+    VALUE state; /* return instance */
+    rb_adns_state_t *rb_ads_r;
+    adns_initflags iflags = adns_if_none;
+    const char *cfgtxt;
+    
+    if (argc < 1)
+        rb_raise(rb_eArgError, "wrong number of arguments (%d for 1)", argc);
+    else if (argc > 4)
+        rb_raise(rb_eArgError, "excess number of arguments (%d for 4)", argc);
+    CHECK_TYPE(argv[0], T_STRING);
+    cfgtxt = STR2CSTR(argv[0]);
+    if (argc >= 2)
+    {
+        CHECK_TYPE(argv[1], T_FIXNUM);
+        iflags |= FIX2INT(argv[1]);
+    }
+    rb_ads_r = state_alloc();
+    state_open_diagfile(rb_ads_r, argc - 2, argv + 2);
+    rb_ads_r->iflags = iflags;
+    rb_ads_r->cfgtxt = rb_str_new2(cfgtxt);
+    adns_init_strcfg(&rb_ads_r->ads, iflags, rb_ads_r->diagfile, cfgtxt);
+    state = Data_Wrap_Struct(mADNS__cState, cState_mark, cState_free, rb_ads_r);
+    rb_obj_call_init(state, 0, 0);
+    return state;
+}
+
+/*
+ * call-seq: finish() => nil
+ *
+ * Finish all the outstanding queries associated with the ADNS::State instance,
+ * stop its io thread and close its sockets. Outstanding queries are invalidated,
+ * and submitting or collecting on the state raises ADNS::Error from now on.
+ */
+static VALUE cState_finish(VALUE self)
+{
+    rb_adns_state_t *rb_ads_r;
+    rb_adns_slab_t *slab;
+    rb_adns_query_t *slot;
+    long idx;
+
+    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
+#ifdef RB_ADNS_IO_THREAD
+    io_thread_stop(rb_ads_r); /* fails queries still in flight */
+    state_sweep_inflight(rb_ads_r);
+#endif
+    /* direct mode queries must not reach into the adns states about to go */
+    slab = rb_ads_r->slab;
+    for (idx=0; idx < slab->nchunks * SLAB_CHUNK_SLOTS; idx++)
+    {
+        slot = slab->chunks[idx / SLAB_CHUNK_SLOTS] + idx % SLAB_CHUNK_SLOTS;
+        if (!slot->in_use || slot->iothread)
+            continue;
+        if (slot->throttled)
+            bucket_unlink(&rb_ads_r->bucket, slot);
+        slot->adq = NULL;
+    }
+    state_wait_selects(rb_ads_r);
+    if (rb_ads_r->ads)
+        (void) adns_finish(rb_ads_r->ads);
+    if (rb_ads_r->retired)
+        (void) adns_finish(rb_ads_r->retired);
+    rb_ads_r->ads = rb_ads_r->retired = NULL;
+    return Qnil;
+}
+
+/*
+ * call-seq: config() => ADNS::Config or nil
+ *
+ * Returns the ADNS::Config the state was created from, see ADNS::Config#new_state.
+ */
+static VALUE cState_config(VALUE self)
+{
+    rb_adns_state_t *rb_ads_r;
+    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
+    return rb_ads_r->config;
+}
+
+/*
+ * call-seq: timing_hook() => callable or nil
+ *
+ * Returns the hook set by ADNS::State#timing_hook=.
+ */
+static VALUE cState_timing_hook(VALUE self)
+{
+    rb_adns_state_t *rb_ads_r;
+    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
+    return rb_ads_r->timing_hook;
+}
+
+/*
+ * call-seq: timing_hook=(callable)
+ *
+ * Call <callable> with each query as its answer is built, and a Hash of the seconds
+ * elapsed from submit until :sent (handed to adns), :answered (answer received) and
+ * :built (answer Hash ready). A phase not reached is nil, as are all phases of queries
+ * submitted before the hook was set. nil removes the hook.
+ *
+ * completed_queries calls the hook once its list is complete. If a call raises, the
+ * exception propagates and the list is returned by the next completed_queries instead.
+ *
+ *  adns.timing_hook = lambda {|query, t| stats.record(t[:answered], t[:built] - t[:answered]) }
+ */
+static VALUE cState_set_timing_hook(VALUE self, VALUE hook)
+{
+    rb_adns_state_t *rb_ads_r;
+    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
+    if (hook != Qnil && !rb_respond_to(hook, rb_intern("call")))
+        rb_raise(rb_eTypeError, "timing hook must respond to call");
+    rb_ads_r->timing_hook = hook;
+    return hook;
 }
 
 /*
- * call-seq: submit_reverse(ipaddr, type[, qflags]) => ADNS::Query object
+ * call-seq: slab_stats() => Hash
  *
- * Submit asynchronous request to reverse lookup address <ipaddr> using optional query flags <qflags>.
- * Note: <type> can only be ADNS::RR::PTR or ADNS::RR::PTR_RAW  
+ * Returns occupancy of the slab query structs are allocated from: :slots allocated
+ * (in :chunks of :chunk_slots each), :used by live ADNS::Query objects or in flight,
+ * :free for reuse and the :peak of :used.
  */
-static VALUE cState_submit_reverse(int argc, VALUE argv[], VALUE self)
+static VALUE cState_slab_stats(VALUE self)
 {
-    VALUE query; /* return instance */
-    rb_adns_query_t *rb_adq_r = ALLOC(rb_adns_query_t);
-    const char *owner;
-    struct sockaddr_in addr;
-    adns_rrtype type;
-    adns_queryflags qflags = adns_qf_owner;
-    int idx, ecode;
-    
-    if (argc < 2)
-        rb_raise(rb_eArgError, "wrong number of arguments (%d for 2)", argc);
-    if (argc > 3)
+    VALUE stats = rb_hash_new();
+    rb_adns_state_t *rb_ads_r;
+    rb_adns_slab_t *slab;
+    long nslots, nused, peak, nchunks;
+
+    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
+    slab = rb_ads_r->slab;
+    SLAB_LOCK(slab);
+    nchunks = slab->nchunks;
+    nslots = nchunks * SLAB_CHUNK_SLOTS;
+    nused = slab->nused;
+    peak = slab->peak;
+    SLAB_UNLOCK(slab);
+    rb_hash_aset(stats, CSTR2SYM("chunk_slots"), INT2FIX(SLAB_CHUNK_SLOTS));
+    rb_hash_aset(stats, CSTR2SYM("chunks"), LONG2NUM(nchunks));
+    rb_hash_aset(stats, CSTR2SYM("slots"), LONG2NUM(nslots));
+    rb_hash_aset(stats, CSTR2SYM("used"), LONG2NUM(nused));
+    rb_hash_aset(stats, CSTR2SYM("free"), LONG2NUM(nslots - nused));
+    rb_hash_aset(stats, CSTR2SYM("peak"), LONG2NUM(peak));
+    return stats;
+}
+
+/*
+ * call-seq: set_rate_limit(qps[, burst]) => self
+ *
+ * Hand at most <qps> submissions per second to adns, in bursts of up to <burst> (default:
+ * one second's worth). Submissions over the limit are queued in order and released as
+ * tokens come in; they show up as not ready until then. nil or 0 lifts the limit.
+ */
+static VALUE cState_set_rate_limit(int argc, VALUE argv[], VALUE self)
+{
+    rb_adns_state_t *rb_ads_r;
+    rb_adns_bucket_t *bucket;
+    double rate = 0, burst;
+    uint64_t now;
+
+    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
+    if (argc < 1)
+        rb_raise(rb_eArgError, "wrong number of arguments (%d for 1)", argc);
+    if (argc > 2)
         rb_raise(rb_eArgError, "excess number of arguments (%d for 2)", argc);
-    CHECK_TYPE(argv[0], T_STRING);
-    CHECK_TYPE(argv[1], T_FIXNUM);
-    if (argc == 3)
-        CHECK_TYPE(argv[2], T_FIXNUM);
-    owner = STR2CSTR(argv[0]);
-    type = FIX2INT(argv[1]);
-    if (argc == 3)
-        qflags |= FIX2INT(argv[2]);
-    switch(type)
+    if (argv[0] != Qnil)
+        rate = NUM2DBL(argv[0]);
+    burst = (argc == 2 && argv[1] != Qnil) ? NUM2DBL(argv[1]) : rate;
+    if (rate < 0 || (rate > 0 && burst < 1))
+        rb_raise(rb_eArgError, "qps must not be negative, burst at least 1");
+    bucket = &rb_ads_r->bucket;
+    now = clock_ns();
+    BUCKET_LOCK(rb_ads_r);
+    if (bucket->rate > 0)
+        bucket_refill(bucket, now);
+    else
+        bucket->tokens = burst; /* start full */
+    bucket->rate = rate;
+    bucket->burst = burst;
+    if (bucket->tokens > burst)
+        bucket->tokens = burst;
+    bucket->last = now;
+    BUCKET_UNLOCK(rb_ads_r);
+#ifdef RB_ADNS_IO_THREAD
+    if (rb_ads_r->iothread)
     {
-        case adns_r_ptr:
-        case adns_r_ptr_raw:
-            break;
-        default:
-            rb_raise(rb_eArgError, "invalid record type (PTR or PTR_RAW record expected)");
+        io_thread_wake(rb_ads_r);
+        return self;
     }
-    addr.sin_family = AF_INET;
-    ecode = inet_aton(owner, &addr.sin_addr);
-    if (ecode == -1)
-        rb_raise(mADNS__eQueryError, "invalid ip address");
-    Data_Get_Struct(self, rb_adns_state_t, rb_adq_r->rb_ads_r);
-    rb_adq_r->answer = Qnil;
-    query = Data_Wrap_Struct(mADNS__cQuery, cQuery_mark, cQuery_free, rb_adq_r);
-    rb_obj_call_init(query, 0, 0);
-    ecode = adns_submit_reverse(rb_adq_r->rb_ads_r->ads, (struct sockaddr *) &addr,
-                                type, qflags, (void *)query, &rb_adq_r->adq);
-    if (ecode)
-        rb_raise(mADNS__eError, strerror(ecode));
-    return query;
+#endif
+    state_pump(rb_ads_r);
+    return self;
 }
 
 /*
- * call-seq: submit_reverse_any(ip_addr, type[, qflags])    => ADNS::Query instance
- * 
- * Submit asynchronous request to reverse lookup address <ipaddr> using optional query flags <qflags>.
- * Note: <type> can any resource record.  
+ * call-seq: throttle_stats() => Hash
+ *
+ * Returns the rate limit (:qps, :burst), the :tokens left, the number of submissions
+ * :queued now, the number :throttled so far and the total seconds they spent queued
+ * (:throttled_time).
  */
-static VALUE cState_submit_reverse_any(int argc, VALUE argv[], VALUE self)
+static VALUE cState_throttle_stats(VALUE self)
 {
-    VALUE query; /* return instance */
-    rb_adns_query_t *rb_adq_r = ALLOC(rb_adns_query_t);
-    const char *owner;
-    struct sockaddr_in addr;
-    const char *zone; /* in-addr.arpa or any other reverse zones */
-    adns_rrtype type = adns_r_none;
-    adns_queryflags qflags = adns_qf_owner;
-    int idx, ecode;
-   
-    Data_Get_Struct(self, rb_adns_state_t, rb_adq_r->rb_ads_r);
-    if (argc < 3)
-        rb_raise(rb_eArgError, "wrong number of arguments (%d for 3)", argc);
-    if (argc > 4)
-        rb_raise(rb_eArgError, "excess number of arguments (%d for 4)", argc);
-    CHECK_TYPE(argv[0], T_STRING); /* IP */
-    CHECK_TYPE(argv[1], T_STRING); /* Zone */
-    CHECK_TYPE(argv[2], T_FIXNUM); /* RR */
-    if (argc == 4)
-        CHECK_TYPE(argv[3], T_FIXNUM); /* )); */
-    owner = STR2CSTR(argv[0]);
-    zone = STR2CSTR(argv[1]);
-    type = FIX2INT(argv[2]);
-    if (argc == 4)
-        qflags |= FIX2INT(argv[3]);
-    addr.sin_family = AF_INET;
-    ecode = inet_aton(owner, &addr.sin_addr);
-    if (ecode == 0)
-        rb_raise(mADNS__eQueryError, "invalid ip address");
-    rb_adq_r->answer = Qnil;
-    query = Data_Wrap_Struct(mADNS__cQuery, cQuery_mark, cQuery_free, rb_adq_r);
-    rb_obj_call_init(query, 0, 0);
-    ecode = adns_submit_reverse_any(rb_adq_r->rb_ads_r->ads, (struct sockaddr*)&addr,
-                                    zone, type, qflags, (void *)query, &rb_adq_r->adq);
+    VALUE stats = rb_hash_new();
+    rb_adns_state_t *rb_ads_r;
+    rb_adns_bucket_t *bucket;
+    double rate, burst, tokens;
+
+    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
+    bucket = &rb_ads_r->bucket;
+    BUCKET_LOCK(rb_ads_r);
+    if (bucket->rate > 0)
+        bucket_refill(bucket, clock_ns());
+    rate = bucket->rate;
+    burst = bucket->burst;
+    tokens = bucket->tokens;
+    BUCKET_UNLOCK(rb_ads_r);
+    rb_hash_aset(stats, CSTR2SYM("qps"), rb_float_new(rate));
+    rb_hash_aset(stats, CSTR2SYM("burst"), rb_float_new(burst));
+    rb_hash_aset(stats, CSTR2SYM("tokens"), rb_float_new(tokens));
+    rb_hash_aset(stats, CSTR2SYM("queued"), LONG2NUM(__atomic_load_n(&bucket->queued, __ATOMIC_RELAXED)));
+    rb_hash_aset(stats, CSTR2SYM("throttled"), ULONG2NUM(__atomic_load_n(&bucket->throttled, __ATOMIC_RELAXED)));
+    rb_hash_aset(stats, CSTR2SYM("throttled_time"),
+                 rb_float_new(__atomic_load_n(&bucket->throttled_ns, __ATOMIC_RELAXED) / 1e9));
+    return stats;
+}
+
+/*
+ * call-seq: shared_cache() => ADNS::SharedCache or nil
+ *
+ * Returns the cache set by ADNS::State#shared_cache=.
+ */
+static VALUE cState_shared_cache(VALUE self)
+{
+    rb_adns_state_t *rb_ads_r;
+    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
+    return rb_ads_r->shm;
+}
+
+/*
+ * call-seq: shared_cache=(cache) => cache
+ *
+ * Answer ADNS::State#submit and ADNS::State#synchronous from ADNS::SharedCache <cache>
+ * while the stored answer has not expired, and store the answers of the submissions
+ * it could not answer. Answers from the cache are ready at once and show up in the next
+ * ADNS::State#completed_queries like any other. nil detaches the cache.
+ */
+static VALUE cState_set_shared_cache(VALUE self, VALUE cache)
+{
+    rb_adns_state_t *rb_ads_r;
+    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
+    if (cache != Qnil && !rb_obj_is_kind_of(cache, mADNS__cSharedCache))
+        rb_raise(rb_eTypeError, "wrong argument type %s (expected ADNS::SharedCache)",
+                 rb_obj_classname(cache));
+    if (rb_ads_r->hits == Qnil)
+        rb_ads_r->hits = rb_hash_new();
+    rb_ads_r->shm = cache;
+    return cache;
+}
+
+/*
+ * call-seq: nameservers() => Array
+ *
+ * Returns the configured nameserver addresses in the order adns asks them, see
+ * ADNS::State#nameservers=.
+ */
+static VALUE cState_nameservers(VALUE self)
+{
+    rb_adns_state_t *rb_ads_r;
+    VALUE cfgtxt;
+
+    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
+    cfgtxt = rb_ads_r->cfgtxt;
+    if (rb_ads_r->nsorder != Qnil)
+        cfgtxt = cfgtxt_reorder(cfgtxt, rb_ads_r->nsorder);
+    return cfgtxt_nameservers(cfgtxt);
+}
+
+/*
+ * call-seq: nameservers=(addresses) => addresses
+ *
+ * Ask the configured nameservers listed in <addresses> first, in that order, and the
+ * others after them as configured; nil restores the configured order. Addresses that
+ * are not configured are ignored. The order survives config reloads. Like a reloaded
+ * ADNS::Config, it takes effect on the next submit; queries in flight finish with the
+ * previous order.
+ */
+static VALUE cState_set_nameservers(VALUE self, VALUE order)
+{
+    rb_adns_state_t *rb_ads_r;
+    long idx;
+
+    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
+    if (order != Qnil)
+    {
+        CHECK_TYPE(order, T_ARRAY);
+        for (idx=0; idx < RARRAY_LEN(order); idx++)
+            CHECK_TYPE(rb_ary_entry(order, idx), T_STRING);
+        order = rb_ary_dup(order);
+        OBJ_FREEZE(order);
+    }
+    if (!rb_ads_r->ads)
+        rb_raise(mADNS__eError, "adns state finished");
+    rb_ads_r->nsorder = order;
+    rb_ads_r->reorder_pending = 1; /* applied by state_follow_config */
+    return order;
+}
+
+static void cConfig_free(void *ptr)
+{
+    free(ptr);
+}
+
+static void cConfig_mark(void *ptr)
+{
+    rb_adns_config_t *rb_cfg_r = (rb_adns_config_t *) ptr;
+    rb_gc_mark(rb_cfg_r->cfgtxt);
+    rb_gc_mark(rb_cfg_r->path);
+    rb_gc_mark(rb_cfg_r->search.list);
+}
+
+static VALUE cConfig_initialize(int argc, VALUE argv[], VALUE self)
+{
+    return self;
+}
+
+static rb_adns_config_t *config_alloc(void)
+{
+    rb_adns_config_t *rb_cfg_r = ALLOC(rb_adns_config_t);
+
+    MEMZERO(rb_cfg_r, rb_adns_config_t, 1);
+    rb_cfg_r->cfgtxt = Qnil;
+    rb_cfg_r->path = Qnil;
+    rb_cfg_r->search.list = Qnil;
+    return rb_cfg_r;
+}
+
+/*
+ * call-seq: new([filename, iflags]) => ADNS::Config object
+ *
+ * Read the configuration adns_init() would, with resolv.conf style file <filename>
+ * (default /etc/resolv.conf) in place of /etc/resolv.conf: that file, /etc/resolv-adns.conf
+ * and, unless ADNS::IF::NOENV is given in <iflags>, the RES_CONF, ADNS_RES_CONF,
+ * RES_CONF_TEXT, ADNS_RES_CONF_TEXT, RES_OPTIONS, ADNS_RES_OPTIONS, LOCALDOMAIN and
+ * ADNS_LOCALDOMAIN environment variables. The files are checked for changes at most
+ * every check_interval seconds as queries are submitted.
+ */
+static VALUE cConfig_new(int argc, VALUE argv[], VALUE self)
+{
+    VALUE config; /* return instance */
+    rb_adns_config_t *rb_cfg_r = config_alloc();
+
+    config = Data_Wrap_Struct(mADNS__cConfig, cConfig_mark, cConfig_free, rb_cfg_r);
+    if (argc > 2)
+        rb_raise(rb_eArgError, "excess number of arguments (%d for 2)", argc);
+    if (argc >= 1)
+        CHECK_TYPE(argv[0], T_STRING);
+    if (argc == 2)
+    {
+        CHECK_TYPE(argv[1], T_FIXNUM);
+        rb_cfg_r->iflags = FIX2INT(argv[1]);
+    }
+    rb_cfg_r->path = rb_str_freeze(argc >= 1 ? rb_str_dup(argv[0]) : rb_str_new2(DEFAULT_RESOLV_CONF));
+    rb_cfg_r->check_interval = DEFAULT_CONFIG_CHECK_INTERVAL;
+    (void) config_reload(rb_cfg_r, 1);
+    rb_obj_call_init(config, 0, 0);
+    return config;
+}
+
+/*
+ * call-seq: new2(configtext) => ADNS::Config object
+ *
+ * Parse resolv.conf style configuration text <configtext> once. Such a config is never
+ * reloaded.
+ */
+static VALUE cConfig_new2(VALUE self, VALUE cfgtxt)
+{
+    VALUE config; /* return instance */
+    rb_adns_config_t *rb_cfg_r = config_alloc();
+
+    config = Data_Wrap_Struct(mADNS__cConfig, cConfig_mark, cConfig_free, rb_cfg_r);
+    CHECK_TYPE(cfgtxt, T_STRING);
+    rb_cfg_r->cfgtxt = rb_str_freeze(rb_str_dup(cfgtxt));
+    parse_search_config(&rb_cfg_r->search, rb_cfg_r->cfgtxt, rb_cfg_r->iflags);
+    rb_cfg_r->generation = 1;
+    rb_obj_call_init(config, 0, 0);
+    return config;
+}
+
+/*
+ * call-seq: new_state([iflags, filename, filemode]) => ADNS::State object
+ *
+ * Create new ADNS::State object from the parsed configuration, using optional initialization
+ * flags <iflags>, debug log to filename <filename> (*only available if ADNS::IF::DEBUG flag is given*),
+ * debug log filemode <filemode>. No files or environment variables are read and the search
+ * list is shared, which makes this much cheaper than ADNS::State.new for short lived states.
+ * The state follows later reloads of the config: queries in flight finish on the previous
+ * setup, new ones use the new one.
+ */
+static VALUE cConfig_new_state(int argc, VALUE argv[], VALUE self)
+{
+    VALUE state; /* return instance */
+    rb_adns_config_t *rb_cfg_r;
+    rb_adns_state_t *rb_ads_r;
+    adns_initflags iflags = adns_if_none;
+    int ecode;
+
+    Data_Get_Struct(self, rb_adns_config_t, rb_cfg_r);
+    if (argc > 3)
+        rb_raise(rb_eArgError, "excess number of arguments (%d for 3)", argc);
+    if (argc >= 1)
+        CHECK_TYPE(argv[0], T_FIXNUM);
+    config_check(rb_cfg_r);
+    rb_ads_r = state_alloc();
+    state = Data_Wrap_Struct(mADNS__cState, cState_mark, cState_free, rb_ads_r);
+    if (argc >= 1)
+    {
+        iflags |= FIX2INT(argv[0]);
+        state_open_diagfile(rb_ads_r, argc - 1, argv + 1);
+    }
+    rb_ads_r->iflags = iflags;
+    rb_ads_r->config = self;
+    rb_ads_r->generation = rb_cfg_r->generation;
+    rb_ads_r->cfgtxt = rb_cfg_r->cfgtxt;
+    rb_ads_r->search = rb_cfg_r->search;
+    ecode = adns_init_strcfg(&rb_ads_r->ads, iflags, rb_ads_r->diagfile, RSTRING_PTR(rb_cfg_r->cfgtxt));
     if (ecode)
-        rb_raise(mADNS__eError, strerror(ecode));
-    return query;
+    {
+        rb_ads_r->ads = NULL;
+        rb_raise(mADNS__eError, "%s", strerror(ecode));
+    }
+    rb_obj_call_init(state, 0, 0);
+    return state;
+}
+
+/*
+ * call-seq: reload() => true or false
+ *
+ * Read the configuration file again now. Returns true if its contents changed, in which
+ * case states created by new_state switch over on their next submit.
+ */
+static VALUE cConfig_reload(VALUE self)
+{
+    rb_adns_config_t *rb_cfg_r;
+    Data_Get_Struct(self, rb_adns_config_t, rb_cfg_r);
+    return config_reload(rb_cfg_r, 1) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq: text() => String
+ *
+ * Returns the configuration text handed to adns.
+ */
+static VALUE cConfig_text(VALUE self)
+{
+    rb_adns_config_t *rb_cfg_r;
+    Data_Get_Struct(self, rb_adns_config_t, rb_cfg_r);
+    return rb_cfg_r->cfgtxt;
+}
+
+/*
+ * call-seq: path() => String or nil
+ *
+ * Returns the configuration file name, nil for configs made by new2.
+ */
+static VALUE cConfig_path(VALUE self)
+{
+    rb_adns_config_t *rb_cfg_r;
+    Data_Get_Struct(self, rb_adns_config_t, rb_cfg_r);
+    return rb_cfg_r->path;
+}
+
+/*
+ * call-seq: search_list() => Array
+ *
+ * Returns the parsed domain search list, see ADNS::State#search_list.
+ */
+static VALUE cConfig_search_list(VALUE self)
+{
+    rb_adns_config_t *rb_cfg_r;
+    Data_Get_Struct(self, rb_adns_config_t, rb_cfg_r);
+    return rb_cfg_r->search.list;
+}
+
+/*
+ * call-seq: ndots() => Integer
+ *
+ * Returns the parsed 'ndots' option, see ADNS::State#ndots.
+ */
+static VALUE cConfig_ndots(VALUE self)
+{
+    rb_adns_config_t *rb_cfg_r;
+    Data_Get_Struct(self, rb_adns_config_t, rb_cfg_r);
+    return INT2FIX(rb_cfg_r->search.ndots);
+}
+
+/*
+ * call-seq: generation() => Integer
+ *
+ * Returns a counter bumped each time the configuration text changes.
+ */
+static VALUE cConfig_generation(VALUE self)
+{
+    rb_adns_config_t *rb_cfg_r;
+    Data_Get_Struct(self, rb_adns_config_t, rb_cfg_r);
+    return ULONG2NUM(rb_cfg_r->generation);
+}
+
+/*
+ * call-seq: check_interval() => Integer
+ *
+ * Returns the minimum number of seconds between checks of the configuration file for
+ * changes, 0 if it is never checked.
+ */
+static VALUE cConfig_check_interval(VALUE self)
+{
+    rb_adns_config_t *rb_cfg_r;
+    Data_Get_Struct(self, rb_adns_config_t, rb_cfg_r);
+    return INT2FIX(rb_cfg_r->check_interval);
+}
+
+/*
+ * call-seq: check_interval=(seconds)
+ *
+ * Set the minimum number of seconds between checks of the configuration file for changes,
+ * 0 disables checking (ADNS::Config#reload still works).
+ */
+static VALUE cConfig_set_check_interval(VALUE self, VALUE seconds)
+{
+    rb_adns_config_t *rb_cfg_r;
+    Data_Get_Struct(self, rb_adns_config_t, rb_cfg_r);
+    CHECK_TYPE(seconds, T_FIXNUM);
+    rb_cfg_r->check_interval = FIX2INT(seconds);
+    rb_cfg_r->next_check = time(NULL) + rb_cfg_r->check_interval;
+    return seconds;
+}
+
+static void cSharedCache_free(void *ptr)
+{
+    rb_adns_shm_t *shm_r = (rb_adns_shm_t *) ptr;
+    if (shm_r->header)
+        (void) munmap(shm_r->header, shm_r->size);
+    free(shm_r);
+}
+
+static void cSharedCache_mark(void *ptr)
+{
+    rb_gc_mark(((rb_adns_shm_t *) ptr)->path);
+}
+
+static VALUE cSharedCache_initialize(int argc, VALUE argv[], VALUE self)
+{
+    return self;
+}
+
+/* Fill in the header of a zeroed mapping, magic last. */
+static void shm_setup(rb_adns_shm_header_t *header, uint32_t nslots, uint32_t slot_size)
+{
+    header->nslots = nslots;
+    header->slot_size = slot_size;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->magic, SHM_MAGIC, sizeof(header->magic));
+}
+
+/* Map cache file <path>, setting it up unless another process already has. Returns 0 or an errno. */
+static int shm_map_file(rb_adns_shm_t *shm_r, const char *path, uint32_t nslots, uint32_t slot_size)
+{
+    rb_adns_shm_header_t header;
+    struct stat st;
+    int fd, fresh = 0, ecode = 0;
+    void *map;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return errno;
+    (void) flock(fd, LOCK_EX);
+    MEMZERO(&header, rb_adns_shm_header_t, 1);
+    if (fstat(fd, &st) == -1)
+        ecode = errno;
+    else if (st.st_uid != geteuid() || (st.st_mode & 022))
+        ecode = EPERM; /* others could plant answers */
+    else if (st.st_size > 0 && pread(fd, &header, sizeof(header), 0) != sizeof(header))
+        ecode = EINVAL;
+    else if (header.magic[0] == '\0') /* new, or its creator died half way */
+    {
+        fresh = 1;
+        if (ftruncate(fd, 0) == -1 ||
+            ftruncate(fd, sizeof(header) + (off_t) nslots * slot_size) == -1)
+            ecode = errno;
+    }
+    else if (memcmp(header.magic, SHM_MAGIC, sizeof(header.magic)) ||
+             header.nslots < SHM_WAYS || header.nslots % SHM_WAYS ||
+             header.slot_size < sizeof(rb_adns_shm_slot_t) ||
+             st.st_size != (off_t)(sizeof(header) + (off_t) header.nslots * header.slot_size))
+        ecode = EINVAL;
+    else
+    {
+        nslots = header.nslots;
+        slot_size = header.slot_size;
+    }
+    if (!ecode)
+    {
+        shm_r->size = sizeof(header) + (size_t) nslots * slot_size;
+        map = mmap(NULL, shm_r->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+            ecode = errno;
+        else
+        {
+            shm_r->header = map;
+            shm_r->nslots = nslots;
+            shm_r->slot_size = slot_size;
+            if (fresh)
+                shm_setup(shm_r->header, nslots, slot_size);
+        }
+    }
+    (void) flock(fd, LOCK_UN); /* the mapping keeps the file open past close */
+    (void) close(fd);
+    return ecode;
 }
 
 /*
- * call-seq: completed()    => Array
+ * call-seq: new([filename, slots, slot_size]) => ADNS::SharedCache object
  *
- * Returns an array of all the completed (ADNS::Query) queries submitted using ADNS::State.submit_*() methods.
+ * Map the answer cache file <filename>, creating it with room for <slots> answers (default
+ * 4096) of up to <slot_size> bytes each (default 512) unless it exists; an existing file
+ * keeps its geometry. Every process mapping the file shares the answers. Without
+ * <filename> the cache is an anonymous mapping, shared with processes forked later.
+ * The file must belong to the effective user and not be writable by group or others.
  */
-static VALUE cState_completed_queries(int argc, VALUE argv[], VALUE self)
+static VALUE cSharedCache_new(int argc, VALUE argv[], VALUE self)
 {
-    VALUE a1, query_list = rb_ary_new();
-    VALUE query_ctx; /* ADNS::Query context passed from one of the submit_* */
-    rb_adns_state_t *rb_ads_r;
-    rb_adns_query_t *rb_adq_r;
-    adns_query adq;
-    adns_answer *answer_r;
-    double timeout;
+    VALUE cache; /* return instance */
+    rb_adns_shm_t *shm_r = ALLOC(rb_adns_shm_t);
+    long nslots = DEFAULT_SHM_SLOTS, slot_size = DEFAULT_SHM_SLOT_SIZE;
+    void *map;
     int ecode;
 
-    if (argc == 1)
+    MEMZERO(shm_r, rb_adns_shm_t, 1);
+    shm_r->path = Qnil;
+    cache = Data_Wrap_Struct(mADNS__cSharedCache, cSharedCache_mark, cSharedCache_free, shm_r);
+    if (argc > 3)
+        rb_raise(rb_eArgError, "excess number of arguments (%d for 3)", argc);
+    if (argc >= 1 && argv[0] != Qnil)
     {
-        a1 = argv[0];
-        CHECK_TYPE(a1, T_FLOAT);
+        CHECK_TYPE(argv[0], T_STRING);
+        shm_r->path = rb_str_freeze(rb_str_dup(argv[0]));
     }
-    else
-        a1 = rb_float_new(0.0);
-    timeout = (double) RFLOAT_VALUE(a1);
-    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
-    (void) adns_select_timeout(rb_ads_r, timeout);
-    for (adns_forallqueries_begin(rb_ads_r->ads);
-         (adq = adns_forallqueries_next(rb_ads_r->ads, 0)) != 0;)
+    if (argc >= 2)
+    {
+        CHECK_TYPE(argv[1], T_FIXNUM);
+        nslots = FIX2LONG(argv[1]);
+    }
+    if (argc == 3)
+    {
+        CHECK_TYPE(argv[2], T_FIXNUM);
+        slot_size = FIX2LONG(argv[2]);
+    }
+    if (nslots < 1 || nslots > (1L << 24))
+        rb_raise(rb_eArgError, "slots out of range");
+    if (slot_size < (long) sizeof(rb_adns_shm_slot_t) + 64 || slot_size > 65536)
+        rb_raise(rb_eArgError, "slot_size out of range");
+    nslots = (nslots + SHM_WAYS - 1) / SHM_WAYS * SHM_WAYS;
+    slot_size = (slot_size + 7) & ~7L;
+    if (shm_r->path != Qnil)
     {
-        ecode = adns_check(rb_ads_r->ads, &adq, &answer_r, (void **)&query_ctx);
+        ecode = shm_map_file(shm_r, STR2CSTR(shm_r->path), nslots, slot_size);
+        if (ecode == EINVAL)
+            rb_raise(rb_eArgError, "%s: not an adns shared cache", STR2CSTR(shm_r->path));
+        if (ecode == EPERM)
+            rb_raise(mADNS__eError, "%s: not owned by this user, or writable by others", STR2CSTR(shm_r->path));
         if (ecode)
-            if (ecode == EWOULDBLOCK)
-                continue;
-        Data_Get_Struct(query_ctx, rb_adns_query_t, rb_adq_r);
-        rb_adq_r->answer = rb_hash_new();
-        rb_hash_aset(rb_adq_r->answer, CSTR2SYM("type"), INT2FIX(answer_r->type));
-        rb_hash_aset(rb_adq_r->answer, CSTR2SYM("owner"), CSTR2STR(answer_r->owner));
-        rb_hash_aset(rb_adq_r->answer, CSTR2SYM("status"), INT2FIX(answer_r->status));
-        rb_hash_aset(rb_adq_r->answer, CSTR2SYM("expires"), INT2FIX(answer_r->expires));
-        rb_hash_aset(rb_adq_r->answer, CSTR2SYM("answer"), parse_adns_answer(answer_r));
-        rb_adq_r->adq = NULL;
-        free(answer_r);
-        rb_ary_push(query_list, query_ctx);
+            rb_raise(mADNS__eError, "%s: %s", STR2CSTR(shm_r->path), strerror(ecode));
     }
-    return query_list;
+    else
+    {
+        shm_r->size = sizeof(rb_adns_shm_header_t) + (size_t) nslots * slot_size;
+        map = mmap(NULL, shm_r->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED)
+            rb_raise(mADNS__eError, "%s", strerror(errno));
+        shm_r->header = map;
+        shm_r->nslots = nslots;
+        shm_r->slot_size = slot_size;
+        shm_setup(shm_r->header, nslots, slot_size);
+    }
+    rb_obj_call_init(cache, 0, 0);
+    return cache;
 }
 
 /*
- * call-seq: synchronous(domain, type[, qflags]) => Hash
+ * call-seq: path() => String or nil
  *
- * Submit synchronous request to resolve domain <domain> of record type <type> using optional query flags <qflags>.
+ * Returns the cache file, nil for an anonymous cache.
  */
-static VALUE cState_synchronous(int argc, VALUE argv[], VALUE self)
+static VALUE cSharedCache_path(VALUE self)
 {
-    VALUE answer = rb_hash_new(); /* return instance */
-    rb_adns_state_t *rb_ads_r;
-    adns_answer *answer_r;
-    adns_queryflags qflags = adns_qf_owner;
-    adns_rrtype type = adns_r_none;
-    const char *owner;
-    int ecode;
-    
-    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
-    if (argc < 2)
-        rb_raise(rb_eArgError, "wrong number of arguments (%d for 2)", argc);
-    if (argc > 3)
-        rb_raise(rb_eArgError, "excess number of arguments (%d for 3)", argc);
-    CHECK_TYPE(argv[0], T_STRING); /* DOMAIN */
-    CHECK_TYPE(argv[1], T_FIXNUM); /* RR */
-    if (argc == 3)
-        CHECK_TYPE(argv[2], T_FIXNUM); /* QFlags */
-    owner = STR2CSTR(argv[0]);
-    type = FIX2INT(argv[1]);
-    if (argc == 3)
-        qflags |= FIX2INT(argv[2]);
-    ecode = adns_synchronous(rb_ads_r->ads, owner, type, qflags, &answer_r);
-    if (ecode)
-        rb_raise(mADNS__eError, adns_strerror(ecode));
-    /* populate return hash */
-    rb_hash_aset(answer, CSTR2SYM("type"), INT2FIX(answer_r->type));
-    rb_hash_aset(answer, CSTR2SYM("owner"), CSTR2STR(answer_r->owner));
-    rb_hash_aset(answer, CSTR2SYM("status"), INT2FIX(answer_r->status));
-    rb_hash_aset(answer, CSTR2SYM("expires"), INT2FIX(answer_r->expires));
-    rb_hash_aset(answer, CSTR2SYM("answer"), Qnil);
-    if (answer_r->nrrs == 0)
-        return answer;
-    else
-        rb_hash_aset(answer, CSTR2SYM("answer"), parse_adns_answer(answer_r));
-    return answer;
+    rb_adns_shm_t *shm_r;
+    Data_Get_Struct(self, rb_adns_shm_t, shm_r);
+    return shm_r->path;
 }
 
 /*
- * call-seq: global_system_failure() => nil
+ * call-seq: stats() => Hash
  *
- * Call this function, If serious problem(s) occurs with adns library.
- * All currently outstanding queries will be made to fail with ADNS::Status::SystemFail
- * status code and adns library will close any stream sockets it has open since inception.
+ * Returns the geometry (:slots, :slot_size), the number of unexpired answers (:used) and
+ * the :hits, :misses, :stores and :skipped stores (too large or contended) of all processes
+ * sharing the cache.
  */
-static VALUE cState_global_system_failure(VALUE self)
+static VALUE cSharedCache_stats(VALUE self)
 {
-    rb_adns_state_t *rb_ads_r;
-    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
-    (void) adns_globalsystemfailure(rb_ads_r->ads);
-    return Qnil;
+    VALUE stats = rb_hash_new();
+    rb_adns_shm_t *shm_r;
+    rb_adns_shm_header_t *header;
+    rb_adns_shm_slot_t *slot;
+    time_t now = time(NULL);
+    long used = 0;
+    uint32_t idx;
+
+    Data_Get_Struct(self, rb_adns_shm_t, shm_r);
+    header = shm_r->header;
+    for (idx=0; idx < shm_r->nslots; idx++)
+    {
+        slot = shm_slot(shm_r, idx);
+        if (__atomic_load_n(&slot->key, __ATOMIC_RELAXED) &&
+            __atomic_load_n(&slot->expires, __ATOMIC_RELAXED) > now)
+            used++;
+    }
+    rb_hash_aset(stats, CSTR2SYM("slots"), ULONG2NUM(shm_r->nslots));
+    rb_hash_aset(stats, CSTR2SYM("slot_size"), ULONG2NUM(shm_r->slot_size));
+    rb_hash_aset(stats, CSTR2SYM("used"), LONG2NUM(used));
+    rb_hash_aset(stats, CSTR2SYM("hits"), ULL2NUM(__atomic_load_n(&header->hits, __ATOMIC_RELAXED)));
+    rb_hash_aset(stats, CSTR2SYM("misses"), ULL2NUM(__atomic_load_n(&header->misses, __ATOMIC_RELAXED)));
+    rb_hash_aset(stats, CSTR2SYM("stores"), ULL2NUM(__atomic_load_n(&header->stores, __ATOMIC_RELAXED)));
+    rb_hash_aset(stats, CSTR2SYM("skipped"), ULL2NUM(__atomic_load_n(&header->skipped, __ATOMIC_RELAXED)));
+    return stats;
 }
 
-static VALUE cState_initialize(int argc, VALUE argv[], VALUE self)
+/*
+ * call-seq: clear() => self
+ *
+ * Drop every stored answer, for all processes sharing the cache.
+ */
+static VALUE cSharedCache_clear(VALUE self)
 {
+    rb_adns_shm_t *shm_r;
+    rb_adns_shm_slot_t *slot;
+    uint32_t idx, seq;
+
+    Data_Get_Struct(self, rb_adns_shm_t, shm_r);
+    for (idx=0; idx < shm_r->nslots; idx++)
+    {
+        slot = shm_slot(shm_r, idx);
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+        if ((seq & 1) || !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0,
+                                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            continue; /* being rewritten right now */
+        slot->key = 0;
+        slot->expires = 0;
+        __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    }
     return self;
 }
 
-static void cState_free(void *ptr)
+/*
+ * RFC 2782 gives weight 0 targets "a very small chance of being selected" when
+ * other targets of the same priority have a weight; scaling the real weights
+ * and giving zero weights a selection weight of 1 does just that, and keeps a
+ * group made only of zero weights uniformly balanced.
+ */
+#define SRV_WEIGHT_SCALE 256
+
+static void srv_tree_add(rb_adns_srv_group_t *group, int pos, long delta)
 {
-    rb_adns_state_t *rb_ads_r = (rb_adns_state_t *) ptr;
-    (void) adns_finish(rb_ads_r->ads);
-    if (rb_ads_r->diagfile)
-        (void) fclose(rb_ads_r->diagfile);
-    free(rb_ads_r);
+    for (pos++; pos <= group->count; pos += pos & -pos)
+        group->tree[pos] += delta;
 }
 
-static void cState_mark(void *ptr)
+static int srv_tree_find(rb_adns_srv_group_t *group, unsigned long r)
+{
+   /*
+    * Fenwick tree descent: smallest position whose prefix sum exceeds r.
+    */
+    int pos = 0, step = 1;
+
+    while ((step << 1) <= group->count)
+        step <<= 1;
+    for (; step; step >>= 1)
+        if (pos + step <= group->count && group->tree[pos + step] <= r)
+        {
+            pos += step;
+            r -= group->tree[pos];
+        }
+    return pos;
+}
+
+static void srvset_update_active(rb_adns_srvset_t *srvset)
+{
+    for (srvset->active = 0; srvset->active < srvset->ngroups; srvset->active++)
+        if (srvset->groups[srvset->active].up > 0)
+            break;
+}
+
+static int srv_endpoint_cmp(const void *a, const void *b)
+{
+    const rb_adns_srv_endpoint_t *ea = a, *eb = b;
+    if (ea->priority != eb->priority)
+        return ea->priority < eb->priority ? -1 : 1;
+    /* keep answer order within a priority, qsort is not stable */
+    return ea->order - eb->order;
+}
+
+static void cSRVSet_mark(void *ptr)
+{
+    rb_adns_srvset_t *srvset = (rb_adns_srvset_t *)ptr;
+    int idx;
+
+    for (idx=0; idx < srvset->nendpoints; idx++)
+        rb_gc_mark(srvset->endpoints[idx].endpoint);
+}
+
+static void cSRVSet_free(void *ptr)
 {
-    return;
+    rb_adns_srvset_t *srvset = (rb_adns_srvset_t *)ptr;
+    xfree(srvset->endpoints);
+    xfree(srvset->groups);
+    xfree(srvset->trees);
+    xfree(srvset);
+}
+
+static VALUE srv_hash_fetch(VALUE hash, const char *key)
+{
+    VALUE v = rb_hash_aref(hash, CSTR2SYM(key));
+    if (v == Qnil)
+        rb_raise(rb_eArgError, "SRV record without :%s", key);
+    CHECK_TYPE(v, T_FIXNUM);
+    return v;
+}
+
+/* A target of "." (adns gives the root as "") means the service is not available there, RFC 2782. */
+static int srv_target_unavailable(VALUE host)
+{
+    if (TYPE(host) != T_STRING)
+        return 0;
+    return RSTRING_LEN(host) == 0 || (RSTRING_LEN(host) == 1 && RSTRING_PTR(host)[0] == '.');
+}
+
+static int cSRVSet_index(rb_adns_srvset_t *srvset, VALUE a1)
+{
+    int idx;
+
+    VALUE endpoint = Qnil;
+
+    if (TYPE(a1) == T_HASH)
+    {
+        endpoint = a1;
+        a1 = rb_hash_aref(a1, CSTR2SYM("index"));
+    }
+    CHECK_TYPE(a1, T_FIXNUM);
+    idx = FIX2INT(a1);
+    if (idx < 0 || idx >= srvset->nendpoints)
+        rb_raise(rb_eIndexError, "no SRV endpoint at index %d", idx);
+    if (endpoint != Qnil && endpoint != srvset->endpoints[idx].endpoint)
+        rb_raise(rb_eArgError, "SRV endpoint not from this set");
+    return idx;
+}
+
+static rb_adns_srv_group_t *cSRVSet_group(rb_adns_srvset_t *srvset, int idx)
+{
+    int g;
+    for (g=0; g < srvset->ngroups; g++)
+        if (idx < srvset->groups[g].first + srvset->groups[g].count)
+            break;
+    return srvset->groups + g;
 }
 
 /*
- * call-seq: new([iflags, filename, filemode])  => ADNS::State object
+ * call-seq: new(answer) => ADNS::SRVSet object
  *
- * Create new ADNS::State object and initialize adns library using optional initialization
- * flags <iflags>, debug log to filename <filename> (*only available if ADNS::IF::DEBUG flag is given*),
- * debug log filemode <filemode>.
+ * Build an RFC 2782 endpoint selector from an SRV or SRV_RAW query answer, either the
+ * Hash returned by ADNS::Query#wait or its :answer Array. Records whose target is "."
+ * (service not available) are left out. Priority groups and weight tables are computed
+ * once here, so ADNS::SRVSet#pick allocates nothing.
  */
-static VALUE cState_new(int argc, VALUE argv[], VALUE self)
+static VALUE cSRVSet_new(VALUE self, VALUE a1)
 {
-    VALUE state; /* return instance */
-    rb_adns_state_t *rb_ads_r = ALLOC(rb_adns_state_t);
-    rb_ads_r->ads = NULL;
-    rb_ads_r->diagfile = NULL;
-    adns_initflags iflags = adns_if_none;
-    const char *fname, *fmode;
-    
-    if (argc > 3)
-        rb_raise(rb_eArgError, "excess number of arguments (%d for 3)", argc);
-    if (argc >= 1)
+    VALUE srvset_v; /* return instance */
+    rb_adns_srvset_t *srvset;
+    VALUE records = a1;
+    int idx, g, n, ntrees = 0;
+
+    if (TYPE(records) == T_HASH)
+        records = rb_hash_aref(records, CSTR2SYM("answer"));
+    if (records == Qnil)
+        records = rb_ary_new();
+    CHECK_TYPE(records, T_ARRAY);
+    /* wrapped (zeroed) before anything below can raise, so GC owns it */
+    srvset_v = Data_Make_Struct(mADNS__cSRVSet, rb_adns_srvset_t, cSRVSet_mark, cSRVSet_free, srvset);
+    n = RARRAY_LEN(records);
+    srvset->endpoints = ALLOC_N(rb_adns_srv_endpoint_t, n ? n : 1);
+    for (idx=0; idx < n; idx++)
+        srvset->endpoints[idx].endpoint = Qnil;
+
+    for (idx=0; idx < n; idx++)
     {
-        CHECK_TYPE(argv[0], T_FIXNUM);
-        iflags |= FIX2INT(argv[0]);
-        if (argc >= 2)
+        rb_adns_srv_endpoint_t *ep = srvset->endpoints + srvset->nendpoints;
+        VALUE rr = rb_ary_entry(records, idx);
+        VALUE host, addrs = Qnil, ha, endpoint;
+
+        CHECK_TYPE(rr, T_HASH);
+        host = rb_hash_aref(rr, CSTR2SYM("host"));
+        ha = rb_hash_aref(rr, CSTR2SYM("addrs"));
+        if (TYPE(ha) == T_HASH)
         {
-            CHECK_TYPE(argv[1], T_STRING);
-            fname = STR2CSTR(argv[1]);
-            if (argc == 3)
-            {
-                CHECK_TYPE(argv[2], T_STRING);
-                fmode = STR2CSTR(argv[2]);
-            } else
-                fmode = DEFAULT_DIAG_FILEMODE;
-            rb_ads_r->diagfile = fopen(fname, fmode);
-            if (!rb_ads_r->diagfile)
-                rb_raise(rb_eIOError, "%s - %s", strerror(errno), fname);
+            /* SRV (dereferenced) record, see parse_adns_rr_hostaddr */
+            if (host == Qnil)
+                host = rb_hash_aref(ha, CSTR2SYM("host"));
+            addrs = rb_hash_aref(ha, CSTR2SYM("addr"));
         }
+        if (srv_target_unavailable(host))
+            continue;
+        ep->priority = FIX2INT(srv_hash_fetch(rr, "priority"));
+        ep->weight = FIX2INT(srv_hash_fetch(rr, "weight"));
+        ep->port = FIX2INT(srv_hash_fetch(rr, "port"));
+        ep->order = idx;
+        ep->eweight = ep->weight > 0 ? (unsigned long)ep->weight * SRV_WEIGHT_SCALE : 1;
+        ep->down = 0;
+        endpoint = rb_hash_new(); /* not marked through srvset until counted */
+        rb_hash_aset(endpoint, CSTR2SYM("host"), host);
+        rb_hash_aset(endpoint, CSTR2SYM("port"), INT2FIX(ep->port));
+        rb_hash_aset(endpoint, CSTR2SYM("priority"), INT2FIX(ep->priority));
+        rb_hash_aset(endpoint, CSTR2SYM("weight"), INT2FIX(ep->weight));
+        if (addrs != Qnil)
+            rb_hash_aset(endpoint, CSTR2SYM("addrs"), addrs);
+        ep->endpoint = endpoint;
+        srvset->nendpoints++;
+        RB_GC_GUARD(endpoint);
     }
-    adns_init(&rb_ads_r->ads, iflags, rb_ads_r->diagfile);
-    state = Data_Wrap_Struct(mADNS__cState, cState_mark, cState_free, rb_ads_r);
-    rb_obj_call_init(state, 0, 0);
-    return state;
+    if (srvset->nendpoints > 1)
+        qsort(srvset->endpoints, srvset->nendpoints, sizeof(rb_adns_srv_endpoint_t), srv_endpoint_cmp);
+
+    srvset->groups = ALLOC_N(rb_adns_srv_group_t, srvset->nendpoints ? srvset->nendpoints : 1);
+    for (idx=0; idx < srvset->nendpoints; idx++)
+    {
+        rb_adns_srv_endpoint_t *ep = srvset->endpoints + idx;
+        rb_hash_aset(ep->endpoint, CSTR2SYM("index"), INT2FIX(idx));
+        OBJ_FREEZE(ep->endpoint);
+        if (idx == 0 || ep->priority != ep[-1].priority)
+        {
+            rb_adns_srv_group_t *group = srvset->groups + srvset->ngroups++;
+            group->first = idx;
+            group->count = 0;
+            group->up = 0;
+            group->total = 0;
+        }
+        srvset->groups[srvset->ngroups - 1].count++;
+    }
+    for (g=0; g < srvset->ngroups; g++)
+        ntrees += srvset->groups[g].count + 1;
+    srvset->trees = ALLOC_N(unsigned long, ntrees ? ntrees : 1);
+    MEMZERO(srvset->trees, unsigned long, ntrees ? ntrees : 1);
+    for (g=0, ntrees=0; g < srvset->ngroups; g++)
+    {
+        rb_adns_srv_group_t *group = srvset->groups + g;
+        group->tree = srvset->trees + ntrees;
+        ntrees += group->count + 1;
+        for (idx=0; idx < group->count; idx++)
+        {
+            srv_tree_add(group, idx, srvset->endpoints[group->first + idx].eweight);
+            group->total += srvset->endpoints[group->first + idx].eweight;
+            group->up++;
+        }
+    }
+    srvset_update_active(srvset);
+    rb_obj_call_init(srvset_v, 0, 0);
+    return srvset_v;
 }
 
 /*
- * call-seq: new2(configtext, [iflags, filename, filemode]) => ADNS::State object
+ * call-seq: pick() => Hash or nil
  *
- * Create new ADNS::State object and initialize adns library using resolve.conf style
- * configuration text and optional initialization
- * flags <iflags>, debug log to filename <filename> (*only available if ADNS::IF::DEBUG flag is given*),
- * debug log filemode <filemode>.
+ * Weighted random selection among the up endpoints of the lowest priority that has any,
+ * in O(log n). Returns nil if every endpoint is marked down.
  */
-static VALUE cState_new2(int argc, VALUE argv[], VALUE self)
+static VALUE cSRVSet_pick(VALUE self)
 {
-    VALUE state; /* return instance */
-    rb_adns_state_t *rb_ads_r = ALLOC(rb_adns_state_t);
-    rb_ads_r->ads = NULL;
-    rb_ads_r->diagfile = NULL;
-    adns_initflags iflags = adns_if_none;
-    const char *fname, *fmode, *cfgtxt;
-    
-    if (argc > 4)
-        rb_raise(rb_eArgError, "excess number of arguments (%d for 3)", argc);
-    if (argc >= 1)
+    rb_adns_srvset_t *srvset;
+    rb_adns_srv_group_t *group;
+    unsigned long r;
+
+    Data_Get_Struct(self, rb_adns_srvset_t, srvset);
+    if (srvset->active >= srvset->ngroups)
+        return Qnil;
+    group = srvset->groups + srvset->active;
+    r = (unsigned long)(rb_genrand_real() * group->total);
+    if (r >= group->total)
+        r = group->total - 1;
+    return srvset->endpoints[group->first + srv_tree_find(group, r)].endpoint;
+}
+
+static VALUE cSRVSet_set_down(VALUE self, VALUE a1, int down)
+{
+    rb_adns_srvset_t *srvset;
+    rb_adns_srv_endpoint_t *ep;
+    rb_adns_srv_group_t *group;
+    int idx;
+
+    Data_Get_Struct(self, rb_adns_srvset_t, srvset);
+    idx = cSRVSet_index(srvset, a1);
+    ep = srvset->endpoints + idx;
+    if (ep->down == down)
+        return self;
+    group = cSRVSet_group(srvset, idx);
+    ep->down = down;
+    if (down)
     {
-        CHECK_TYPE(argv[0], T_STRING);
-        cfgtxt = STR2CSTR(argv[0]);
-        if (argc >= 2)
-        {
-            CHECK_TYPE(argv[1], T_FIXNUM);
-            iflags |= FIX2INT(argv[1]);
-        }
-        if (argc >= 3)
-        {
-            CHECK_TYPE(argv[2], T_STRING);
-            fname = STR2CSTR(argv[2]);
-            if (argc == 4)
-            {
-                CHECK_TYPE(argv[3], T_STRING);
-                fmode = STR2CSTR(argv[3]);
-            } else
-                fmode = DEFAULT_DIAG_FILEMODE;
-            rb_ads_r->diagfile = fopen(fname, fmode);
-            if (!rb_ads_r->diagfile)
-                rb_raise(rb_eIOError, "%s - %s", strerror(errno), fname);
-        }
+        srv_tree_add(group, idx - group->first, -(long)ep->eweight);
+        group->total -= ep->eweight;
+        group->up--;
     }
-    adns_init_strcfg(&rb_ads_r->ads, iflags, rb_ads_r->diagfile, cfgtxt);
-    state = Data_Wrap_Struct(mADNS__cState, cState_mark, cState_free, rb_ads_r);
-    rb_obj_call_init(state, 0, 0);
-    return state;
+    else
+    {
+        srv_tree_add(group, idx - group->first, ep->eweight);
+        group->total += ep->eweight;
+        group->up++;
+    }
+    srvset_update_active(srvset);
+    return self;
 }
 
 /*
- * call-seq: finish() => nil
+ * call-seq: mark_down(endpoint) => self
  *
- * Finish all the outstanding queries associated with the ADNS::State instance.
+ * Exclude <endpoint> (a Hash returned by pick, or its :index) from selection. A Hash of
+ * another ADNS::SRVSet raises ArgumentError.
  */
-static VALUE cState_finish(VALUE self)
+static VALUE cSRVSet_mark_down(VALUE self, VALUE a1)
 {
-    rb_adns_state_t *rb_ads_r;
-    Data_Get_Struct(self, rb_adns_state_t, rb_ads_r);
-    (void) adns_finish(rb_ads_r->ads);
-    return Qnil;
+    return cSRVSet_set_down(self, a1, 1);
+}
+
+/*
+ * call-seq: mark_up(endpoint) => self
+ *
+ * Make <endpoint> (a Hash returned by pick, or its :index) selectable again.
+ */
+static VALUE cSRVSet_mark_up(VALUE self, VALUE a1)
+{
+    return cSRVSet_set_down(self, a1, 0);
+}
+
+/*
+ * call-seq: down?(endpoint) => true or false
+ *
+ * Check whether <endpoint> (a Hash returned by pick, or its :index) is marked down.
+ */
+static VALUE cSRVSet_is_down(VALUE self, VALUE a1)
+{
+    rb_adns_srvset_t *srvset;
+    Data_Get_Struct(self, rb_adns_srvset_t, srvset);
+    return srvset->endpoints[cSRVSet_index(srvset, a1)].down ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq: endpoints() => Array
+ *
+ * Returns all endpoints in priority order, down or not.
+ */
+static VALUE cSRVSet_endpoints(VALUE self)
+{
+    rb_adns_srvset_t *srvset;
+    VALUE list;
+    int idx;
+
+    Data_Get_Struct(self, rb_adns_srvset_t, srvset);
+    list = rb_ary_new2(srvset->nendpoints);
+    for (idx=0; idx < srvset->nendpoints; idx++)
+        rb_ary_store(list, idx, srvset->endpoints[idx].endpoint);
+    return list;
+}
+
+/*
+ * call-seq: size() => Integer
+ *
+ * Returns number of endpoints.
+ */
+static VALUE cSRVSet_size(VALUE self)
+{
+    rb_adns_srvset_t *srvset;
+    Data_Get_Struct(self, rb_adns_srvset_t, srvset);
+    return INT2FIX(srvset->nendpoints);
+}
+
+static VALUE cSRVSet_initialize(int argc, VALUE argv[], VALUE self)
+{
+    return self;
 }
 
 /*
@@ -807,6 +4439,7 @@ static VALUE cState_finish(VALUE self)
  * === Classes
  * * ADNS::State
  * * ADNS::Query
+ * * ADNS::SRVSet
  * * ADNS::Error
  * * ADNS::LocalError
  * * ADNS::RemoteError
@@ -847,6 +4480,10 @@ void Init_adns(void)
     * ADNS module provides bindings to GNU adns resolver library.
     */
     mADNS = rb_define_module("ADNS");
+#ifdef RB_ADNS_IO_THREAD
+    rb_adns_pid = getpid();
+    (void) pthread_atfork(NULL, NULL, rb_adns_atfork_child);
+#endif
     rb_define_module_function(mADNS, "status_to_s", mADNS__status_to_s, 1);
     rb_define_module_function(mADNS, "status_to_ss", mADNS__status_to_ss, 1);
     rb_define_const(mADNS, "VERSION", CSTR2STR(VERSION));
@@ -863,8 +4500,45 @@ void Init_adns(void)
     rb_define_method(mADNS__cState, "submit", cState_submit, -1);
     rb_define_method(mADNS__cState, "submit_reverse", cState_submit_reverse, -1);
     rb_define_method(mADNS__cState, "submit_reverse_any", cState_submit_reverse_any, -1);
+    rb_define_method(mADNS__cState, "submit_nonblock", cState_submit_nonblock, -1);
+    rb_define_method(mADNS__cState, "submit_detached", cState_submit_detached, -1);
+    rb_define_method(mADNS__cState, "submit_reverse_nonblock", cState_submit_reverse_nonblock, -1);
+    rb_define_method(mADNS__cState, "submit_reverse_any_nonblock", cState_submit_reverse_any_nonblock, -1);
     rb_define_method(mADNS__cState, "completed_queries", cState_completed_queries, -1);
-    rb_define_method(mADNS__cState, "global_system_failure", cState_global_system_failure, -1);
+    rb_define_method(mADNS__cState, "finish", cState_finish, 0);
+    rb_define_method(mADNS__cState, "global_system_failure", cState_global_system_failure, 0);
+    rb_define_method(mADNS__cState, "search_list", cState_search_list, 0);
+    rb_define_method(mADNS__cState, "ndots", cState_ndots, 0);
+    rb_define_method(mADNS__cState, "start_io_thread", cState_start_io_thread, 0);
+    rb_define_method(mADNS__cState, "io_thread?", cState_is_io_thread, 0);
+    rb_define_method(mADNS__cState, "config", cState_config, 0);
+    rb_define_method(mADNS__cState, "timing_hook", cState_timing_hook, 0);
+    rb_define_method(mADNS__cState, "timing_hook=", cState_set_timing_hook, 1);
+    rb_define_method(mADNS__cState, "slab_stats", cState_slab_stats, 0);
+    rb_define_method(mADNS__cState, "set_rate_limit", cState_set_rate_limit, -1);
+    rb_define_method(mADNS__cState, "throttle_stats", cState_throttle_stats, 0);
+    rb_define_method(mADNS__cState, "shared_cache", cState_shared_cache, 0);
+    rb_define_method(mADNS__cState, "shared_cache=", cState_set_shared_cache, 1);
+    rb_define_method(mADNS__cState, "nameservers", cState_nameservers, 0);
+    rb_define_method(mADNS__cState, "nameservers=", cState_set_nameservers, 1);
+
+   /*
+    * Document-class: ADNS::Config
+    * ADNS::Config class holds a parsed resolver configuration to create ADNS::State objects from.
+    */
+    mADNS__cConfig = rb_define_class_under(mADNS, "Config", rb_cObject);
+    rb_define_module_function(mADNS__cConfig, "new", cConfig_new, -1);
+    rb_define_module_function(mADNS__cConfig, "new2", cConfig_new2, 1);
+    rb_define_method(mADNS__cConfig, "initialize", cConfig_initialize, -1);
+    rb_define_method(mADNS__cConfig, "new_state", cConfig_new_state, -1);
+    rb_define_method(mADNS__cConfig, "reload", cConfig_reload, 0);
+    rb_define_method(mADNS__cConfig, "text", cConfig_text, 0);
+    rb_define_method(mADNS__cConfig, "path", cConfig_path, 0);
+    rb_define_method(mADNS__cConfig, "search_list", cConfig_search_list, 0);
+    rb_define_method(mADNS__cConfig, "ndots", cConfig_ndots, 0);
+    rb_define_method(mADNS__cConfig, "generation", cConfig_generation, 0);
+    rb_define_method(mADNS__cConfig, "check_interval", cConfig_check_interval, 0);
+    rb_define_method(mADNS__cConfig, "check_interval=", cConfig_set_check_interval, 1);
  
    /*
     * Document-class: ADNS::Query
@@ -874,8 +4548,35 @@ void Init_adns(void)
     mADNS__cQuery = rb_define_class_under(mADNS, "Query", rb_cObject);
     rb_define_method(mADNS__cQuery, "initialize", cQuery_init, 0);
     rb_define_method(mADNS__cQuery, "check", cQuery_check, 0);
+    rb_define_method(mADNS__cQuery, "check_nonblock", cQuery_check_nonblock, 0);
+    rb_define_method(mADNS__cQuery, "ready?", cQuery_is_ready, 0);
     rb_define_method(mADNS__cQuery, "wait", cQuery_wait, -1);
     rb_define_method(mADNS__cQuery, "cancel", cQuery_cancel, 0);
+
+   /*
+    * Document-class: ADNS::SharedCache
+    * ADNS::SharedCache class is an answer cache in shared memory, see ADNS::State#shared_cache=.
+    */
+    mADNS__cSharedCache = rb_define_class_under(mADNS, "SharedCache", rb_cObject);
+    rb_define_module_function(mADNS__cSharedCache, "new", cSharedCache_new, -1);
+    rb_define_method(mADNS__cSharedCache, "initialize", cSharedCache_initialize, -1);
+    rb_define_method(mADNS__cSharedCache, "path", cSharedCache_path, 0);
+    rb_define_method(mADNS__cSharedCache, "stats", cSharedCache_stats, 0);
+    rb_define_method(mADNS__cSharedCache, "clear", cSharedCache_clear, 0);
+
+   /*
+    * Document-class: ADNS::SRVSet
+    * ADNS::SRVSet class selects SRV endpoints by RFC 2782 priority and weight.
+    */
+    mADNS__cSRVSet = rb_define_class_under(mADNS, "SRVSet", rb_cObject);
+    rb_define_module_function(mADNS__cSRVSet, "new", cSRVSet_new, 1);
+    rb_define_method(mADNS__cSRVSet, "initialize", cSRVSet_initialize, -1);
+    rb_define_method(mADNS__cSRVSet, "pick", cSRVSet_pick, 0);
+    rb_define_method(mADNS__cSRVSet, "mark_down", cSRVSet_mark_down, 1);
+    rb_define_method(mADNS__cSRVSet, "mark_up", cSRVSet_mark_up, 1);
+    rb_define_method(mADNS__cSRVSet, "down?", cSRVSet_is_down, 1);
+    rb_define_method(mADNS__cSRVSet, "endpoints", cSRVSet_endpoints, 0);
+    rb_define_method(mADNS__cSRVSet, "size", cSRVSet_size, 0);
     
    /*
     * Document-module: ADNS::RR
@@ -885,6 +4586,10 @@ void Init_adns(void)
     rb_define_const(mADNS__mRR, "UNKNOWN",  INT2FIX(adns_r_unknown));
     rb_define_const(mADNS__mRR, "NONE",     INT2FIX(adns_r_none));
     rb_define_const(mADNS__mRR, "A",        INT2FIX(adns_r_a));   
+    rb_define_const(mADNS__mRR, "ADDR",     INT2FIX(adns_r_addr));
+#ifdef ADNS_FEATURE_MANYAF
+    rb_define_const(mADNS__mRR, "AAAA",     INT2FIX(adns_r_aaaa));
+#endif
     rb_define_const(mADNS__mRR, "NS_RAW",   INT2FIX(adns_r_ns_raw)); 
     rb_define_const(mADNS__mRR, "NS",       INT2FIX(adns_r_ns));
     rb_define_const(mADNS__mRR, "CNAME",    INT2FIX(adns_r_cname));
@@ -2,4 +2,9 @@
 # This file is part of adns-ruby library.
 #
 require 'adns/adns'
+require 'adns/query'
+require 'adns/watcher'
+require 'adns/search'
+require 'adns/ranker'
+require 'adns/preresolve'
 include ADNS
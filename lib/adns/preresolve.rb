@@ -0,0 +1,65 @@
+#
+# This file is part of adns-ruby library.
+#
+
+module ADNS
+	class State
+		#
+		# call-seq: preresolve(list, deadline: seconds[, cache: cache]) => Hash
+		#
+		# Resolve every (domain, type[, qflags]) entry of <list> at once, typically
+		# the dependencies of a worker at boot, and block until all are answered or
+		# <deadline> seconds (default 5.0) have passed. Entries still out then are
+		# cancelled.
+		#
+		# The answers land in the ADNS::SharedCache <cache>, by default the one
+		# of the state, so later submits of the same (domain, type, qflags) are
+		# answered without a round trip until they expire. A <cache> given is
+		# attached to the state first; a state without one gets an anonymous
+		# cache of its own, shared with the processes it forks later.
+		#
+		# The GVL is released while waiting, see ADNS::Query#wait_until.
+		#
+		# Returns a report: :resolved lists the entries answered with
+		# ADNS::Status::OK, :failed maps the other entries to their status
+		# (nil for a local ADNS::Error), :timed_out lists the entries cancelled
+		# at the deadline.
+		#
+		#  report = adns.preresolve([['db.example.com', ADNS::RR::A],
+		#                            ['_memcache._tcp.example.com', ADNS::RR::SRV]], deadline: 2)
+		#  report[:timed_out]  # => []
+		#
+		def preresolve(list, deadline: 5.0, cache: nil)
+			cache ||= shared_cache || ADNS::SharedCache.new
+			self.shared_cache = cache unless cache.equal?(shared_cache)
+			report = {:resolved => [], :failed => {}, :timed_out => []}
+			stop = Process.clock_gettime(Process::CLOCK_MONOTONIC) + deadline
+			queries = list.map {|entry|
+				domain, type, qflags = entry
+				begin
+					[entry, submit(domain, type, qflags || ADNS::QF::NONE)]
+				rescue ADNS::Error
+					report[:failed][entry] = nil
+					nil
+				end
+			}.compact
+			queries.each {|entry, query|
+				answer = begin
+					query.wait_until(stop)
+				rescue ADNS::Error
+					false
+				end
+				if answer.nil?
+					report[:timed_out] << entry
+				elsif answer == false
+					report[:failed][entry] = nil
+				elsif answer[:status] == ADNS::Status::OK
+					report[:resolved] << entry
+				else
+					report[:failed][entry] = answer[:status]
+				end
+			}
+			report
+		end
+	end
+end
@@ -0,0 +1,27 @@
+#
+# This file is part of adns-ruby library.
+#
+
+module ADNS
+	class Query
+		#
+		# call-seq: wait_until(deadline) => Hash or nil
+		#
+		# Wait for the answer at most until <deadline>, in
+		# Process.clock_gettime(Process::CLOCK_MONOTONIC) terms, with the GVL
+		# released in either mode. A query still pending by then is cancelled
+		# and nil returned. Raises ADNS::Error like #wait.
+		#
+		def wait_until(deadline)
+			remaining = deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+			answer = wait(remaining > 0 ? remaining : 0)
+			return answer if answer
+			begin
+				cancel
+			rescue ADNS::QueryError
+				# answered meanwhile
+			end
+			nil
+		end
+	end
+end
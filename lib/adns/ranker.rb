@@ -0,0 +1,211 @@
+#
+# This file is part of adns-ruby library.
+#
+require 'thread'
+
+module ADNS
+	#
+	# ADNS::NameserverRanker keeps the nameservers of a state ordered by
+	# measured latency, so that a slow but alive first nameserver in
+	# resolv.conf stops adding its round trip to every query.
+	#
+	# adns does not report which nameserver answered a query, so every
+	# :interval seconds each configured nameserver is sent the :probe query
+	# through a single-server state of its own. Round trip times and failures
+	# feed exponentially weighted moving averages, :alpha being the weight of
+	# the newest sample. A failure is an error status other than NXDomain or
+	# NoData, or no answer within :timeout. Healthy servers, failing at most
+	# :max_failure of the time, then go first, fastest first. The others
+	# follow, least failing first. The order is handed to ADNS::State#nameservers=,
+	# which, like a reloaded ADNS::Config, switches the state over on its next
+	# submit, so the ranker thread never swaps adns states under the state's users.
+	#
+	#  ranker = adns.nameserver_ranker(:interval => 10)
+	#  ranker.stats  # => {"10.0.0.1" => {:rtt => 0.0021, :failure_rate => 0.0, :samples => 12}, ...}
+	#
+	class NameserverRanker
+		DEFAULTS = {
+			:interval    => 30.0,  # seconds between probe rounds
+			:timeout     => 2.0,   # a probe not answered by then failed
+			:alpha       => 0.3,   # EWMA weight of the newest sample
+			:max_failure => 0.5,   # failure rate beyond which a server goes last
+			:probe       => ['.', ADNS::RR::NS],  # query sent to every nameserver
+		}
+
+		# Statuses that still show a working nameserver.
+		ANSWERED = [ADNS::Status::OK, ADNS::Status::NXDomain, ADNS::Status::NoData]
+
+		Server = Struct.new(:state, :rtt, :failure_rate, :samples)
+
+		attr_reader :state, :opts
+
+		def initialize(state, opts = {})
+			@state = state
+			@opts = DEFAULTS.merge(opts).freeze
+			@servers = {}
+			@answered = {}
+			@round = Mutex.new
+			@mutex = Mutex.new
+			@cond = ConditionVariable.new
+			@stopped = false
+			@thread = Thread.new { run }
+		end
+
+		#
+		# call-seq: stats() => Hash
+		#
+		# Per nameserver address: the round trip time average in seconds (:rtt,
+		# nil until the server answered once), the :failure_rate average between
+		# 0 and 1, and the number of probes sent (:samples).
+		#
+		def stats
+			@mutex.synchronize {
+				@servers.each_with_object({}) {|(addr, s), stats|
+					stats[addr] = {:rtt => s.rtt, :failure_rate => s.failure_rate, :samples => s.samples}
+				}
+			}
+		end
+
+		#
+		# call-seq: rank() => Array
+		#
+		# Probe every nameserver once and reorder them now. Returns the new order.
+		#
+		def rank
+			@round.synchronize {
+				addrs = @state.nameservers
+				samples = probe(addrs)
+				order = @mutex.synchronize {
+					@servers.keep_if {|addr, s|
+						next true if addrs.include?(addr)
+						s.state.finish if s.state
+						false
+					}
+					samples.each {|addr, rtt| record(addr, rtt) }
+					ordered(addrs)
+				}
+				@state.nameservers = order unless order == addrs
+				order
+			}
+		end
+
+		#
+		# call-seq: stop() => nil
+		#
+		# Stop the background thread, leaving the current order in place, and
+		# finish the probe states. Later calls to #rank make new ones.
+		#
+		def stop
+			@mutex.synchronize {
+				@stopped = true
+				@cond.signal
+			}
+			@thread.join
+			@round.synchronize {
+				@mutex.synchronize {
+					@servers.each_value {|s|
+						s.state.finish if s.state
+						s.state = nil
+					}
+				}
+			}
+			nil
+		end
+
+		private
+
+		def run
+			loop {
+				rank
+				@mutex.synchronize {
+					@cond.wait(@mutex, @opts[:interval]) unless @stopped
+					return if @stopped
+				}
+			}
+		end
+
+		# Returns [[addr, rtt or nil if failed], ...]
+		def probe(addrs)
+			name, type = @opts[:probe]
+			deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + @opts[:timeout]
+			@answered.clear
+			queries = addrs.map {|addr|
+				st = probe_state(addr)
+				begin
+					[addr, st.submit(name, type)]
+				rescue ADNS::Error
+					[addr, nil]
+				end
+			}
+			queries.map {|addr, q|
+				answer = begin
+					q && q.wait_until(deadline)
+				rescue ADNS::Error
+					nil
+				end
+				[addr, answer && ANSWERED.include?(answer[:status]) ? @answered[q] : nil]
+			}
+		end
+
+		def probe_state(addr)
+			s = @mutex.synchronize { @servers[addr] ||= Server.new(nil, nil, nil, 0) }
+			s.state ||= begin
+				st = ADNS::State.new2("nameserver #{addr}\n", ADNS::IF::NOENV | ADNS::IF::NOERRPRINT)
+				begin
+					st.start_io_thread
+				rescue NotImplementedError
+					# direct mode
+				end
+				st.timing_hook = lambda {|q, timings| @answered[q] = timings[:answered] }
+				st
+			end
+		end
+
+		def record(addr, rtt)
+			s = (@servers[addr] ||= Server.new(nil, nil, nil, 0))
+			alpha = @opts[:alpha]
+			failed = rtt ? 0.0 : 1.0
+			s.samples += 1
+			s.failure_rate = s.failure_rate ? s.failure_rate + alpha * (failed - s.failure_rate) : failed
+			s.rtt = s.rtt ? s.rtt + alpha * (rtt - s.rtt) : rtt if rtt
+		end
+
+		def ordered(addrs)
+			healthy, failing = addrs.each_with_index.partition {|addr, _|
+				(@servers[addr].failure_rate || 0.0) <= @opts[:max_failure]
+			}
+			healthy.sort_by! {|addr, idx| [@servers[addr].rtt || Float::INFINITY, idx] }
+			failing.sort_by! {|addr, idx| [@servers[addr].failure_rate, idx] }
+			(healthy + failing).map {|addr, _| addr }
+		end
+	end
+
+	class State
+		#
+		# call-seq: nameserver_ranker([opts]) => ADNS::NameserverRanker
+		#
+		# Background nameserver ordering by latency for this state, see
+		# ADNS::NameserverRanker. The ranker is created on the first call; later
+		# calls return it and raise ArgumentError if they pass <opts> it was not
+		# created with.
+		#
+		def nameserver_ranker(opts = {})
+			if @nameserver_ranker
+				unless opts.empty? || @nameserver_ranker.opts == NameserverRanker::DEFAULTS.merge(opts)
+					raise ArgumentError, "nameserver ranker already created with options #{@nameserver_ranker.opts.inspect}"
+				end
+				return @nameserver_ranker
+			end
+			@nameserver_ranker = NameserverRanker.new(self, opts)
+		end
+
+		# State#finish stops the ranker first, its thread would keep reordering otherwise.
+		module StopRanker
+			def finish
+				@nameserver_ranker.stop if @nameserver_ranker
+				super
+			end
+		end
+		prepend StopRanker
+	end
+end
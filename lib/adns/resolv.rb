@@ -0,0 +1,406 @@
+#
+# This file is part of adns-ruby library.
+#
+require 'adns'
+require 'resolv'
+require 'socket'
+require 'thread'
+
+module ADNS
+	#
+	# ADNS::Resolver plugs adns into Ruby's own name resolution. It implements
+	# the interface of the resolvers inside Resolv (each_address, getaddress,
+	# each_name, getname, ...), so it can serve as Resolv::DefaultResolver, and
+	# ADNS::Resolver.install additionally routes Addrinfo.getaddrinfo,
+	# Socket.getaddrinfo and TCPSocket.new/open through it. This covers Net::HTTP
+	# and most client libraries without changes to their code.
+	#
+	# The hosts file is consulted first (through Resolv::Hosts). Otherwise the A
+	# and AAAA records of every search list candidate (see
+	# ADNS::State#search_candidates) are queried at the same time, and the first
+	# candidate that resolves wins. Answers, including negative ones, are cached
+	# until their :expires time.
+	#
+	# All lookups share one process-wide ADNS::State, running in io thread mode
+	# where supported and in direct mode otherwise; a forked child gets a state
+	# of its own on first use. Either way a waiting thread leaves the GVL
+	# released, gives up after :timeout seconds and can be interrupted by
+	# Thread#raise or Timeout.
+	#
+	# A lookup that times out raises Resolv::ResolvTimeout, one that fails for
+	# another reason than a missing name raises ADNS::Resolver::Failure; the
+	# socket hooks turn these into the SocketError getaddrinfo(3) would raise.
+	#
+	#  require 'adns/resolv'
+	#  ADNS::Resolver.install(:timeout => 2)
+	#  Net::HTTP.get(URI('http://example.com/'))   # resolved through adns
+	#
+	class Resolver
+		DEFAULTS = {
+			:timeout    => 5.0,    # seconds per lookup (nil: wait forever)
+			:hosts      => Resolv::Hosts::DefaultFileName,  # nil: skip the hosts file
+			:ipv6       => true,   # also look up AAAA records
+			:cache_size => 1024,   # names kept in the answer cache
+			:state      => nil,    # ADNS::State to use (nil: ADNS::Resolver.state)
+		}
+
+		# Statuses after which the next search candidate is tried, as in ADNS::SearchQuery.
+		CONTINUE = ADNS::SearchQuery::CONTINUE
+
+		# Failures worth retrying, EAI_AGAIN rather than EAI_FAIL for the socket hooks.
+		TEMPORARY = [ADNS::Status::Timeout, ADNS::Status::AllServFail, ADNS::Status::RcodeServFail,
+		             ADNS::Status::NoMemory, ADNS::Status::SystemFail]
+
+		# Names that cannot exist, EAI_NONAME like a missing one for the socket hooks.
+		INVALID = [ADNS::Status::QueryDomainWrong, ADNS::Status::QueryDomainInvalid,
+		           ADNS::Status::QueryDomainTooLong]
+
+		#
+		# A lookup failed for another reason than a missing name or a timeout,
+		# the adns status is in #status.
+		#
+		class Failure < Resolv::ResolvError
+			attr_reader :status
+
+			def initialize(name, status)
+				@status = status
+				super("#{name}: #{ADNS.status_to_s(status)}")
+			end
+
+			# True if asking again later may succeed, see TEMPORARY.
+			def temporary?
+				TEMPORARY.include?(@status)
+			end
+		end
+
+		@mutex = Mutex.new
+		@state = nil        # [state, pid that made it]
+		@installed = nil
+		@saved = nil        # resolvers of Resolv::DefaultResolver before install
+
+		class << self
+			# The resolver behind the hooks, nil when not installed.
+			attr_reader :installed
+
+			#
+			# call-seq: state() => ADNS::State
+			#
+			# The process-wide state used by resolvers that were not given one. It is
+			# created on first use, switched to io thread mode when possible, and
+			# made again in a forked child, which does not inherit the io thread.
+			#
+			def state
+				state, pid = @state
+				return state if pid == Process.pid
+				@mutex.synchronize {
+					state, pid = @state
+					next state if pid == Process.pid
+					state = ADNS::State.new
+					begin
+						state.start_io_thread
+					rescue NotImplementedError
+						# direct mode
+					end
+					@state = [state, Process.pid]
+					state
+				}
+			end
+
+			#
+			# call-seq: install([opts]) => ADNS::Resolver
+			#
+			# Make a resolver built from <opts> the default resolver of Resolv, and route
+			# Addrinfo.getaddrinfo, Socket.getaddrinfo and TCPSocket.new/open through it.
+			#
+			# Installing again replaces the installed resolver.
+			#
+			def install(opts = {})
+				resolver = new(opts)
+				@mutex.synchronize {
+					::Addrinfo.singleton_class.prepend(AddrinfoHook)
+					::Socket.singleton_class.prepend(SocketHook)
+					::TCPSocket.prepend(TCPSocketHook)
+					@saved ||= Resolv::DefaultResolver.instance_variable_get(:@resolvers)
+					Resolv::DefaultResolver.replace_resolvers([resolver])
+					@installed = resolver
+				}
+			end
+
+			#
+			# call-seq: uninstall() => nil
+			#
+			# Give Resolv::DefaultResolver back the resolvers it had before install and
+			# hand the socket hooks back to libc: they stay prepended, but pass every
+			# call to the original methods while no resolver is installed.
+			#
+			def uninstall
+				@mutex.synchronize {
+					next unless @installed
+					@installed = nil
+					Resolv::DefaultResolver.replace_resolvers(@saved)
+					@saved = nil
+				}
+				nil
+			end
+		end
+
+		def initialize(opts = {})
+			@opts = DEFAULTS.merge(opts)
+			@hosts = @opts[:hosts] && Resolv::Hosts.new(@opts[:hosts])
+			@cache = {}
+			@mutex = Mutex.new
+		end
+
+		# The ADNS::State lookups are submitted on.
+		def state
+			@opts[:state] || Resolver.state
+		end
+
+		#
+		# call-seq: each_address(name) {|address| ... }
+		#
+		# Yield every address of <name> as a String, IPv4 first. Raises
+		# Resolv::ResolvTimeout if the lookup takes longer than :timeout or adns
+		# gives up, ADNS::Resolver::Failure if it fails otherwise.
+		#
+		def each_address(name, &block)
+			addresses(name).each(&block)
+			nil
+		end
+
+		#
+		# call-seq: getaddress(name) => String
+		#
+		# First address of <name>, raises Resolv::ResolvError if there is none.
+		#
+		def getaddress(name)
+			addresses(name).first or raise Resolv::ResolvError, "no address for #{name}"
+		end
+
+		#
+		# call-seq: getaddresses(name) => Array
+		#
+		# All addresses of <name>.
+		#
+		def getaddresses(name)
+			addresses(name).dup
+		end
+
+		#
+		# call-seq: each_name(address) {|name| ... }
+		#
+		# Yield every host name of <address>, from the hosts file or PTR records.
+		#
+		def each_name(address, &block)
+			names(address).each(&block)
+			nil
+		end
+
+		#
+		# call-seq: getname(address) => String
+		#
+		# First host name of <address>, raises Resolv::ResolvError if there is none.
+		#
+		def getname(address)
+			names(address).first or raise Resolv::ResolvError, "no name for #{address}"
+		end
+
+		#
+		# call-seq: getnames(address) => Array
+		#
+		# All host names of <address>.
+		#
+		def getnames(address)
+			names(address)
+		end
+
+		#
+		# call-seq: hookable?(host) => true or false
+		#
+		# True if <host> is a name for this resolver rather than a numeric address
+		# the socket layer parses by itself.
+		#
+		def hookable?(host)
+			host.is_a?(String) && !host.empty? &&
+				host !~ Resolv::IPv4::Regex && host !~ Resolv::IPv6::Regex
+		end
+
+		#
+		# call-seq: socket_addresses(host) => Array
+		#
+		# Addresses of <host> for the socket hooks, which report failures as
+		# SocketError with the message of the getaddrinfo(3) error: EAI_NONAME for
+		# a missing or invalid name, EAI_AGAIN for a timeout or server failure and EAI_FAIL
+		# for anything else.
+		#
+		def socket_addresses(host)
+			list = addresses(host)
+			raise SocketError, "getaddrinfo: Name or service not known" if list.empty?
+			list
+		rescue Resolv::ResolvTimeout
+			raise SocketError, "getaddrinfo: Temporary failure in name resolution"
+		rescue Failure => e
+			raise SocketError, "getaddrinfo: Name or service not known" if INVALID.include?(e.status)
+			raise SocketError, e.temporary? ? "getaddrinfo: Temporary failure in name resolution" :
+				"getaddrinfo: Non-recoverable failure in name resolution"
+		end
+
+		private
+
+		def addresses(name)
+			name = name.to_s
+			if @hosts
+				list = @hosts.getaddresses(name)
+				return list unless list.empty?
+			end
+			cached(name) || fetch(name)
+		end
+
+		def cached(name)
+			@mutex.synchronize {
+				list, expires = @cache[name]
+				next nil unless list
+				next list if expires > Time.now.to_i
+				@cache.delete(name)
+				nil
+			}
+		end
+
+		def remember(name, list, expires)
+			@mutex.synchronize {
+				@cache.delete(name)
+				@cache.shift while @cache.size >= @opts[:cache_size]
+				@cache[name] = [list.freeze, expires]
+			}
+			list
+		end
+
+		def types
+			@opts[:ipv6] && defined?(ADNS::RR::AAAA) ? [ADNS::RR::A, ADNS::RR::AAAA] : [ADNS::RR::A]
+		end
+
+		# Resolve all candidates concurrently, settle in search order.
+		def fetch(name)
+			st = state
+			deadline = @opts[:timeout] && Process.clock_gettime(Process::CLOCK_MONOTONIC) + @opts[:timeout]
+			queries = st.search_candidates(name).map {|domain|
+				types.map {|type| st.submit(domain, type, ADNS::QF::NONE) }
+			}
+			begin
+				answers = []
+				queries.each {|candidate|
+					answers = candidate.map {|q| wait(q, deadline) }
+					next if answers.all? {|a| CONTINUE.include?(a[:status]) }
+					list = answers.select {|a| a[:status] == ADNS::Status::OK }.flat_map {|a| a[:answer] }
+					return remember(name, list, answers.map {|a| a[:expires] }.min) unless list.empty?
+					fail_with(name, answers) # a real failure, not cached
+				}
+				remember(name, [], answers.map {|a| a[:expires] }.min || Time.now.to_i)
+			ensure
+				queries.flatten.each {|q|
+					begin
+						q.cancel
+					rescue ADNS::QueryError
+						# already answered
+					end
+				}
+			end
+		end
+
+		def wait(query, deadline)
+			return query.wait unless deadline
+			remaining = deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+			answer = query.wait(remaining > 0 ? remaining : 0)
+			raise Resolv::ResolvTimeout, "adns timeout" unless answer
+			answer
+		end
+
+		# Raise for the first of <answers> that neither succeeded nor found the name missing.
+		def fail_with(name, answers)
+			answer = answers.find {|a| a[:status] != ADNS::Status::OK && !CONTINUE.include?(a[:status]) }
+			raise Resolv::ResolvTimeout, "#{name}: adns timeout" if answer[:status] == ADNS::Status::Timeout
+			raise Failure.new(name, answer[:status])
+		end
+
+		def names(address)
+			address = address.to_s
+			if @hosts
+				list = @hosts.getnames(address)
+				return list unless list.empty?
+			end
+			st = state
+			query = if address =~ Resolv::IPv4::Regex
+				st.submit_reverse(address, ADNS::RR::PTR)
+			else
+				st.submit("#{Resolv::IPv6.create(address).to_name}.", ADNS::RR::PTR_RAW)
+			end
+			answer = wait(query, @opts[:timeout] && Process.clock_gettime(Process::CLOCK_MONOTONIC) + @opts[:timeout])
+			return answer[:answer] if answer[:status] == ADNS::Status::OK
+			return [] if CONTINUE.include?(answer[:status])
+			fail_with(address, [answer])
+		rescue ArgumentError
+			[] # not an address
+		end
+
+		#
+		# Addrinfo.getaddrinfo through the installed resolver: names are resolved by
+		# adns and handed to the original as numeric hosts.
+		#
+		module AddrinfoHook
+			def getaddrinfo(node, service, family = nil, socktype = nil, protocol = nil, flags = nil, **opts)
+				resolver = Resolver.installed
+				return super unless resolver && resolver.hookable?(node) &&
+					(flags.nil? || flags & ::Socket::AI_NUMERICHOST == 0)
+				numeric = (flags || 0) | ::Socket::AI_NUMERICHOST
+				list = resolver.socket_addresses(node).flat_map {|ip|
+					begin
+						super(ip, service, family, socktype, protocol, numeric, **opts)
+					rescue SocketError
+						[] # other address family
+					end
+				}
+				raise SocketError, "getaddrinfo: Address family for hostname not supported" if list.empty?
+				list
+			end
+		end
+
+		# Socket.getaddrinfo through the installed resolver, see AddrinfoHook.
+		module SocketHook
+			def getaddrinfo(node, service, family = nil, socktype = nil, protocol = nil, flags = nil, *rest)
+				resolver = Resolver.installed
+				return super unless resolver && resolver.hookable?(node) &&
+					(flags.nil? || flags & ::Socket::AI_NUMERICHOST == 0)
+				numeric = (flags || 0) | ::Socket::AI_NUMERICHOST
+				list = resolver.socket_addresses(node).flat_map {|ip|
+					begin
+						super(ip, service, family, socktype, protocol, numeric, *rest)
+					rescue SocketError
+						[] # other address family
+					end
+				}
+				raise SocketError, "getaddrinfo: Address family for hostname not supported" if list.empty?
+				list
+			end
+		end
+
+		#
+		# TCPSocket.new/open through the installed resolver: every address is tried
+		# in turn and the last connection error is raised if none of them answers.
+		#
+		module TCPSocketHook
+			def initialize(host, port, local_host = nil, local_port = nil, **opts)
+				resolver = Resolver.installed
+				return super unless resolver && resolver.hookable?(host)
+				error = nil
+				resolver.socket_addresses(host).each {|ip|
+					begin
+						return super(ip, port, local_host, local_port, **opts)
+					rescue SystemCallError => e
+						error = e
+					end
+				}
+				raise error
+			end
+		end
+	end
+end
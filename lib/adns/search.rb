@@ -0,0 +1,123 @@
+#
+# This file is part of adns-ruby library.
+#
+
+module ADNS
+	#
+	# ADNS::SearchQuery is returned by ADNS::State#submit_search.
+	#
+	# Instead of letting adns walk the search list one candidate after another
+	# (ADNS::QF::SEARCH), every candidate domain is submitted up front and the
+	# answer is picked in search order: the first candidate that resolves wins,
+	# as soon as all candidates before it have failed with NXDomain or NoData.
+	# The remaining candidates are cancelled at that point. Candidates are
+	# submitted with ADNS::State#submit_detached, so they never show up in
+	# ADNS::State#completed_queries.
+	#
+	class SearchQuery
+		# Statuses that move the search on to the next candidate, like adns does.
+		CONTINUE = [ADNS::Status::NXDomain, ADNS::Status::NoData]
+
+		# Candidate domains in search order.
+		attr_reader :candidates
+
+		def initialize(state, candidates, type, qflags)
+			@candidates = candidates
+			@queries = []
+			begin
+				candidates.each {|domain| @queries << state.submit_detached(domain, type, qflags) }
+			rescue Exception
+				cancel_from(0)
+				raise
+			end
+			@answer = nil
+		end
+
+		#
+		# call-seq: check => Hash or raises ADNS::NotReadyError
+		#
+		# Check pending candidates and retrieve the winning answer, or raises
+		# ADNS::NotReadyError if a higher priority candidate is still pending.
+		#
+		def check
+			@answer || settle {|q| q.check }
+		end
+
+		#
+		# call-seq: check_nonblock => Hash or nil
+		#
+		# Like check, but returns nil instead of raising ADNS::NotReadyError.
+		#
+		def check_nonblock
+			@answer || settle {|q| q.check_nonblock or return nil }
+		end
+
+		#
+		# call-seq: wait() => Hash
+		#
+		# Wait until the winning answer is known.
+		#
+		def wait
+			@answer || settle {|q| q.wait }
+		end
+
+		#
+		# call-seq: cancel() => nil
+		#
+		# Cancel all candidates still pending.
+		#
+		def cancel
+			cancel_from(0)
+			nil
+		end
+
+		private
+
+		def settle
+			last = nil
+			@queries.each_with_index {|q, idx|
+				last = yield(q)
+				next if CONTINUE.include?(last[:status])
+				cancel_from(idx + 1)
+				return @answer = last
+			}
+			@answer = last
+		end
+
+		def cancel_from(idx)
+			@queries[idx..-1].each {|q|
+				begin
+					q.cancel
+				rescue ADNS::QueryError
+					# already answered
+				end
+			}
+		end
+	end
+
+	class State
+		#
+		# call-seq: search_candidates(domain) => Array
+		#
+		# Expand <domain> against the search list the way ADNS::QF::SEARCH does:
+		# a trailing dot disables searching, domains with at least ndots dots are
+		# tried as is first, others only after the search list.
+		#
+		def search_candidates(domain)
+			return [domain] if domain.end_with?('.')
+			searched = search_list.map {|suffix| "#{domain}.#{suffix}" }
+			domain.count('.') >= ndots ? [domain] + searched : searched + [domain]
+		end
+
+		#
+		# call-seq: submit_search(domain, type[, qflags]) => ADNS::SearchQuery
+		#
+		# Submit asynchronous request to resolve domain <domain> of record type <type> against
+		# every search list candidate concurrently, using optional query flags <qflags>.
+		# Short names then take a single round trip instead of one per search domain.
+		#
+		def submit_search(domain, type, qflags = ADNS::QF::NONE)
+			SearchQuery.new(self, search_candidates(domain), type, qflags & ~ADNS::QF::SEARCH)
+		end
+	end
+end
@@ -0,0 +1,288 @@
+#
+# This file is part of adns-ruby library.
+#
+require 'thread'
+
+module ADNS
+	#
+	# ADNS::Watcher keeps the answers for a set of hot (domain, type) pairs
+	# resolved in the background, re-submitting each one shortly before its
+	# answer expires.
+	#
+	# The latest answers live in a frozen snapshot Hash which is replaced as a
+	# whole on every update, so ADNS::Watcher#[] is a plain memory read: it
+	# takes no lock and never touches the network.
+	#
+	# When a refresh fails (error status or ADNS::Error) the last good answer
+	# keeps being served and is flagged stale until a refresh succeeds, or
+	# until it is older than :max_stale seconds past its expiry.
+	#
+	# Refresh queries are submitted on the watcher's ADNS::State, so they also
+	# show up in ADNS::State#completed_queries if the state is shared. While
+	# refreshes are out the thread blocks in ADNS::Query#wait on the oldest
+	# one, so answers that come in meanwhile are published along with it.
+	# An unexpected exception is kept in #last_error and the thread goes on.
+	#
+	#  watcher = adns.watcher
+	#  watcher.watch('_http._tcp.example.com', ADNS::RR::SRV)
+	#  watcher['_http._tcp.example.com']     # => answer Hash or nil
+	#
+	class Watcher
+		DEFAULTS = {
+			:lead         => 2.0,   # refresh this many seconds before expires
+			:min_interval => 1.0,   # never refresh a name more often than this
+			:retry        => 1.0,   # first retry delay after a failed refresh
+			:max_retry    => 30.0,  # retry delay backoff cap
+			:max_stale    => nil,   # seconds past expires to serve stale answers (nil: forever)
+		}
+
+		Entry = Struct.new(:domain, :type, :qflags, :query, :answer, :refresh_at, :failures, :stale)
+
+		# Raised in the thread by #watch and #stop to cut a query wait short.
+		class Wakeup < Exception; end
+		private_constant :Wakeup
+
+		# The last exception other than ADNS::Error the thread ran into, or nil.
+		attr_reader :last_error
+
+		attr_reader :state, :opts
+
+		def initialize(state, opts = {})
+			@state = state
+			@opts = DEFAULTS.merge(opts).freeze
+			@entries = []
+			@snapshot = {}.freeze
+			@stale = {}.freeze
+			@mutex = Mutex.new
+			@cond = ConditionVariable.new
+			@stopped = false
+			@waiting = false
+			@last_error = nil
+			@thread = Thread.new { run }
+		end
+
+		#
+		# call-seq: watch(domain, type[, qflags]) => self
+		#
+		# Register <domain> of record type <type> for background refresh.
+		# The first type watched for a domain is the one returned by [](domain).
+		#
+		def watch(domain, type, qflags = ADNS::QF::NONE)
+			@mutex.synchronize {
+				unless @entries.any? {|e| e.domain == domain && e.type == type }
+					@entries << Entry.new(domain, type, qflags, nil, nil, 0.0, 0, false)
+				end
+				wake
+			}
+			self
+		end
+
+		#
+		# call-seq: unwatch(domain[, type]) => self
+		#
+		# Stop refreshing <domain> (only record type <type> if given).
+		#
+		def unwatch(domain, type = nil)
+			@mutex.synchronize {
+				@entries.reject! {|e|
+					next false unless e.domain == domain && (type.nil? || e.type == type)
+					cancel(e.query) if e.query
+					true
+				}
+				publish
+			}
+			self
+		end
+
+		#
+		# call-seq: [](domain[, type]) => Hash or nil
+		#
+		# Latest answer for <domain>, without any DNS traffic.
+		#
+		def [](domain, type = nil)
+			(types = @snapshot[domain]) && types[type]
+		end
+
+		#
+		# call-seq: stale?(domain[, type]) => true or false
+		#
+		# True if the answer served for <domain> comes from before a failed refresh.
+		#
+		def stale?(domain, type = nil)
+			(types = @stale[domain]) ? types.include?(type) : false
+		end
+
+		# Names currently being watched, answered yet or not.
+		def domains
+			@mutex.synchronize { @entries.map {|e| e.domain }.uniq }
+		end
+
+		#
+		# call-seq: stop() => nil
+		#
+		# Cancel pending refreshes and stop the background thread.
+		#
+		def stop
+			@mutex.synchronize {
+				@stopped = true
+				wake
+			}
+			@thread.join
+			nil
+		end
+
+		private
+
+		def run
+			Thread.handle_interrupt(Wakeup => :never) {
+				@mutex.synchronize {
+					until @stopped
+						begin
+							step
+							pause unless @stopped
+						rescue StandardError => e
+							@last_error = e
+							@cond.wait(@mutex, @opts[:retry]) unless @stopped
+						end
+					end
+					@entries.each {|e| cancel(e.query) if e.query }
+				}
+			}
+		end
+
+		def step
+			now = Time.now.to_f
+			@entries.each {|e| refresh(e) if e.query.nil? && e.refresh_at <= now }
+			changed = false
+			@entries.each {|e| changed |= collect(e, now) if e.query }
+			publish if changed
+		end
+
+		# Block until the next refresh is due, the oldest refresh out is answered,
+		# or #watch or #stop wake the thread. Query waits run without @mutex.
+		def pause
+			timeout = next_wakeup(Time.now.to_f)
+			pending = @entries.find {|e| e.query }
+			return @cond.wait(@mutex, timeout) unless pending
+			query = pending.query
+			@waiting = true
+			@mutex.unlock
+			begin
+				Thread.handle_interrupt(Wakeup => :immediate) { query.wait(timeout) }
+			rescue Wakeup, ADNS::Error
+				# collected by the next step
+			ensure
+				@mutex.lock
+				@waiting = false
+			end
+		end
+
+		# Under @mutex: get the thread out of #pause.
+		def wake
+			@cond.signal
+			@thread.raise(Wakeup) if @waiting
+		end
+
+		def next_wakeup(now)
+			due = @entries.reject {|e| e.query }.map {|e| e.refresh_at }.min
+			due ? [[due - now, 0.0].max, @opts[:max_retry]].min : @opts[:max_retry]
+		end
+
+		def cancel(query)
+			query.cancel
+		rescue ADNS::QueryError
+			# answered meanwhile
+		end
+
+		def refresh(e)
+			e.query = @state.submit(e.domain, e.type, e.qflags)
+		rescue ADNS::Error
+			failed(e, nil, Time.now.to_f)
+		end
+
+		# Returns true if the published snapshot needs to change.
+		def collect(e, now)
+			begin
+				answer = e.query.check_nonblock
+				return false unless answer
+			rescue ADNS::Error
+				answer = nil
+			end
+			e.query = nil
+			if answer && answer[:status] == ADNS::Status::OK
+				ttl = answer[:expires] - now
+				e.refresh_at = now + [ttl - [@opts[:lead], ttl / 2].min, @opts[:min_interval]].max
+				e.answer = answer
+				e.failures = 0
+				e.stale = false
+				true
+			else
+				failed(e, answer, now)
+			end
+		end
+
+		def failed(e, answer, now)
+			e.failures += 1
+			e.refresh_at = now + [@opts[:retry] * (2 ** (e.failures - 1)), @opts[:max_retry]].min
+			if e.answer.nil? || e.answer[:status] != ADNS::Status::OK
+				# nothing good to fall back on, serve the failure itself
+				e.answer = answer
+				e.stale = false
+			elsif @opts[:max_stale] && now > e.answer[:expires] + @opts[:max_stale]
+				e.answer = nil
+				e.stale = false
+			else
+				e.stale = true
+			end
+			true
+		end
+
+		def publish
+			snapshot = {}
+			stale = {}
+			@entries.each {|e|
+				primary = !snapshot.key?(e.domain)
+				types = (snapshot[e.domain] ||= {})
+				types[nil] = e.answer if primary
+				types[e.type] = e.answer
+				if e.stale
+					flags = (stale[e.domain] ||= [])
+					flags << nil if primary
+					flags << e.type
+				end
+			}
+			snapshot.each_value {|types| types.freeze }
+			stale.each_value {|flags| flags.freeze }
+			@stale = stale.freeze
+			@snapshot = snapshot.freeze
+		end
+	end
+
+	class State
+		#
+		# call-seq: watcher([opts]) => ADNS::Watcher
+		#
+		# Background refresher bound to this state, see ADNS::Watcher. The
+		# watcher is created on the first call; later calls return it and raise
+		# ArgumentError if they pass <opts> it was not created with.
+		#
+		def watcher(opts = {})
+			if @watcher
+				unless opts.empty? || @watcher.opts == Watcher::DEFAULTS.merge(opts)
+					raise ArgumentError, "watcher already created with options #{@watcher.opts.inspect}"
+				end
+				return @watcher
+			end
+			@watcher = Watcher.new(self, opts)
+		end
+
+		# State#finish stops the watcher first, its thread would keep submitting otherwise.
+		module StopWatcher
+			def finish
+				@watcher.stop if @watcher
+				super
+			end
+		end
+		prepend StopWatcher
+	end
+end
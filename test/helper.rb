@@ -0,0 +1,127 @@
+#
+# This file is part of adns-ruby library.
+#
+require 'minitest/autorun'
+require 'adns'
+require 'resolv'
+require 'socket'
+
+module ADNSTest
+	# Config text of a nameserver nothing answers on: queries sent to it stay
+	# pending until adns gives up on them, tens of seconds later.
+	SILENT = "nameserver 127.0.0.9\n"
+
+	#
+	# A nameserver on ADDR port 53, answering from <zone> in a child process
+	# until closed. <zone> maps names to Resolv::DNS::Resource lists: other
+	# names get NXDomain, record types a name lacks get NoData, and SRV answers
+	# carry the A records of their targets as additional records. With <rcode>
+	# every query is answered with that rcode instead.
+	#
+	class DNSServer
+		ADDR = '127.0.0.55'
+
+		def initialize(zone, rcode = nil, ttl = 300)
+			sock = UDPSocket.new
+			sock.bind(ADDR, 53)
+			@pid = fork {
+				loop {
+					data, from = sock.recvfrom(512)
+					reply = answer(zone, rcode, ttl, data) rescue next
+					sock.send(reply, 0, from[3], from[1])
+				}
+			}
+			sock.close
+		end
+
+		# Config text for ADNS::State.new2.
+		def config
+			"nameserver #{ADDR}\n"
+		end
+
+		def close
+			Process.kill(:KILL, @pid)
+			Process.waitpid(@pid)
+		end
+
+		private
+
+		def answer(zone, rcode, ttl, data)
+			query = Resolv::DNS::Message.decode(data)
+			name, type = query.question.first
+			reply = Resolv::DNS::Message.new(query.id)
+			reply.qr = 1
+			reply.rd = query.rd
+			reply.ra = 1
+			reply.add_question(name, type)
+			records = zone[name.to_s.downcase]
+			if rcode || records.nil?
+				reply.rcode = rcode || Resolv::DNS::RCode::NXDomain
+				return reply.encode
+			end
+			records.grep(type).each {|rr|
+				reply.add_answer(name, ttl, rr)
+				next unless rr.is_a?(Resolv::DNS::Resource::IN::SRV)
+				(zone[rr.target.to_s.downcase] || []).grep(Resolv::DNS::Resource::IN::A).each {|a|
+					reply.add_additional(rr.target, ttl, a)
+				}
+			}
+			reply.encode
+		end
+	end
+
+	# A DNSServer for the test, or skip it where port 53 cannot be bound.
+	def dns_server(zone, rcode: nil, ttl: 300)
+		DNSServer.new(zone, rcode, ttl)
+	rescue Errno::EACCES, Errno::EADDRINUSE, Errno::EADDRNOTAVAIL
+		skip "cannot serve DNS on #{DNSServer::ADDR}:53"
+	end
+
+	# <state> switched to io thread mode, or skip the test where that is not built in.
+	def io_thread_state(state = ADNS::State.new2(SILENT))
+		state.start_io_thread
+		state
+	rescue NotImplementedError
+		skip 'no io thread support'
+	end
+
+	# Exit status of a child running the block, nil if it was still alive after
+	# <seconds> and had to be killed. The child exits normally, freeing what is left.
+	def fork_within(seconds)
+		pid = fork {
+			begin
+				yield
+			rescue Exception => e
+				$stderr.puts "#{e.class}: #{e.message}"
+				exit!(1)
+			end
+			exit(0)
+		}
+		stop = Process.clock_gettime(Process::CLOCK_MONOTONIC) + seconds
+		loop {
+			_, status = Process.waitpid2(pid, Process::WNOHANG)
+			return status.exitstatus if status
+			break if Process.clock_gettime(Process::CLOCK_MONOTONIC) > stop
+			sleep 0.01
+		}
+		Process.kill(:KILL, pid)
+		Process.waitpid(pid)
+		nil
+	end
+
+	# Wait up to <seconds> for the block to return true.
+	def eventually(seconds = 5)
+		stop = Process.clock_gettime(Process::CLOCK_MONOTONIC) + seconds
+		until yield
+			return false if Process.clock_gettime(Process::CLOCK_MONOTONIC) > stop
+			sleep 0.01
+		end
+		true
+	end
+
+	def elapsed
+		t0 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+		yield
+		Process.clock_gettime(Process::CLOCK_MONOTONIC) - t0
+	end
+end
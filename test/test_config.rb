@@ -0,0 +1,97 @@
+#
+# This file is part of adns-ruby library.
+#
+require 'helper'
+require 'tempfile'
+
+# ADNS::Config.new and ADNS::State.new must see the configuration adns_init() reads.
+class TestConfig < Minitest::Test
+	VARIABLES = %w(RES_CONF ADNS_RES_CONF RES_CONF_TEXT ADNS_RES_CONF_TEXT
+	               RES_OPTIONS ADNS_RES_OPTIONS LOCALDOMAIN ADNS_LOCALDOMAIN)
+
+	def setup
+		@saved = VARIABLES.map {|name| [name, ENV.delete(name)] }
+		@conf = Tempfile.new('resolv.conf')
+		@conf.write("nameserver 10.0.0.1\nsearch file.example\n")
+		@conf.flush
+	end
+
+	def teardown
+		@saved.each {|name, value| ENV[name] = value }
+		@conf.close!
+	end
+
+	def test_res_conf_files
+		extra = Tempfile.new('res_conf')
+		extra.write("nameserver 10.0.0.2\nsearch res-conf.example\n")
+		extra.flush
+		ENV['RES_CONF'] = extra.path
+		config = ADNS::Config.new(@conf.path)
+		assert_match(/nameserver 10\.0\.0\.1.*nameserver 10\.0\.0\.2/m, config.text)
+		assert_equal ['res-conf.example'], config.search_list
+	ensure
+		extra.close!
+	end
+
+	def test_res_conf_text
+		ENV['RES_CONF_TEXT'] = "search text.example\noptions ndots:3"
+		config = ADNS::Config.new(@conf.path)
+		assert_equal ['text.example'], config.search_list
+		assert_equal 3, config.ndots
+	end
+
+	def test_order
+		ENV['RES_CONF_TEXT'] = 'search text.example'
+		ENV['ADNS_LOCALDOMAIN'] = 'adns.example'
+		ENV['LOCALDOMAIN'] = 'local.example'
+		ENV['RES_OPTIONS'] = 'ndots:4'
+		config = ADNS::Config.new(@conf.path)
+		assert_equal ['adns.example'], config.search_list # LOCALDOMAIN comes last
+		assert_equal 4, config.ndots
+	end
+
+	def test_noenv
+		ENV['RES_CONF_TEXT'] = 'search text.example'
+		ENV['LOCALDOMAIN'] = 'local.example'
+		config = ADNS::Config.new(@conf.path, ADNS::IF::NOENV)
+		assert_equal ['file.example'], config.search_list
+	end
+
+	def test_reload_on_res_conf_change
+		extra = Tempfile.new('res_conf')
+		extra.write("search one.example\n")
+		extra.flush
+		ENV['RES_CONF'] = extra.path
+		config = ADNS::Config.new(@conf.path)
+		config.check_interval = 1
+		state = config.new_state
+		generation = config.generation
+		sleep 1.1
+		File.write(extra.path, "search two.example other.example\n")
+		state.submit('reload.example', ADNS::RR::A).cancel
+		assert_operator config.generation, :>, generation
+		assert_equal ['two.example', 'other.example'], config.search_list
+	ensure
+		extra.close!
+	end
+
+	def test_state_new_search_list
+		ENV['RES_CONF_TEXT'] = 'search text.example'
+		assert_equal ['text.example'], ADNS::State.new.search_list
+	end
+
+	def test_state_new_nameservers
+		ENV['RES_CONF_TEXT'] = 'nameserver 10.9.9.9'
+		state = ADNS::State.new(ADNS::IF::NOERRPRINT)
+		ENV.delete('RES_CONF_TEXT') # read along with adns_init, not later
+		assert_includes state.nameservers, '10.9.9.9'
+		state.nameservers = ['10.9.9.9']
+		assert_equal '10.9.9.9', state.nameservers.first
+	end
+
+	def test_state_new2_arguments
+		assert_raises(ArgumentError) { ADNS::State.new2 }
+		assert_raises(ArgumentError) { ADNS::State.new2("nameserver 10.0.0.1\n", 0, '/dev/null', 'w', 1) }
+		assert_equal ['10.0.0.1'], ADNS::State.new2("nameserver 10.0.0.1\n").nameservers
+	end
+end
@@ -0,0 +1,61 @@
+#
+# This file is part of adns-ruby library.
+#
+require 'helper'
+
+# Answers decoded from the wire through rr_decoders.
+class TestDecoders < Minitest::Test
+	include ADNSTest
+
+	IN = Resolv::DNS::Resource::IN
+	NAME = Resolv::DNS::Name
+	ZONE = {
+		'host.example' => [IN::A.new('10.0.0.1'), IN::TXT.new('ab', 'cd', 'ef')],
+		'example' => [IN::SOA.new(NAME.create('ns.example.'), NAME.create('hostmaster.example.'),
+		                          2024010101, 3600, 600, 1209600, 300)],
+		'_http._tcp.example' => [IN::SRV.new(10, 5, 8080, NAME.create('host.example.'))],
+	}
+
+	def setup
+		@server = dns_server(ZONE)
+		@state = ADNS::State.new2(@server.config)
+	end
+
+	def teardown
+		@server.close if @server
+	end
+
+	def answer(domain, type)
+		answer = @state.submit(domain, type).wait(5)
+		assert_equal ADNS::Status::OK, answer[:status]
+		answer[:answer]
+	end
+
+	def test_a
+		assert_equal ['10.0.0.1'], answer('host.example', ADNS::RR::A)
+	end
+
+	def test_txt_concatenates_strings
+		assert_equal ['abcdef'], answer('host.example', ADNS::RR::TXT)
+	end
+
+	def test_soa
+		soa = answer('example', ADNS::RR::SOA).first
+		assert_equal 2024010101, soa[:serial]
+		assert_equal [3600, 600, 1209600, 300], soa.values_at(:refresh, :retry, :expire, :minimum)
+		assert_equal 'ns.example', soa[:mname]
+	end
+
+	def test_srv_deref
+		srv = answer('_http._tcp.example', ADNS::RR::SRV).first
+		assert_equal 'host.example', srv[:host]
+		assert_equal [10, 5, 8080], srv.values_at(:priority, :weight, :port)
+		assert_equal 'host.example', srv[:addrs][:host]
+		assert_equal ['10.0.0.1'], srv[:addrs][:addr]
+	end
+
+	def test_srv_raw
+		srv = answer('_http._tcp.example', ADNS::RR::SRV_RAW).first
+		assert_equal({:host => 'host.example', :priority => 10, :weight => 5, :port => 8080}, srv)
+	end
+end
@@ -0,0 +1,40 @@
+#
+# This file is part of adns-ruby library.
+#
+require 'helper'
+
+class TestIOThread < Minitest::Test
+	include ADNSTest
+
+	def test_refused_with_throttled_queries_queued
+		io_thread_state # or skip
+		state = ADNS::State.new2(SILENT)
+		state.set_rate_limit(1, 1)
+		# answered locally, so only the rate limiter holds queries afterwards
+		state.submit('invalid..example', ADNS::RR::A).wait
+		queued = 2.times.map { state.submit('invalid..example', ADNS::RR::A) }
+		assert_raises(ADNS::QueryError) { state.start_io_thread }
+		refute state.io_thread?
+		queued.each(&:cancel)
+		io_thread_state(state)
+		assert state.io_thread?
+	end
+
+	def test_forked_child_drops_io_thread
+		state = io_thread_state
+		query = state.submit('example.com', ADNS::RR::A)
+		status = fork_within(5) {
+			[-> { state.submit('example.com', ADNS::RR::A) }, -> { query.wait(0.1) }].each {|call|
+				begin
+					call.()
+					raise 'io thread state usable after fork'
+				rescue ADNS::Error
+				end
+			}
+			state.finish # without joining a thread that is not there
+		}
+		assert_equal 0, status
+		assert_nil query.wait(0.05) # the parent's io thread carries on
+		query.cancel
+	end
+end
@@ -0,0 +1,84 @@
+#
+# This file is part of adns-ruby library.
+#
+require 'helper'
+
+# submit_nonblock, check_nonblock and ready?, in both modes.
+class TestNonblock < Minitest::Test
+	include ADNSTest
+
+	A = Resolv::DNS::Resource::IN::A
+
+	def setup
+		@server = dns_server({'host.example' => [A.new('10.0.0.1')]})
+	end
+
+	def teardown
+		@server.close if @server
+	end
+
+	def states
+		[ADNS::State.new2(@server.config), io_thread_state(ADNS::State.new2(@server.config))]
+	end
+
+	def test_check_nonblock
+		states.each {|state|
+			query = state.submit('host.example', ADNS::RR::A)
+			assert eventually { query.check_nonblock }
+			assert_equal ['10.0.0.1'], query.check_nonblock[:answer]
+		}
+		[ADNS::State.new2(SILENT), io_thread_state].each {|state|
+			query = state.submit('timeout.example', ADNS::RR::A)
+			2.times { assert_nil query.check_nonblock }
+			query.cancel
+			assert_raises(ADNS::QueryError) { query.check_nonblock }
+		}
+	end
+
+	def test_ready_does_not_collect
+		states.each {|state|
+			reports = []
+			state.timing_hook = proc {|query, timings| reports << query }
+			query = state.submit('host.example', ADNS::RR::A)
+			assert eventually { query.ready? }
+			assert query.ready?
+			assert_equal [], reports # left for check
+			assert_equal ['10.0.0.1'], query.check[:answer]
+			assert_equal [query], reports
+			assert query.ready?
+		}
+	end
+
+	def test_ready_pending_and_cancelled
+		[ADNS::State.new2(SILENT), io_thread_state].each {|state|
+			query = state.submit('timeout.example', ADNS::RR::A)
+			refute query.ready?
+			query.cancel
+			assert query.ready? # check raises, but not ADNS::NotReadyError
+			assert_raises(ADNS::QueryError) { query.check }
+		}
+	end
+
+	def test_ready_keeps_failure
+		state = io_thread_state
+		query = state.submit('unknown-type.example', 12345) # adns_submit: ENOSYS
+		assert eventually { query.ready? }
+		2.times {
+			e = assert_raises(ADNS::Error) { query.check }
+			assert_equal Errno::ENOSYS.new.message, e.message # not "invalid query"
+		}
+		assert_raises(ADNS::QueryError) { query.cancel }
+	end
+
+	def test_submit_nonblock
+		states.each {|state|
+			query = state.submit_nonblock('host.example', ADNS::RR::A)
+			assert_kind_of ADNS::Query, query
+			assert_equal ['10.0.0.1'], query.wait(5)[:answer]
+		}
+		state = ADNS::State.new2(SILENT)
+		assert_equal Errno::ENOSYS::Errno, state.submit_nonblock('host.example', 12345)
+		state.finish
+		assert_equal Errno::ESHUTDOWN::Errno, state.submit_nonblock('host.example', ADNS::RR::A)
+	end
+end
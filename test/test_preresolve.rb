@@ -0,0 +1,29 @@
+#
+# This file is part of adns-ruby library.
+#
+require 'helper'
+
+class TestPreresolve < Minitest::Test
+	include ADNSTest
+
+	def test_creates_cache
+		state = ADNS::State.new2(SILENT)
+		report = state.preresolve([['invalid..example', ADNS::RR::A]], deadline: 0.2)
+		assert_kind_of ADNS::SharedCache, state.shared_cache
+		assert_nil state.shared_cache.path # anonymous
+		assert_equal({['invalid..example', ADNS::RR::A] => ADNS::Status::QueryDomainInvalid}, report[:failed])
+		cache = state.shared_cache
+		state.preresolve([], deadline: 0.2)
+		assert_same cache, state.shared_cache # kept
+	end
+
+	def test_attaches_given_cache
+		state = ADNS::State.new2(SILENT)
+		cache = ADNS::SharedCache.new
+		report = state.preresolve([['example.com', ADNS::RR::A], ['invalid..example', ADNS::RR::A]],
+		                          deadline: 0.2, cache: cache)
+		assert_same cache, state.shared_cache
+		assert_equal [['example.com', ADNS::RR::A]], report[:timed_out]
+		assert_equal({['invalid..example', ADNS::RR::A] => ADNS::Status::QueryDomainInvalid}, report[:failed])
+	end
+end
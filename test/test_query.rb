@@ -0,0 +1,103 @@
+#
+# This file is part of adns-ruby library.
+#
+require 'helper'
+
+class TestQuery < Minitest::Test
+	include ADNSTest
+
+	def test_wait_timeout_direct
+		query = ADNS::State.new2(SILENT).submit('timeout.example', ADNS::RR::A)
+		answer = nil
+		t = elapsed { answer = query.wait(0.2) }
+		assert_nil answer
+		assert_in_delta 0.2, t, 0.15
+		assert_nil query.check_nonblock # still pending
+		query.cancel
+	end
+
+	def test_wait_timeout_io_thread
+		query = io_thread_state.submit('timeout.example', ADNS::RR::A)
+		answer = nil
+		t = elapsed { answer = query.wait(0.2) }
+		assert_nil answer
+		assert_in_delta 0.2, t, 0.15
+		query.cancel
+	end
+
+	def test_wait_direct_releases_gvl
+		query = ADNS::State.new2(SILENT).submit('timeout.example', ADNS::RR::A)
+		ticks = 0
+		ticker = Thread.new { loop { ticks += 1; sleep 0.01 } }
+		query.wait(0.3)
+		ticker.kill
+		assert_operator ticks, :>, 5
+	end
+
+	def test_wait_direct_interruptible
+		query = ADNS::State.new2(SILENT).submit('timeout.example', ADNS::RR::A)
+		waiter = Thread.new { query.wait }
+		waiter.report_on_exception = false
+		sleep 0.1
+		waiter.raise(RuntimeError, 'interrupted')
+		assert_raises(RuntimeError) { waiter.join(5) }
+	end
+
+	def test_cancelled_io_thread_queries_are_not_outstanding
+		state = io_thread_state
+		3.times.map { state.submit('cancel.example', ADNS::RR::A) }.each(&:cancel)
+		sleep 0.05
+		t = elapsed { assert_equal [], state.completed_queries(1.0) }
+		assert_operator t, :<, 0.5
+	end
+
+	def test_failed_io_thread_queries_are_not_outstanding
+		state = io_thread_state
+		query = state.submit('unknown-type.example', 12345) # adns_submit: ENOSYS
+		sleep 0.05
+		t = elapsed { assert_equal [], state.completed_queries(1.0) }
+		assert_operator t, :<, 0.5
+		assert_raises(ADNS::Error) { query.check }
+	end
+
+	def test_finish_invalidates_queries
+		state = ADNS::State.new2(SILENT)
+		query = state.submit('example.com', ADNS::RR::A)
+		assert_nil state.finish
+		assert_raises(ADNS::QueryError) { query.wait(0.1) }
+		assert_raises(ADNS::Error) { state.submit('example.com', ADNS::RR::A) }
+		assert_raises(ADNS::Error) { state.completed_queries(0.0) }
+		assert_raises(ADNS::Error) { state.synchronous('example.com', ADNS::RR::A) }
+	end
+
+	def test_finish_while_waiting_direct
+		state = ADNS::State.new2(SILENT)
+		query = state.submit('example.com', ADNS::RR::A)
+		waiters = [Thread.new { query.wait }, Thread.new { state.completed_queries(5.0) }]
+		waiters.each {|w| w.report_on_exception = false }
+		sleep 0.1
+		t = elapsed { state.finish }
+		assert_operator t, :<, 1.0
+		assert_raises(ADNS::QueryError) { waiters[0].join(1) }
+		assert_equal [], waiters[1].value
+	end
+
+	def test_finish_while_waiting_io_thread
+		state = io_thread_state
+		query = state.submit('example.com', ADNS::RR::A)
+		waiters = [Thread.new { query.wait }, Thread.new { state.completed_queries(5.0) }]
+		waiters.each {|w| w.report_on_exception = false }
+		sleep 0.1
+		state.finish
+		assert_raises(ADNS::Error) { waiters[0].join(1) }
+		assert_equal [], waiters[1].join(1).value
+	end
+
+	def test_wait_until_cancels_at_deadline
+		[ADNS::State.new2(SILENT), io_thread_state].each {|state|
+			query = state.submit('example.com', ADNS::RR::A)
+			assert_nil query.wait_until(Process.clock_gettime(Process::CLOCK_MONOTONIC) + 0.1)
+			assert_raises(ADNS::QueryError) { query.cancel }
+		}
+	end
+end
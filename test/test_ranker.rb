@@ -0,0 +1,79 @@
+#
+# This file is part of adns-ruby library.
+#
+require 'helper'
+
+class TestRanker < Minitest::Test
+	include ADNSTest
+
+	def teardown
+		@ranker.stop if @ranker
+		@server.close if @server
+	end
+
+	# A stopped ranker with its first round's samples forgotten.
+	def idle_ranker(opts = {})
+		@ranker = ADNS::State.new2(SILENT).nameserver_ranker({:interval => 60, :timeout => 0.1}.merge(opts))
+		@ranker.stop
+		servers.clear
+		@ranker
+	end
+
+	def servers
+		@ranker.instance_variable_get(:@servers)
+	end
+
+	def test_record
+		r = idle_ranker(:alpha => 0.5)
+		r.send(:record, 'a', 0.1)
+		assert_equal({'a' => {:rtt => 0.1, :failure_rate => 0.0, :samples => 1}}, r.stats)
+		r.send(:record, 'a', nil)
+		assert_equal({:rtt => 0.1, :failure_rate => 0.5, :samples => 2}, r.stats['a'])
+		r.send(:record, 'a', 0.3)
+		assert_in_delta 0.2, r.stats['a'][:rtt], 1e-9
+		assert_in_delta 0.25, r.stats['a'][:failure_rate], 1e-9
+		assert_equal 3, r.stats['a'][:samples]
+	end
+
+	def test_ordered
+		r = idle_ranker
+		r.send(:record, 'slow', 0.3)
+		r.send(:record, 'fast', 0.1)
+		r.send(:record, 'dead', nil)                          # failure rate 1.0
+		[nil, 0.05, nil].each {|rtt| r.send(:record, 'flaky', rtt) } # 0.79
+		servers['new'] = ADNS::NameserverRanker::Server.new(nil, nil, nil, 0)
+		# healthy by rtt, unmeasured last among them; then failing, least failing first
+		assert_equal %w(fast slow new flaky dead), r.send(:ordered, %w(dead slow new flaky fast))
+		assert_equal %w(fast slow), r.send(:ordered, %w(slow fast))
+	end
+
+	def test_rank_applies_on_next_submit
+		@server = dns_server({})
+		state = ADNS::State.new2(SILENT + @server.config)
+		assert_equal ['127.0.0.9', DNSServer::ADDR], state.nameservers
+		@ranker = state.nameserver_ranker(:interval => 60, :timeout => 0.3)
+		assert eventually { state.nameservers.first == DNSServer::ADDR }
+		stats = @ranker.stats
+		assert_equal 1.0, stats['127.0.0.9'][:failure_rate]
+		assert_equal 0.0, stats[DNSServer::ADDR][:failure_rate]
+		assert_operator stats[DNSServer::ADDR][:rtt], :<, 0.3
+		answer = state.submit('nxdomain.example', ADNS::RR::A).wait(1) # the new order, answered
+		assert_equal ADNS::Status::NXDomain, answer[:status]
+	end
+
+	def test_stop_joins_thread
+		@ranker = ADNS::State.new2(SILENT).nameserver_ranker(:interval => 60, :timeout => 0.1)
+		thread = @ranker.instance_variable_get(:@thread)
+		assert_nil @ranker.stop
+		refute thread.alive?
+		assert servers.values.all? {|s| s.state.nil? }
+	end
+
+	def test_finish_stops_ranker
+		state = ADNS::State.new2(SILENT)
+		@ranker = state.nameserver_ranker(:interval => 60, :timeout => 0.1)
+		thread = @ranker.instance_variable_get(:@thread)
+		state.finish
+		refute thread.alive?
+	end
+end
@@ -0,0 +1,76 @@
+#
+# This file is part of adns-ruby library.
+#
+require 'helper'
+require 'adns/resolv'
+
+class TestResolv < Minitest::Test
+	include ADNSTest
+
+	# A resolver whose lookups all end in <error>.
+	class Failing < ADNS::Resolver
+		def initialize(error)
+			super(:hosts => nil)
+			@error = error
+		end
+
+		private
+
+		def addresses(name)
+			raise @error
+		end
+	end
+
+	def test_forked_child_gets_own_state
+		parent = ADNS::Resolver.state
+		rd, wr = IO.pipe
+		status = fork_within(5) {
+			rd.close
+			wr.puts ADNS::Resolver.state.equal?(parent)
+			wr.close
+		}
+		wr.close
+		assert_equal 0, status
+		assert_equal "false\n", rd.read
+		assert_same parent, ADNS::Resolver.state
+	ensure
+		rd.close if rd
+	end
+
+	def test_timeout
+		resolver = ADNS::Resolver.new(:hosts => nil, :timeout => 0.2, :state => ADNS::State.new2(SILENT))
+		assert_raises(Resolv::ResolvTimeout) { resolver.getaddress('example.com') }
+		e = assert_raises(SocketError) { resolver.socket_addresses('example.com') }
+		assert_equal 'getaddrinfo: Temporary failure in name resolution', e.message
+	end
+
+	def test_failure
+		resolver = ADNS::Resolver.new(:hosts => nil, :state => ADNS::State.new2(SILENT))
+		e = assert_raises(ADNS::Resolver::Failure) { resolver.getaddress('invalid..example') }
+		assert_equal ADNS::Status::QueryDomainInvalid, e.status
+		e = assert_raises(SocketError) { resolver.socket_addresses('invalid..example') }
+		assert_equal 'getaddrinfo: Name or service not known', e.message
+	end
+
+	def test_socket_errors
+		{ADNS::Status::RcodeServFail => 'Temporary failure in name resolution',
+		 ADNS::Status::AllServFail   => 'Temporary failure in name resolution',
+		 ADNS::Status::RcodeRefused  => 'Non-recoverable failure in name resolution'}.each {|status, message|
+			resolver = Failing.new(ADNS::Resolver::Failure.new('example.com', status))
+			e = assert_raises(SocketError) { resolver.socket_addresses('example.com') }
+			assert_equal "getaddrinfo: #{message}", e.message
+		}
+	end
+
+	def test_uninstall_restores_resolvers
+		saved = Resolv::DefaultResolver.instance_variable_get(:@resolvers)
+		ADNS::Resolver.install(:hosts => nil)
+		ADNS::Resolver.install(:hosts => nil)
+		refute_same saved, Resolv::DefaultResolver.instance_variable_get(:@resolvers)
+		ADNS::Resolver.uninstall
+		assert_same saved, Resolv::DefaultResolver.instance_variable_get(:@resolvers)
+		assert_nil ADNS::Resolver.installed
+	ensure
+		ADNS::Resolver.uninstall
+	end
+end
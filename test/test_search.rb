@@ -0,0 +1,67 @@
+#
+# This file is part of adns-ruby library.
+#
+require 'helper'
+
+class TestSearch < Minitest::Test
+	include ADNSTest
+
+	A = Resolv::DNS::Resource::IN::A
+	SEARCH = "search a.example b.example\noptions ndots:1\n"
+
+	def teardown
+		@server.close if @server
+	end
+
+	def state(zone)
+		@server = dns_server(zone)
+		ADNS::State.new2(@server.config + SEARCH)
+	end
+
+	def test_candidates
+		s = ADNS::State.new2(SILENT + SEARCH)
+		assert_equal ['host.a.example', 'host.b.example', 'host'], s.search_candidates('host')
+		assert_equal ['www.host', 'www.host.a.example', 'www.host.b.example'], s.search_candidates('www.host')
+		assert_equal ['host.'], s.search_candidates('host.')
+	end
+
+	def test_search_order_wins
+		s = state('svc.b.example' => [A.new('10.0.0.2')], 'svc' => [A.new('10.0.0.9')])
+		q = s.submit_search('svc', ADNS::RR::A)
+		answer = q.wait
+		assert_equal ADNS::Status::OK, answer[:status]
+		assert_equal ['10.0.0.2'], answer[:answer]
+		assert_same answer, q.check
+	end
+
+	def test_losers_cancelled
+		s = state('svc.a.example' => [A.new('10.0.0.1')], 'svc' => [A.new('10.0.0.9')])
+		q = s.submit_search('svc', ADNS::RR::A)
+		assert_equal ['10.0.0.1'], q.wait[:answer]
+		q.instance_variable_get(:@queries)[1..-1].each {|loser|
+			assert_raises(ADNS::QueryError) { loser.check }
+		}
+	end
+
+	def test_not_completed
+		s = state('svc.b.example' => [A.new('10.0.0.2')])
+		q = s.submit_search('svc', ADNS::RR::A)
+		plain = s.submit('svc.b.example', ADNS::RR::A)
+		found = []
+		assert eventually { (found += s.completed_queries(0.1)).include?(plain) }
+		assert_equal [plain], found
+		assert_equal ['10.0.0.2'], q.wait[:answer]
+	end
+
+	def test_submit_failure_cancels
+		s = ADNS::State.new2(SILENT + SEARCH)
+		submitted = []
+		s.define_singleton_method(:submit_detached) {|*args|
+			raise ADNS::Error, 'no more' if submitted.size == 1
+			submitted << super(*args)
+			submitted.last
+		}
+		assert_raises(ADNS::Error) { s.submit_search('host', ADNS::RR::A) }
+		assert_raises(ADNS::QueryError) { submitted.first.check }
+	end
+end
@@ -0,0 +1,64 @@
+#
+# This file is part of adns-ruby library.
+#
+require 'helper'
+require 'tmpdir'
+
+class TestSharedCache < Minitest::Test
+	include ADNSTest
+
+	IN = Resolv::DNS::Resource::IN
+	ZONE = {
+		'host.example' => [IN::A.new('10.0.0.1'), IN::TXT.new('ab', 'cd')],
+		'_http._tcp.example' => [IN::SRV.new(10, 5, 8080, Resolv::DNS::Name.create('host.example.'))],
+	}
+
+	def setup
+		@dir = Dir.mktmpdir
+		@path = File.join(@dir, 'adns.cache')
+	end
+
+	def teardown
+		@server.close if @server
+		FileUtils.remove_entry(@dir)
+	end
+
+	def cached_state(cache)
+		state = ADNS::State.new2(@server.config)
+		state.shared_cache = cache
+		state
+	end
+
+	def test_answers_round_trip
+		@server = dns_server(ZONE)
+		[['host.example', ADNS::RR::A], ['host.example', ADNS::RR::TXT],
+		 ['_http._tcp.example', ADNS::RR::SRV], ['nxdomain.example', ADNS::RR::A]].each {|domain, type|
+			cache = ADNS::SharedCache.new
+			answer = cached_state(cache).submit(domain, type).wait(5)
+			assert_equal 1, cache.stats[:stores]
+			assert_equal answer, cached_state(cache).submit(domain, type).check
+			assert_equal 1, cache.stats[:hits]
+		}
+	end
+
+	def test_rejects_foreign_or_writable_file
+		File.write(@path, '')
+		File.chmod(0666, @path)
+		assert_raises(ADNS::Error) { ADNS::SharedCache.new(@path) }
+		File.chmod(0600, @path)
+		assert_equal @path, ADNS::SharedCache.new(@path).path
+	end
+
+	def test_garbage_is_a_miss
+		@server = dns_server(ZONE)
+		cache = ADNS::SharedCache.new(@path)
+		cached_state(cache).submit('host.example', ADNS::RR::A).wait(5)
+		data = File.binread(@path)
+		File.open(@path, 'r+b') {|f|
+			f.seek(data.index('host.example') + 'host.example'.size)
+			f.write('M') # not a tag shm_decode knows, Marshal's for one
+		}
+		assert_nil cached_state(cache).submit('host.example', ADNS::RR::A).check_nonblock
+		assert_equal [0, 2], cache.stats.values_at(:hits, :misses) # the first submit missed too
+	end
+end
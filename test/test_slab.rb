@@ -0,0 +1,65 @@
+#
+# This file is part of adns-ruby library.
+#
+require 'helper'
+
+class TestSlab < Minitest::Test
+	include ADNSTest
+
+	A = Resolv::DNS::Resource::IN::A
+
+	def teardown
+		@server.close if @server
+	end
+
+	# Submit and cancel <count> queries, leaving nothing that references them.
+	def submit_cancelled(state, count)
+		count.times { state.submit('slab.example', ADNS::RR::A).cancel }
+		nil
+	end
+
+	def test_stats
+		state = ADNS::State.new2(SILENT)
+		assert_equal({:chunk_slots => 64, :chunks => 0, :slots => 0, :used => 0, :free => 0, :peak => 0},
+		             state.slab_stats)
+		queries = 3.times.map { state.submit('slab.example', ADNS::RR::A) }
+		stats = state.slab_stats
+		assert_equal [1, 64, 3, 61, 3], stats.values_at(:chunks, :slots, :used, :free, :peak)
+		queries.each(&:cancel)
+	end
+
+	def test_freed_slots_reused
+		state = ADNS::State.new2(SILENT)
+		submit_cancelled(state, 64)
+		assert_equal 1, state.slab_stats[:chunks]
+		GC.start
+		used = state.slab_stats[:used]
+		assert_operator used, :<, 64 # released by Query#free
+		queries = (64 - used).times.map { state.submit('slab.example', ADNS::RR::A) }
+		stats = state.slab_stats
+		assert_equal [1, 64, 64], stats.values_at(:chunks, :used, :peak)
+		queries.each(&:cancel)
+	end
+
+	def test_stale_after_cancel
+		[ADNS::State.new2(SILENT), io_thread_state].each {|state|
+			query = state.submit('slab.example', ADNS::RR::A)
+			query.cancel
+			assert_raises(ADNS::QueryError) { query.cancel }
+			assert_raises(ADNS::QueryError) { query.check }
+		}
+	end
+
+	def test_stale_after_collect
+		@server = dns_server({'slab.example' => [A.new('10.0.0.1')]})
+		[ADNS::State.new2(@server.config), io_thread_state(ADNS::State.new2(@server.config))].each {|state|
+			query = state.submit('slab.example', ADNS::RR::A)
+			assert_equal ['10.0.0.1'], query.wait(5)[:answer]
+			assert_raises(ADNS::QueryError) { query.cancel }
+			other = state.submit('slab.example', ADNS::RR::A)
+			found = []
+			assert eventually { (found += state.completed_queries(0.1)).include?(other) }
+			assert_equal [other], found # the collected one is not answered again
+		}
+	end
+end
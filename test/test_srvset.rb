@@ -0,0 +1,59 @@
+#
+# This file is part of adns-ruby library.
+#
+require 'helper'
+
+class TestSRVSet < Minitest::Test
+	def srv(host, priority, weight, port = 80)
+		{:host => host, :priority => priority, :weight => weight, :port => port}
+	end
+
+	def picks(set, count = 4000)
+		tally = Hash.new(0)
+		count.times { tally[set.pick[:host]] += 1 }
+		tally
+	end
+
+	def test_weighted_distribution
+		set = ADNS::SRVSet.new([srv('light', 10, 1), srv('heavy', 10, 3), srv('backup', 20, 100)])
+		tally = picks(set)
+		assert_equal ['heavy', 'light'], tally.keys.sort
+		assert_in_delta 0.75, tally['heavy'] / 4000.0, 0.05
+	end
+
+	def test_zero_weight
+		set = ADNS::SRVSet.new([srv('zero', 10, 0), srv('some', 10, 5)])
+		assert_operator picks(set)['zero'], :<, 40 # 1 in 1281
+		set = ADNS::SRVSet.new([srv('a', 10, 0), srv('b', 10, 0)])
+		tally = picks(set)
+		assert_in_delta 0.5, tally['a'] / 4000.0, 0.05
+	end
+
+	def test_mark_down_falls_back
+		set = ADNS::SRVSet.new(:answer => [srv('b', 20, 1), srv('a1', 10, 1), srv('a2', 10, 1)])
+		assert_equal ['a1', 'a2', 'b'], set.endpoints.map {|e| e[:host] }
+		set.mark_down(set.endpoints[0]).mark_down(1)
+		assert set.down?(set.endpoints[0])
+		assert_equal 'b', set.pick[:host]
+		set.mark_down(set.pick)
+		assert_nil set.pick
+		set.mark_up(set.endpoints[1])
+		assert_equal 'a2', set.pick[:host]
+	end
+
+	def test_unavailable_target
+		set = ADNS::SRVSet.new([srv('.', 10, 1), srv('', 10, 1), srv('a', 20, 1)])
+		assert_equal 1, set.size
+		assert_equal 'a', set.pick[:host]
+		assert_nil ADNS::SRVSet.new([srv('.', 0, 0)]).pick
+	end
+
+	def test_foreign_endpoint
+		set = ADNS::SRVSet.new([srv('a', 10, 1)])
+		other = ADNS::SRVSet.new([srv('b', 10, 1)])
+		assert_raises(ArgumentError) { set.mark_down(other.pick) }
+		assert_raises(ArgumentError) { set.down?(srv('a', 10, 1).merge(:index => 0)) }
+		assert_raises(IndexError) { set.mark_down(1) }
+		refute set.down?(0)
+	end
+end
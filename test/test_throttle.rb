@@ -0,0 +1,64 @@
+#
+# This file is part of adns-ruby library.
+#
+require 'helper'
+
+class TestThrottle < Minitest::Test
+	include ADNSTest
+
+	A = Resolv::DNS::Resource::IN::A
+
+	def setup
+		@server = dns_server({'rate.example' => [A.new('10.0.0.1')]})
+	end
+
+	def teardown
+		@server.close if @server
+	end
+
+	# Answer times of three submits at 5 per second with a burst of one, and the stats
+	# once the io thread, if any, has queued them.
+	def throttled(state)
+		state.set_rate_limit(5, 1)
+		start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+		queries = 3.times.map { state.submit('rate.example', ADNS::RR::A) }
+		queued = nil
+		assert eventually(0.1) { (queued = state.throttle_stats)[:queued] == 2 }
+		times = queries.map {|q|
+			assert_equal ['10.0.0.1'], q.wait(5)[:answer]
+			Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+		}
+		[times, queued]
+	end
+
+	def check(state)
+		times, queued = throttled(state)
+		assert_in_delta 5.0, queued[:qps], 0.001
+		assert_in_delta 1.0, queued[:burst], 0.001
+		assert_operator queued[:tokens], :<, 1.0
+		assert_operator times[0], :<, 0.15 # the burst
+		assert_in_delta 0.2, times[1], 0.1
+		assert_in_delta 0.4, times[2], 0.1
+		stats = state.throttle_stats
+		assert_equal 0, stats[:queued]
+		assert_equal 2, stats[:throttled]
+		assert_in_delta 0.6, stats[:throttled_time], 0.15 # 0.2 + 0.4
+	end
+
+	def test_direct
+		check(ADNS::State.new2(@server.config))
+	end
+
+	def test_io_thread
+		check(io_thread_state(ADNS::State.new2(@server.config)))
+	end
+
+	def test_lifted
+		state = ADNS::State.new2(@server.config)
+		state.set_rate_limit(5, 1)
+		state.set_rate_limit(nil)
+		t = elapsed { 3.times.map { state.submit('rate.example', ADNS::RR::A) }.each {|q| q.wait(5) } }
+		assert_operator t, :<, 0.15
+		assert_equal 0, state.throttle_stats[:throttled]
+	end
+end
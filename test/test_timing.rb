@@ -0,0 +1,42 @@
+#
+# This file is part of adns-ruby library.
+#
+require 'helper'
+
+class TestTiming < Minitest::Test
+	include ADNSTest
+
+	# adns answers a syntactically invalid domain locally, without a round trip.
+	INVALID = 'invalid..example'
+
+	def collect(state, want)
+		list = []
+		deadline = Time.now + 5
+		list.concat(state.completed_queries(0.05)) while list.size < want && Time.now < deadline
+		list
+	end
+
+	def test_phases
+		state = ADNS::State.new2(SILENT)
+		reports = []
+		state.timing_hook = proc {|query, timings| reports << timings }
+		query = state.submit(INVALID, ADNS::RR::A)
+		assert_equal [query], collect(state, 1)
+		assert_equal 1, reports.size
+		assert_operator reports[0][:built], :>=, reports[0][:answered]
+	end
+
+	def test_raising_hook_loses_no_query
+		state = ADNS::State.new2(SILENT)
+		calls = 0
+		state.timing_hook = proc { calls += 1; raise 'hook failed' }
+		queries = 3.times.map { state.submit(INVALID, ADNS::RR::A) }
+		sleep 0.05
+		error = assert_raises(RuntimeError) { state.completed_queries(0.05) }
+		assert_equal 'hook failed', error.message
+		assert_equal 3, calls # every collected query was still reported
+		state.timing_hook = nil
+		assert_equal queries.sort_by(&:object_id), state.completed_queries.sort_by(&:object_id)
+		queries.each {|q| assert_equal ADNS::Status::QueryDomainInvalid, q.check[:status] }
+	end
+end
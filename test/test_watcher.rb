@@ -0,0 +1,77 @@
+#
+# This file is part of adns-ruby library.
+#
+require 'helper'
+
+class TestWatcher < Minitest::Test
+	include ADNSTest
+
+	A = Resolv::DNS::Resource::IN::A
+	ZONE = {'svc.example' => [A.new('10.0.0.1')], 'db.example' => [A.new('10.0.0.2')]}
+
+	def teardown
+		@watcher.stop if @watcher
+		@server.close if @server
+	end
+
+	def watcher(server_opts = {}, opts = {})
+		@server = dns_server(ZONE, **server_opts)
+		@watcher = ADNS::State.new2(@server.config).watcher(opts)
+	end
+
+	def test_watch
+		w = watcher
+		w.watch('svc.example', ADNS::RR::A)
+		assert_equal ['svc.example'], w.domains # before any answer
+		assert eventually { w['svc.example'] }
+		assert_equal ['10.0.0.1'], w['svc.example'][:answer]
+		assert_equal w['svc.example'], w['svc.example', ADNS::RR::A]
+		refute w.stale?('svc.example')
+	end
+
+	def test_refresh
+		w = watcher({:ttl => 1}, :min_interval => 0.2)
+		w.watch('svc.example', ADNS::RR::A)
+		assert eventually { w['svc.example'] }
+		expires = w['svc.example'][:expires]
+		assert eventually { w['svc.example'][:expires] > expires }
+	end
+
+	def test_unwatch
+		w = watcher
+		w.watch('svc.example', ADNS::RR::A).watch('db.example', ADNS::RR::A)
+		assert eventually { w['svc.example'] && w['db.example'] }
+		w.unwatch('svc.example')
+		assert_nil w['svc.example']
+		assert_equal ['db.example'], w.domains
+	end
+
+	def test_stale
+		w = watcher({:ttl => 1}, :min_interval => 0.2, :retry => 0.1)
+		w.watch('svc.example', ADNS::RR::A)
+		assert eventually { w['svc.example'] }
+		@server.close
+		@server = dns_server(ZONE, :rcode => Resolv::DNS::RCode::ServFail)
+		assert eventually { w.stale?('svc.example') }
+		assert_equal ['10.0.0.1'], w['svc.example'][:answer] # the last good answer
+	end
+
+	def test_stop_while_refresh_out
+		state = ADNS::State.new2(SILENT)
+		@watcher = w = state.watcher
+		w.watch('svc.example', ADNS::RR::A)
+		sleep 0.1 # the thread is waiting for an answer that never comes
+		assert_operator elapsed { state.finish }, :<, 1.0
+		assert_raises(ADNS::Error) { state.submit('svc.example', ADNS::RR::A) }
+	end
+
+	def test_unexpected_error_kept
+		w = watcher
+		w.state.timing_hook = lambda {|q, timings| raise 'hook failed' }
+		w.watch('svc.example', ADNS::RR::A)
+		assert eventually { w.last_error }
+		assert_equal 'hook failed', w.last_error.message
+		w.state.timing_hook = nil
+		assert eventually { w['svc.example'] } # still running
+	end
+end